@@ -0,0 +1,86 @@
+#ifndef _BENCH_H
+#define _BENCH_H
+
+#include <time.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+
+// 源码目录，用来查找client/video-data下的样例切片
+#ifndef HLS_SOURCE_DIR
+#define HLS_SOURCE_DIR "."
+#endif
+
+// 单调时钟，纳秒
+static inline uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// 当前线程消耗的CPU时间（用户态 + 内核态），纳秒
+static inline uint64_t thread_cpu_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// 整个进程消耗的CPU时间，纳秒
+static inline uint64_t process_cpu_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// 一条测试结果，以json的形式输出到标准输出，每行一条，方便不同版本之间对比
+class BenchResult
+{
+public:
+    BenchResult(const char *bench, const char *name)
+    {
+        m_body = "{\"bench\":\"";
+        m_body += bench;
+        m_body += "\",\"case\":\"";
+        m_body += name;
+        m_body += '"';
+    }
+
+    BenchResult &add(const char *key, double val)
+    {
+        char num[64];
+        // 整数原样输出，避免字节数之类的大数丢失精度
+        if (val == (double)(long long)val && val < 1e15 && val > -1e15)
+            snprintf(num, sizeof(num), "%lld", (long long)val);
+        else
+            snprintf(num, sizeof(num), "%.6g", val);
+        m_body += ",\"";
+        m_body += key;
+        m_body += "\":";
+        m_body += num;
+        return *this;
+    }
+
+    BenchResult &add(const char *key, const char *val)
+    {
+        m_body += ",\"";
+        m_body += key;
+        m_body += "\":\"";
+        m_body += val;
+        m_body += '"';
+        return *this;
+    }
+
+    void print()
+    {
+        printf("%s}\n", m_body.c_str());
+        fflush(stdout);
+    }
+
+private:
+    std::string m_body;
+};
+
+#endif
@@ -0,0 +1,90 @@
+// TS转CMAF速度测试：把 client/video-data 下的所有样例切片重新封装成fMP4，
+// 统计转换速度，以及拉流时每个切片少发送的字节数（初始化段每个播放器只下载一次，不计入）
+//
+// 用法: bench_cmaf [轮数] [切片目录]
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include "bench.h"
+#include "../server/cmafRepackager.h"
+
+int main(int argc, char *argv[])
+{
+    int rounds = argc > 1 ? atoi(argv[1]) : 5;
+    std::string dir = argc > 2 ? argv[2] : std::string(HLS_SOURCE_DIR) + "/client/video-data";
+
+    // 先把所有切片读到内存里并扫描好，只测试转换本身
+    std::vector<std::string> segments;
+    DIR *d = opendir(dir.c_str());
+    if (d == NULL)
+    {
+        perror("opendir");
+        return 1;
+    }
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL)
+    {
+        std::string name = ent->d_name;
+        if (name.size() < 3 || name.compare(name.size() - 3, 3, ".ts") != 0)
+            continue;
+        std::ifstream in(dir + "/" + name, std::ios::binary);
+        std::stringstream ss;
+        ss << in.rdbuf();
+        segments.push_back(ss.str());
+    }
+    closedir(d);
+    if (segments.empty())
+    {
+        fprintf(stderr, "no segments in %s\n", dir.c_str());
+        return 1;
+    }
+
+    std::vector<TsIndex> indexes;
+    TsIndexer indexer;
+    for (const std::string &seg : segments)
+    {
+        indexer.reset();
+        indexer.feed(reinterpret_cast<const uint8_t *>(seg.data()), seg.size());
+        indexes.push_back(indexer.index());
+    }
+
+    CmafRepackager repackager;
+    CmafSegment out;
+    size_t ts_bytes = 0, fmp4_bytes = 0, init_bytes = 0, failed = 0;
+    uint64_t t0 = now_ns();
+    for (int r = 0; r < rounds; r++)
+    {
+        ts_bytes = fmp4_bytes = failed = 0;
+        for (size_t i = 0; i < segments.size(); i++)
+        {
+            const std::string &seg = segments[i];
+            if (repackager.repackage(reinterpret_cast<const uint8_t *>(seg.data()), seg.size(), indexes[i], i + 1,
+                                     out) < 0)
+            {
+                failed++;
+                continue;
+            }
+            ts_bytes += seg.size();
+            fmp4_bytes += out.fragment.size();
+            init_bytes = out.init.size();
+        }
+    }
+    uint64_t elapsed = now_ns() - t0;
+
+    double mb = (double)ts_bytes * rounds / 1e6;
+    BenchResult("cmaf", "repackage")
+        .add("segments", (double)segments.size())
+        .add("failed", (double)failed)
+        .add("ts_bytes", (double)ts_bytes)
+        .add("fmp4_bytes", (double)fmp4_bytes)
+        .add("init_bytes", (double)init_bytes)
+        .add("egress_saved_pct", ts_bytes > 0 ? 100.0 * (ts_bytes - fmp4_bytes) / ts_bytes : 0)
+        .add("mb_per_sec", mb / (elapsed / 1e9))
+        .add("ms_per_segment", elapsed / 1e6 / rounds / segments.size())
+        .print();
+    return 0;
+}
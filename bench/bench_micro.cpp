@@ -0,0 +1,253 @@
+// 热点路径的微基准测试：请求解析、url参数和表单参数解析、响应头生成、线程池任务调度延迟
+// 输入是按hls.js和推流端实际发出的请求构造的，放在内存中或者经过socketpair读取。
+// 每个测试先确定一轮的迭代次数，使一轮至少运行SAMPLE_NS，再重复SAMPLES轮取中位数，
+// 结果每行一个json对象，方便不同版本之间对比。
+//
+// 用法: bench [测试名前缀]
+#include <sys/socket.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <vector>
+#include "bench.h"
+#include "../server/httpHeader.h"
+#include "../server/response.h"
+#include "../server/threadPool.h"
+
+#define SAMPLES 15             // 每个测试重复的轮数
+#define SAMPLE_NS 20000000ull  // 每轮至少运行的时间，20ms
+#define DISPATCH_TASKS 20000   // 线程池调度延迟测试的任务数
+
+// hls.js刷新低延迟播放列表的请求
+static const char PLAYLIST_GET[] =
+    "GET /video/lyj/main.m3u8?_HLS_msn=128&_HLS_part=2&_HLS_skip=YES HTTP/1.1\r\n"
+    "Host: 127.0.0.1:8080\r\n"
+    "Connection: keep-alive\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36\r\n"
+    "Accept: */*\r\n"
+    "Origin: http://127.0.0.1:8080\r\n"
+    "Referer: http://127.0.0.1:8080/\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: zh-CN,zh;q=0.9,en;q=0.8\r\n"
+    "\r\n";
+
+// 播放器下载切片，带Range
+static const char SEGMENT_GET[] =
+    "GET /video/lyj/WLWZ128.ts HTTP/1.1\r\n"
+    "Host: 127.0.0.1:8080\r\n"
+    "Connection: keep-alive\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36\r\n"
+    "Accept: */*\r\n"
+    "Range: bytes=0-1048575\r\n"
+    "Referer: http://127.0.0.1:8080/\r\n"
+    "Accept-Encoding: identity\r\n"
+    "\r\n";
+
+// 推流端上传切片的请求头，参数在url中，请求体由调用者流式处理，这里只解析请求头
+static const char UPLOAD_POST[] =
+    "POST /upload?username=lyj&filename=WLWZ128.ts&rendition=720p&resolution=1280x720 HTTP/1.1\r\n"
+    "Content-Type: video/mp2t\r\n"
+    "Host: 127.0.0.1:8080\r\n"
+    "Content-Length: 2457600\r\n"
+    "\r\n";
+
+// 表单形式提交参数
+static const char FORM_POST[] =
+    "POST /post.cgi HTTP/1.1\r\n"
+    "Host: 127.0.0.1:8080\r\n"
+    "Content-Type: application/x-www-form-urlencoded\r\n"
+    "Content-Length: 71\r\n"
+    "\r\n"
+    "username=lyj&filename=WLWZ128.ts&rendition=720p&resolution=1280x720&x=1";
+
+// 防止编译器把测试的代码优化掉
+static volatile size_t sink;
+
+// 运行fn，输出每次调用的纳秒数的中位数、最小值和最大值
+template <class Fn>
+static void measure(const char *filter, const char *name, size_t bytes, Fn fn)
+{
+    if (strncmp(name, filter, strlen(filter)) != 0)
+        return;
+    // 预热，同时确定一轮的迭代次数
+    size_t iters = 1;
+    while (true)
+    {
+        uint64_t t0 = now_ns();
+        for (size_t i = 0; i < iters; i++)
+            fn();
+        if (now_ns() - t0 >= SAMPLE_NS)
+            break;
+        iters *= 2;
+    }
+    std::vector<double> ns;
+    for (int s = 0; s < SAMPLES; s++)
+    {
+        uint64_t t0 = now_ns();
+        for (size_t i = 0; i < iters; i++)
+            fn();
+        ns.push_back((double)(now_ns() - t0) / iters);
+    }
+    std::sort(ns.begin(), ns.end());
+    double median = ns[ns.size() / 2];
+    BenchResult r("micro", name);
+    r.add("ns_per_op", median).add("min_ns", ns.front()).add("max_ns", ns.back()).add("ops_per_sec", 1e9 / median);
+    if (bytes > 0)
+        r.add("mb_per_sec", bytes / median * 1e3);
+    r.print();
+}
+
+// 完整的请求一次性在缓冲区中
+static void bench_parse(const char *filter, const char *name, const char *req)
+{
+    size_t len = strlen(req);
+    httpHeader http;
+    // 输入本身有错时测到的只是出错路径
+    if (http.parse(req, len) == PARSE_ERROR)
+    {
+        fprintf(stderr, "%s: 请求格式错误\n", name);
+        return;
+    }
+    measure(filter, name, len, [&] {
+        http.reset();
+        sink += http.parse(req, len) + http.path().size();
+    });
+}
+
+// 请求分几次读到，每次读到新数据都用整个缓冲区再调用一次parse
+static void bench_parse_incremental(const char *filter)
+{
+    size_t len = strlen(PLAYLIST_GET);
+    const size_t cuts[] = {40, 150, 300, len};
+    httpHeader http;
+    measure(filter, "parse/playlist_get_4_reads", len, [&] {
+        http.reset();
+        for (size_t cut : cuts)
+            sink += http.parse(PLAYLIST_GET, cut);
+    });
+}
+
+// 和服务端一样从socket读出请求再解析，包括send和recv两次系统调用
+static void bench_parse_socketpair(const char *filter)
+{
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+    {
+        perror("socketpair");
+        return;
+    }
+    size_t len = strlen(PLAYLIST_GET);
+    char buf[4096];
+    httpHeader http;
+    measure(filter, "parse/playlist_get_socketpair", len, [&] {
+        if (send(sv[0], PLAYLIST_GET, len, 0) != (ssize_t)len)
+            abort();
+        size_t got = 0;
+        while (got < len)
+        {
+            ssize_t n = recv(sv[1], buf + got, sizeof(buf) - got, 0);
+            if (n <= 0)
+                abort();
+            got += n;
+        }
+        http.reset();
+        sink += http.parse(buf, got);
+    });
+    close(sv[0]);
+    close(sv[1]);
+}
+
+// 表单请求：解析后再解析请求体中的参数
+static void bench_form(const char *filter)
+{
+    size_t len = strlen(FORM_POST);
+    httpHeader http;
+    measure(filter, "parse/form_urlencoded", len, [&] {
+        http.reset();
+        sink += http.parse(FORM_POST, len);
+        http.handle_pos_x_www_form_urlencoded();
+        sink += http.param("resolution").size();
+    });
+}
+
+// 切片响应头：原来用键值对生成，现在用ResponseBuilder直接写入连接的缓冲区
+static void bench_headers(const char *filter)
+{
+    std::string out;
+    measure(filter, "header/makeheader_200", 0, [&] {
+        std::unordered_map<std::string, std::string> params = httpHeader::params_200;
+        params["Content-Type"] = "video/mp2t";
+        params["Content-Length"] = std::to_string(2457600);
+        params["Connection"] = "keep-alive";
+        params["Keep-Alive"] = "timeout=60, max=999";
+        sink += httpHeader::makeheader(params, out);
+    });
+    measure(filter, "header/builder_200", 0, [&] {
+        out.clear();
+        ResponseBuilder rb(out);
+        rb.status(200).content_type("/video/lyj/WLWZ128.ts").content_length(2457600).connection(true, 60, 999);
+        rb.end();
+        sink += out.size();
+    });
+}
+
+// 线程池调度延迟：空闲的线程池中每次提交一个任务，记录从addTask到任务开始执行的时间
+static std::atomic<uint64_t> started(0);
+
+static void ping(void *arg)
+{
+    (void)arg;
+    started.store(now_ns(), std::memory_order_release);
+}
+
+static void bench_dispatch(const char *filter, int threads)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "threadpool/dispatch_%d", threads);
+    if (strncmp(name, filter, strlen(filter)) != 0)
+        return;
+    ThreadPool pool(threads, threads);
+    std::vector<uint64_t> latency;
+    latency.reserve(DISPATCH_TASKS);
+    for (int i = 0; i < DISPATCH_TASKS; i++)
+    {
+        started.store(0, std::memory_order_relaxed);
+        uint64_t t0 = now_ns();
+        pool.addTask(ping, nullptr);
+        uint64_t t1;
+        while ((t1 = started.load(std::memory_order_acquire)) == 0)
+            ;
+        latency.push_back(t1 - t0);
+        // 让工作线程回到等待状态，每次测的都是唤醒空闲线程的延迟
+        usleep(50);
+    }
+    std::sort(latency.begin(), latency.end());
+    size_t n = latency.size();
+    BenchResult("micro", name)
+        .add("threads", threads)
+        .add("tasks", (double)n)
+        .add("p50_us", latency[n / 2] / 1000.0)
+        .add("p99_us", latency[n * 99 / 100] / 1000.0)
+        .add("p999_us", latency[n * 999 / 1000] / 1000.0)
+        .print();
+}
+
+int main(int argc, char *argv[])
+{
+    const char *filter = argc > 1 ? argv[1] : "";
+    bench_parse(filter, "parse/playlist_get", PLAYLIST_GET);
+    bench_parse(filter, "parse/segment_get", SEGMENT_GET);
+    bench_parse(filter, "parse/upload_query", UPLOAD_POST);
+    bench_parse_incremental(filter);
+    bench_parse_socketpair(filter);
+    bench_form(filter);
+    bench_headers(filter);
+    bench_dispatch(filter, 1);
+    bench_dispatch(filter, 4);
+    return 0;
+}
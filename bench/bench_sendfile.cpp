@@ -0,0 +1,165 @@
+// 切片发送开销测试：对比原来的 fread+send 拷贝方式和 sendfile 零拷贝方式
+// 每发送1GB数据，发送线程消耗的CPU时间
+//
+// 用法: bench_sendfile [轮数] [切片文件...]
+// 默认发送 client/video-data 下的前10个切片
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include <string>
+#include "bench.h"
+#include "../server/eventLoop.h"
+
+struct SegmentFile
+{
+    int fd;
+    off_t size;
+    std::string header;
+};
+
+// 接收端线程，读取并丢弃所有数据
+static void *receiver(void *arg)
+{
+    int listen_fd = *static_cast<int *>(arg);
+    int sock = accept(listen_fd, NULL, NULL);
+    static char buf[1 << 18];
+    while (recv(sock, buf, sizeof(buf), 0) > 0)
+        ;
+    close(sock);
+    return nullptr;
+}
+
+// 发送一轮所有的切片，返回发送的字节数
+static size_t send_round(int sock, std::vector<SegmentFile> &files, const char *mode, char *buf, size_t bufsize)
+{
+    size_t total = 0;
+    bool use_sendfile = strcmp(mode, "sendfile") == 0;
+    for (SegmentFile &f : files)
+    {
+        // 原来的实现响应头单独发送一个包，sendfile方式和文件内容合并
+        send(sock, f.header.data(), f.header.size(), MSG_NOSIGNAL | (use_sendfile ? MSG_MORE : 0));
+        off_t pos = 0;
+        while (pos < f.size)
+        {
+            if (EventLoop::send_file(sock, f.fd, &pos, f.size, use_sendfile, buf, bufsize) < 0)
+            {
+                perror("send_file");
+                exit(EXIT_FAILURE);
+            }
+        }
+        total += f.header.size() + f.size;
+    }
+    return total;
+}
+
+int main(int argc, char *argv[])
+{
+    int rounds = argc > 1 ? atoi(argv[1]) : 20;
+    std::vector<std::string> paths;
+    for (int i = 2; i < argc; i++)
+        paths.push_back(argv[i]);
+    if (paths.empty())
+    {
+        for (int i = 0; i < 10; i++)
+            paths.push_back(std::string(HLS_SOURCE_DIR) + "/client/video-data/WLWZ" + std::to_string(i) + ".ts");
+    }
+
+    std::vector<SegmentFile> files;
+    for (const std::string &path : paths)
+    {
+        struct stat st;
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0 || fstat(fd, &st) < 0)
+            continue;
+        std::unordered_map<std::string, std::string> params = {
+            {"http_version", HTTP_VERSION},
+            {"status", "200"},
+            {"Server", SERVER_NAME},
+            {"Content-Type", "video/ts"},
+            {"Content-Length", std::to_string(st.st_size)}};
+        SegmentFile f;
+        f.fd = fd;
+        f.size = st.st_size;
+        httpHeader::makeheader(params, f.header);
+        files.push_back(f);
+    }
+    if (files.empty())
+    {
+        fprintf(stderr, "no segment files found\n");
+        return 1;
+    }
+
+    // 预热页缓存，避免第一种方式承担磁盘读取的开销
+    static char buf[READ_CHUNK];
+    for (SegmentFile &f : files)
+    {
+        for (off_t pos = 0; pos < f.size; pos += sizeof(buf))
+            pread(f.fd, buf, sizeof(buf), pos);
+    }
+
+    // 依次测试: 原来的8KB拷贝、事件循环的拷贝回退路径、sendfile
+    struct
+    {
+        const char *name;
+        const char *mode;
+        size_t bufsize;
+    } cases[] = {
+        {"copy_8k", "copy", BUFSIZE},
+        {"copy_16k_fallback", "copy", READ_CHUNK},
+        {"sendfile", "sendfile", 0},
+    };
+
+    for (auto &c : cases)
+    {
+        int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = 0;
+        socklen_t addrlen = sizeof(addr);
+        bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr));
+        getsockname(listen_fd, (struct sockaddr *)&addr, &addrlen);
+        listen(listen_fd, 1);
+
+        pthread_t tid;
+        pthread_create(&tid, NULL, receiver, &listen_fd);
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        {
+            perror("connect");
+            return 1;
+        }
+
+        size_t bytes = 0;
+        uint64_t cpu0 = thread_cpu_ns();
+        uint64_t t0 = now_ns();
+        for (int r = 0; r < rounds; r++)
+            bytes += send_round(sock, files, c.mode, buf, c.bufsize);
+        uint64_t wall = now_ns() - t0;
+        uint64_t cpu = thread_cpu_ns() - cpu0;
+
+        close(sock);
+        pthread_join(tid, NULL);
+        close(listen_fd);
+
+        double gb = bytes / 1e9;
+        BenchResult("sendfile", c.name)
+            .add("bytes", bytes)
+            .add("segments", (double)rounds * files.size())
+            .add("cpu_sec_per_gb", cpu / 1e9 / gb)
+            .add("gb_per_sec", gb / (wall / 1e9))
+            .print();
+    }
+
+    for (SegmentFile &f : files)
+        close(f.fd);
+    return 0;
+}
@@ -0,0 +1,194 @@
+// 线程池调度测试：不同线程数下每秒能调度的任务数，以及任务从提交到开始执行的延迟
+// 对比原来的单队列线程池（两把锁）和工作窃取线程池
+//
+// 用法: bench_threadpool [任务数] [每个任务的工作量(循环次数)]
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <queue>
+#include <vector>
+#include "bench.h"
+#include "../server/threadPool.h"
+
+// 原来的线程池：所有线程在同一个锁和条件变量上取任务
+class LegacyPool
+{
+public:
+    explicit LegacyPool(int n) : m_shutdown(false)
+    {
+        pthread_mutex_init(&m_lock, NULL);
+        pthread_cond_init(&m_notEmpty, NULL);
+        m_threads.resize(n);
+        for (int i = 0; i < n; i++)
+            pthread_create(&m_threads[i], NULL, worker, this);
+    }
+    ~LegacyPool()
+    {
+        pthread_mutex_lock(&m_lock);
+        m_shutdown = true;
+        pthread_cond_broadcast(&m_notEmpty);
+        pthread_mutex_unlock(&m_lock);
+        for (pthread_t t : m_threads)
+            pthread_join(t, NULL);
+        pthread_mutex_destroy(&m_lock);
+        pthread_cond_destroy(&m_notEmpty);
+    }
+    void addTask(callback func, void *arg)
+    {
+        m_queue.addTask(func, arg);
+        pthread_mutex_lock(&m_lock);
+        pthread_cond_signal(&m_notEmpty);
+        pthread_mutex_unlock(&m_lock);
+    }
+
+private:
+    static void *worker(void *arg)
+    {
+        LegacyPool *pool = static_cast<LegacyPool *>(arg);
+        while (true)
+        {
+            pthread_mutex_lock(&pool->m_lock);
+            while (pool->m_queue.empty() && !pool->m_shutdown)
+                pthread_cond_wait(&pool->m_notEmpty, &pool->m_lock);
+            if (pool->m_shutdown)
+            {
+                pthread_mutex_unlock(&pool->m_lock);
+                return nullptr;
+            }
+            Task task = pool->m_queue.takeTask();
+            pthread_mutex_unlock(&pool->m_lock);
+            if (task.function)
+                task.function(task.arg);
+        }
+    }
+
+    pthread_mutex_t m_lock;
+    pthread_cond_t m_notEmpty;
+    TaskQueue m_queue;
+    std::vector<pthread_t> m_threads;
+    bool m_shutdown;
+};
+
+// 每个任务的提交时间和开始执行时的延迟
+static std::vector<uint64_t> submit_ns;
+static std::vector<uint64_t> latency_ns;
+static std::atomic<size_t> done(0);
+static int work = 0;
+
+static void spin(int n)
+{
+    volatile int x = 0;
+    for (int i = 0; i < n; i++)
+        x = x + i;
+}
+
+static void task(void *arg)
+{
+    size_t i = (size_t)arg;
+    latency_ns[i] = now_ns() - submit_ns[i];
+    spin(work);
+    done.fetch_add(1, std::memory_order_release);
+}
+
+// 由工作线程再提交子任务，测试本地队列和窃取
+template <class Pool>
+struct FanOut
+{
+    static Pool *pool;
+    static size_t fanout;
+    static size_t total;
+
+    static void run(void *arg)
+    {
+        size_t i = (size_t)arg;
+        latency_ns[i] = now_ns() - submit_ns[i];
+        for (size_t c = i * fanout + 1; c <= i * fanout + fanout && c < total; c++)
+        {
+            submit_ns[c] = now_ns();
+            pool->addTask(run, (void *)c);
+        }
+        spin(work);
+        done.fetch_add(1, std::memory_order_release);
+    }
+};
+template <class Pool> Pool *FanOut<Pool>::pool;
+template <class Pool> size_t FanOut<Pool>::fanout = 4;
+template <class Pool> size_t FanOut<Pool>::total;
+
+static void wait_done(size_t n)
+{
+    while (done.load(std::memory_order_acquire) < n)
+        usleep(100);
+}
+
+static void report(const char *name, int threads, size_t n, uint64_t elapsed)
+{
+    std::vector<uint64_t> sorted(latency_ns.begin(), latency_ns.begin() + n);
+    std::sort(sorted.begin(), sorted.end());
+    char title[64];
+    snprintf(title, sizeof(title), "%s/%d", name, threads);
+    BenchResult("threadpool", title)
+        .add("threads", threads)
+        .add("tasks", n)
+        .add("tasks_per_sec", n * 1e9 / elapsed)
+        .add("p50_us", sorted[n / 2] / 1000.0)
+        .add("p99_us", sorted[n * 99 / 100] / 1000.0)
+        .add("p999_us", sorted[n * 999 / 1000] / 1000.0)
+        .print();
+}
+
+// 事件循环一样从外部逐个提交
+template <class Pool>
+static void bench_inject(const char *name, Pool &pool, int threads, size_t n)
+{
+    done = 0;
+    uint64_t t0 = now_ns();
+    for (size_t i = 0; i < n; i++)
+    {
+        submit_ns[i] = now_ns();
+        pool.addTask(task, (void *)i);
+    }
+    wait_done(n);
+    report(name, threads, n, now_ns() - t0);
+}
+
+// 一个根任务展开成一棵任务树
+template <class Pool>
+static void bench_fanout(const char *name, Pool &pool, int threads, size_t n)
+{
+    done = 0;
+    FanOut<Pool>::pool = &pool;
+    FanOut<Pool>::total = n;
+    uint64_t t0 = now_ns();
+    submit_ns[0] = now_ns();
+    pool.addTask(FanOut<Pool>::run, (void *)0);
+    wait_done(n);
+    report(name, threads, n, now_ns() - t0);
+}
+
+int main(int argc, char *argv[])
+{
+    size_t n = argc > 1 ? atol(argv[1]) : 200000;
+    work = argc > 2 ? atoi(argv[2]) : 200;
+    submit_ns.resize(n);
+    latency_ns.resize(n);
+
+    const int counts[] = {1, 2, 4, 8, 16, 32, 64};
+    for (int threads : counts)
+    {
+        {
+            LegacyPool pool(threads);
+            bench_inject("legacy_inject", pool, threads, n);
+            bench_fanout("legacy_fanout", pool, threads, n);
+        }
+        {
+            ThreadPool pool(threads, threads);
+            bench_inject("steal_inject", pool, threads, n);
+            bench_fanout("steal_fanout", pool, threads, n);
+        }
+    }
+    return 0;
+}
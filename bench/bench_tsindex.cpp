@@ -0,0 +1,98 @@
+// 切片扫描速度测试：用TsIndexer扫描 client/video-data 下的所有样例切片
+//
+// 用法: bench_tsindex [轮数] [切片目录]
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include "bench.h"
+#include "../server/tsIndexer.h"
+
+int main(int argc, char *argv[])
+{
+    int rounds = argc > 1 ? atoi(argv[1]) : 10;
+    std::string dir = argc > 2 ? argv[2] : std::string(HLS_SOURCE_DIR) + "/client/video-data";
+
+    // 先把所有切片读到内存里，只测试扫描本身
+    std::vector<std::string> segments;
+    DIR *d = opendir(dir.c_str());
+    if (d == NULL)
+    {
+        perror("opendir");
+        return 1;
+    }
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL)
+    {
+        std::string name = ent->d_name;
+        if (name.size() < 3 || name.compare(name.size() - 3, 3, ".ts") != 0)
+            continue;
+        std::ifstream in(dir + "/" + name, std::ios::binary);
+        std::stringstream ss;
+        ss << in.rdbuf();
+        segments.push_back(ss.str());
+    }
+    closedir(d);
+    if (segments.empty())
+    {
+        fprintf(stderr, "no segments in %s\n", dir.c_str());
+        return 1;
+    }
+
+    size_t total = 0;
+    for (const std::string &seg : segments)
+        total += seg.size();
+
+    TsIndexer indexer;
+    double duration = 0;
+    size_t keyframes = 0;
+    uint64_t t0 = now_ns();
+    for (int r = 0; r < rounds; r++)
+    {
+        duration = 0;
+        keyframes = 0;
+        for (const std::string &seg : segments)
+        {
+            indexer.reset();
+            indexer.feed(reinterpret_cast<const uint8_t *>(seg.data()), seg.size());
+            duration += indexer.index().duration();
+            keyframes += indexer.index().keyframes();
+        }
+    }
+    uint64_t whole = now_ns() - t0;
+
+    // 模拟边接收边扫描，每次输入16KB
+    const size_t chunk = 16384;
+    t0 = now_ns();
+    for (int r = 0; r < rounds; r++)
+    {
+        for (const std::string &seg : segments)
+        {
+            indexer.reset();
+            for (size_t pos = 0; pos < seg.size(); pos += chunk)
+            {
+                size_t n = seg.size() - pos < chunk ? seg.size() - pos : chunk;
+                indexer.feed(reinterpret_cast<const uint8_t *>(seg.data() + pos), n);
+            }
+        }
+    }
+    uint64_t chunked = now_ns() - t0;
+
+    double mb = (double)total * rounds / 1e6;
+    BenchResult("tsindex", "whole_segment")
+        .add("segments", (double)segments.size())
+        .add("bytes", (double)total)
+        .add("media_sec", duration)
+        .add("keyframes", (double)keyframes)
+        .add("mb_per_sec", mb / (whole / 1e9))
+        .add("us_per_segment", whole / 1e3 / rounds / segments.size())
+        .print();
+    BenchResult("tsindex", "chunked_16k")
+        .add("mb_per_sec", mb / (chunked / 1e9))
+        .add("us_per_segment", chunked / 1e3 / rounds / segments.size())
+        .print();
+    return 0;
+}
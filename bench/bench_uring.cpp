@@ -0,0 +1,219 @@
+// I/O后端对比：同一台机器上分别用epoll+sendfile和io_uring的事件循环提供文件下载，
+// 统计每个请求事件循环线程的系统调用次数、CPU时间以及吞吐量
+//
+// 用法: bench_uring [每种情况的请求数] [客户端连接数]
+// 小文件使用 server/httpfile/index.html，切片使用 client/video-data/WLWZ0.ts
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include "bench.h"
+#include "../server/eventLoop.h"
+#include "../server/response.h"
+#ifdef HLS_IO_URING
+#include "../server/uringLoop.h"
+#endif
+
+static std::string small_path = std::string(HLS_SOURCE_DIR) + "/server/httpfile/index.html";
+static std::string segment_path = std::string(HLS_SOURCE_DIR) + "/client/video-data/WLWZ0.ts";
+
+// 和服务端一样在线程池中打开文件、生成响应头，文件内容由事件循环发送
+static void handle(Connection *conn)
+{
+    conn->requests++;
+    conn->keep_alive = conn->http.keep_alive();
+    const std::string &path = conn->http.path() == "/small" ? small_path : segment_path;
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        perror(path.c_str());
+        exit(EXIT_FAILURE);
+    }
+    ResponseBuilder rb(conn->out);
+    rb.status(200).content_type(path).content_length(st.st_size);
+    rb.connection(conn->keep_alive, IDLE_TIMEOUT, MAX_REQUESTS);
+    rb.end();
+    conn->file_fd = fd;
+    conn->file_pos = 0;
+    conn->file_end = st.st_size;
+}
+
+static void *run_loop(void *arg)
+{
+    static_cast<EventLoop *>(arg)->run();
+    return nullptr;
+}
+
+struct Client
+{
+    int port;
+    const char *url;
+    int requests;
+};
+
+// 一个长连接上依次发送请求，读完每个响应
+static void *client(void *arg)
+{
+    Client *c = static_cast<Client *>(arg);
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(c->port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        perror("connect");
+        exit(EXIT_FAILURE);
+    }
+    std::string req = std::string("GET ") + c->url + " HTTP/1.1\r\nHost: bench\r\n\r\n";
+    static thread_local char buf[1 << 18];
+    for (int i = 0; i < c->requests; i++)
+    {
+        send(sock, req.data(), req.size(), MSG_NOSIGNAL);
+        // 读到响应头结束，再按Content-Length读完响应体
+        std::string head;
+        size_t body = 0, got = 0;
+        while (true)
+        {
+            ssize_t n = recv(sock, buf, sizeof(buf), 0);
+            if (n <= 0)
+            {
+                perror("recv");
+                exit(EXIT_FAILURE);
+            }
+            head.append(buf, n);
+            size_t end = head.find("\r\n\r\n");
+            if (end == std::string::npos)
+                continue;
+            size_t cl = head.find("Content-Length: ");
+            body = strtoull(head.c_str() + cl + 16, NULL, 10);
+            got = head.size() - end - 4;
+            break;
+        }
+        while (got < body)
+        {
+            ssize_t n = recv(sock, buf, sizeof(buf), 0);
+            if (n <= 0)
+            {
+                perror("recv");
+                exit(EXIT_FAILURE);
+            }
+            got += n;
+        }
+    }
+    close(sock);
+    return nullptr;
+}
+
+// 启动一个事件循环，返回监听端口
+static int start_server(EventLoop *(*make)(int listen_fd), pthread_t *tid, EventLoop **out)
+{
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd, LISTEN_BACKLOG) < 0 ||
+        getsockname(listen_fd, (struct sockaddr *)&addr, &len) < 0)
+    {
+        perror("listen");
+        exit(EXIT_FAILURE);
+    }
+    EventLoop *loop = make(listen_fd);
+    if (loop == nullptr)
+    {
+        close(listen_fd);
+        return -1;
+    }
+    *out = loop;
+    pthread_create(tid, NULL, run_loop, loop);
+    return ntohs(addr.sin_port);
+}
+
+static ThreadPool *pool;
+
+static EventLoop *make_epoll(int listen_fd)
+{
+    return new EventLoop(listen_fd, pool, handle);
+}
+
+#ifdef HLS_IO_URING
+static EventLoop *make_uring(int listen_fd)
+{
+    UringLoop *loop = new UringLoop(listen_fd, pool, handle);
+    if (loop->ok())
+        return loop;
+    delete loop;
+    return nullptr;
+}
+#endif
+
+static void bench(const char *backend, EventLoop *(*make)(int), int requests, int clients)
+{
+    pthread_t loop_tid;
+    EventLoop *loop;
+    int port = start_server(make, &loop_tid, &loop);
+    if (port < 0)
+    {
+        fprintf(stderr, "%s backend unavailable\n", backend);
+        return;
+    }
+    clockid_t loop_clock;
+    pthread_getcpuclockid(loop_tid, &loop_clock);
+
+    const char *urls[] = {"/small", "/segment"};
+    for (const char *url : urls)
+    {
+        int n = strcmp(url, "/small") == 0 ? requests : requests / 10;
+        std::vector<Client> args(clients, Client{port, url, n / clients});
+        std::vector<pthread_t> tids(clients);
+
+        struct timespec c0, c1;
+        uint64_t sys0 = loop->syscalls();
+        clock_gettime(loop_clock, &c0);
+        uint64_t t0 = now_ns();
+        for (int i = 0; i < clients; i++)
+            pthread_create(&tids[i], NULL, client, &args[i]);
+        for (int i = 0; i < clients; i++)
+            pthread_join(tids[i], NULL);
+        uint64_t elapsed = now_ns() - t0;
+        clock_gettime(loop_clock, &c1);
+        uint64_t sys = loop->syscalls() - sys0;
+        uint64_t cpu = (c1.tv_sec - c0.tv_sec) * 1000000000ull + c1.tv_nsec - c0.tv_nsec;
+
+        int total = n / clients * clients;
+        std::string name = std::string(backend) + url;
+        BenchResult("uring", name.c_str())
+            .add("requests", total)
+            .add("clients", clients)
+            .add("requests_per_sec", total * 1e9 / elapsed)
+            .add("loop_syscalls_per_request", (double)sys / total)
+            .add("loop_cpu_us_per_request", cpu / 1000.0 / total)
+            .print();
+    }
+    // 事件循环不会返回，留给进程退出时结束
+}
+
+int main(int argc, char *argv[])
+{
+    int requests = argc > 1 ? atoi(argv[1]) : 20000;
+    int clients = argc > 2 ? atoi(argv[2]) : 8;
+    pool = new ThreadPool(2, 2);
+    bench("epoll", make_epoll, requests, clients);
+#ifdef HLS_IO_URING
+    bench("uring", make_uring, requests, clients);
+#else
+    fprintf(stderr, "built without HLS_IO_URING\n");
+#endif
+    return 0;
+}
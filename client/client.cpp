@@ -1,107 +1,569 @@
+// 推流端：把切片上传到服务端
+// 一条长连接依次上传所有切片，文件内容用sendfile发送，按每个切片的实际时长控制上传节奏。
+// --watch 上传编码器正在生成的切片，用分块传输编码边写边发；
+// --backfill 在一条长连接上流水线地补传整个目录，不控制节奏，切片仍按顺序加入播放列表。
 #include <iostream>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
 #include <unistd.h>
+#include <time.h>
 #include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "../server/tsIndexer.h"
 
 #define PORT 8080
 #define IP "127.0.0.1"
-#define BUFSIZE 1024
+#define VIDEO_DIR "/home/lyj/hls/client/video-data" // 默认上传的切片目录
+#define WATCH_PATTERN "WLWZ%d.ts"                   // --watch模式下切片的文件名
+#define WATCH_IDLE_MS 2000  // 正在写入的切片超过这么久没有变化，认为已经写完
+#define WATCH_POLL_MS 50    // 检查切片是否有新数据的间隔
+#define BACKFILL_JOBS 4     // 补传时默认同时发出、还没有收到响应的请求数
+#define RESPONSE_MAX 4096   // 响应头的最大长度
+#define UPLOAD_RETRIES 3    // 连接断开或者服务端过载时的重试次数
 const char *username = "lyj";
 
-int main()
+// 命令行参数
+struct Options
 {
-    struct stat file_stat;
-    char buf[BUFSIZE];
-    int i = 0;
+    const char *ip = IP;
+    int port = PORT;
+    const char *user = username;
+    const char *rendition = nullptr;
+    const char *resolution = nullptr;
+    std::string dir = VIDEO_DIR;
+    bool chunked = false;
+    bool watch = false;
+    int start = 0;
+    bool backfill = false;
+    int jobs = BACKFILL_JOBS;
+};
+static Options opt;
 
-    while (true)
+static uint64_t now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+}
+
+static void sleep_ms(uint64_t ms)
+{
+    struct timespec ts = {(time_t)(ms / 1000), (long)(ms % 1000) * 1000000};
+    nanosleep(&ts, NULL);
+}
+
+// 一条到服务端的长连接，断开后下次上传时重新连接
+class Publisher
+{
+public:
+    Publisher() : m_sock(-1) {}
+    ~Publisher()
     {
+        if (m_sock >= 0)
+            close(m_sock);
+    }
+
+    // 上传一个切片，成功返回0
+    // follow为true时文件还在写入，一直发送新写入的数据，直到next出现或者文件长时间没有变化
+    int upload(const std::string &path, const std::string &filename, bool chunked, bool follow = false,
+               const std::string &next = "");
+    // 流水线地上传dir中的多个切片，最多window个请求在等待响应。服务端按请求的顺序处理，
+    // 切片也按这个顺序加入播放列表。返回上传失败的切片数
+    int pipeline(const std::string &dir, const std::vector<std::string> &names, size_t window);
+
+private:
+    int connect_server();
+    void disconnect();
+    int send_all(const char *data, size_t len, int flags);
+    int send_file(int fd, off_t offset, size_t len);
+    // 发送一次请求，返回HTTP状态码，连接出错返回-1
+    int send_request(int fd, const std::string &filename, bool chunked, bool follow, const std::string &next);
+    int read_response(int &retry_after);
+
+    int m_sock;
+    // 收到的还没有处理的响应，流水线上传时一次可能收到多个响应
+    std::string m_resp;
+};
 
-        int client = socket(PF_INET, SOCK_STREAM, 0);
-        if (client == -1)
+int Publisher::connect_server()
+{
+    m_sock = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (m_sock == -1)
+    {
+        perror("创建socket失败!");
+        return -1;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(opt.port);
+    addr.sin_addr.s_addr = inet_addr(opt.ip);
+    if (connect(m_sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        perror("连接失败!");
+        disconnect();
+        return -1;
+    }
+    return 0;
+}
+
+void Publisher::disconnect()
+{
+    if (m_sock >= 0)
+        close(m_sock);
+    m_sock = -1;
+    m_resp.clear();
+}
+
+int Publisher::send_all(const char *data, size_t len, int flags)
+{
+    while (len > 0)
+    {
+        ssize_t n = send(m_sock, data, len, flags | MSG_NOSIGNAL);
+        if (n < 0)
         {
-            perror("创建socket失败!\n");
-            exit(EXIT_FAILURE);
+            if (errno == EINTR)
+                continue;
+            perror("发送失败!");
+            return -1;
         }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
 
-        // 设置此选项，强制重新使用处于TIME_WAIT状态的socket地址
-        int option;
-        socklen_t optlen;
-        optlen = sizeof(option);
-        option = 1;
-        setsockopt(client, SOL_SOCKET, SO_REUSEADDR, (void *)&option, optlen);
-
-        // 设置连接地址
-        struct sockaddr_in myaddr;
-        bzero(&myaddr, sizeof(myaddr));
-        myaddr.sin_family = AF_INET;
-        myaddr.sin_port = htons(PORT);
-        myaddr.sin_addr.s_addr = inet_addr(IP);
-        socklen_t myaddrlen = sizeof(myaddr);
-
-        // 连接服务器
-        if (connect(client, (struct sockaddr *)&myaddr, myaddrlen) < 0)
+int Publisher::send_file(int fd, off_t offset, size_t len)
+{
+    // 文件内容直接从页缓存发送到socket，不经过用户态
+    while (len > 0)
+    {
+        ssize_t n = sendfile(m_sock, fd, &offset, len);
+        if (n <= 0)
         {
-            perror("连接失败！\n");
+            if (n < 0 && errno == EINTR)
+                continue;
+            perror("sendfile失败!");
             return -1;
         }
+        len -= n;
+    }
+    return 0;
+}
 
-        // 获取文件名
-        sprintf(buf, "/home/lyj/hls/client/video-data/WLWZ%d.ts", i);
-
-        // 获取文件大小
-        if (stat(buf, &file_stat) == -1)
+int Publisher::upload(const std::string &path, const std::string &filename, bool chunked, bool follow,
+                      const std::string &next)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        perror(path.c_str());
+        return -1;
+    }
+    int status = -1;
+    for (int attempt = 0; attempt < UPLOAD_RETRIES; attempt++)
+    {
+        if (m_sock < 0 && connect_server() < 0)
         {
-            perror("Error getting file status");
-            return -1; // 出现错误时返回-1
+            sleep_ms(1000);
+            continue;
         }
+        status = send_request(fd, filename, chunked, follow, next);
+        int retry_after = 0;
+        if (status >= 0)
+            status = read_response(retry_after);
+        if (status == 200)
+            break;
+        // 连接出错时重新连接后重传，过载时等服务端建议的时间
+        disconnect();
+        if (status == 503)
+            sleep_ms((retry_after > 0 ? retry_after : 1) * 1000);
+        else if (status > 0)
+            break;
+    }
+    close(fd);
+    if (status != 200)
+    {
+        fprintf(stderr, "上传失败: %s (%d)\n", filename.c_str(), status);
+        return -1;
+    }
+    return 0;
+}
 
-        // 打开文件
-        FILE *file = fopen(buf, "rb");
-
-        // 发送消息头
-        sprintf(buf, "POST /upload?username=%s&filename=WLWZ%d.ts HTTP/1.1\r\nContent-Type: video/ts\r\nHost: %s:%d\r\nContent-Length: %ld\r\n\r\n", username, i, IP, PORT, file_stat.st_size);
-        if (send(client, buf, strlen(buf), 0) != strlen(buf))
+int Publisher::pipeline(const std::string &dir, const std::vector<std::string> &names, size_t window)
+{
+    int failed = 0;
+    int attempt = 0;
+    // acked之前的切片已经收到响应，acked到sent之间的请求已经发出
+    size_t acked = 0, sent = 0;
+    // 发送失败时服务端可能已经处理完前面的请求并关闭了连接，先读完已经到达的响应
+    bool broken = false;
+    while (acked < names.size())
+    {
+        if (m_sock < 0)
         {
-            perror("发送失败！\n");
-            return -1;
+            // 连接断开时还没有收到响应的请求都在新的连接上重新发送
+            sent = acked;
+            broken = false;
+            if (attempt >= UPLOAD_RETRIES)
+            {
+                fprintf(stderr, "上传失败: %s\n", names[acked].c_str());
+                failed++;
+                acked = ++sent;
+                attempt = 0;
+                continue;
+            }
+            attempt++;
+            if (connect_server() < 0)
+            {
+                sleep_ms(1000);
+                continue;
+            }
         }
-
-        // 发送消息体
-        size_t bytesSentTotal = 0;
-        size_t bytesRead;
-        while ((bytesRead = fread(buf, 1, BUFSIZE, file)) > 0)
+        if (!broken && sent < names.size() && sent - acked < window)
         {
-            size_t bytesSent = send(client, buf, bytesRead, 0);
-            if (bytesSent < 0)
+            std::string path = dir + "/" + names[sent];
+            int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd >= 0)
             {
-                perror("Error sending file");
-                fclose(file);
-                return -1;
+                int ret = send_request(fd, names[sent], opt.chunked, false, "");
+                close(fd);
+                if (ret < 0 && sent == acked)
+                    disconnect();
+                else if (ret < 0)
+                    broken = true;
+                else
+                    sent++;
+                continue;
             }
-            bytesSentTotal += bytesSent;
+            // 打不开的切片等前面的请求都收到响应后跳过
+            if (sent == acked)
+            {
+                perror(path.c_str());
+                failed++;
+                acked = ++sent;
+                continue;
+            }
+        }
+        int retry_after = 0;
+        int status = read_response(retry_after);
+        if (status == 200)
+        {
+            acked++;
+            attempt = 0;
+            continue;
         }
+        // 出错后服务端会关闭连接，之后的请求重新发送，过载时等服务端建议的时间
+        disconnect();
+        if (status == 503)
+            sleep_ms((retry_after > 0 ? retry_after : 1) * 1000);
+        else if (status > 0)
+        {
+            fprintf(stderr, "上传失败: %s (%d)\n", names[acked].c_str(), status);
+            failed++;
+            acked++;
+            attempt = 0;
+        }
+    }
+    return failed;
+}
+
+int Publisher::send_request(int fd, const std::string &filename, bool chunked, bool follow, const std::string &next)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        return -1;
+
+    std::string head = "POST /upload?username=" + std::string(opt.user) + "&filename=" + filename;
+    if (opt.rendition != nullptr)
+        head += "&rendition=" + std::string(opt.rendition);
+    if (opt.resolution != nullptr)
+        head += "&resolution=" + std::string(opt.resolution);
+    head += " HTTP/1.1\r\nContent-Type: video/mp2t\r\nHost: " + std::string(opt.ip) + ":" + std::to_string(opt.port) + "\r\n";
+    if (!chunked)
+    {
+        head += "Content-Length: " + std::to_string(st.st_size) + "\r\n\r\n";
+        if (send_all(head.data(), head.size(), MSG_MORE) < 0 || send_file(fd, 0, st.st_size) < 0)
+            return -1;
+        return 0;
+    }
 
-        // 关闭文件
-        fclose(file);
+    head += "Transfer-Encoding: chunked\r\n\r\n";
+    if (send_all(head.data(), head.size(), MSG_MORE) < 0)
+        return -1;
+    // 每次把文件新增的部分作为一块发送
+    off_t sent = 0;
+    uint64_t last_change = now_ms();
+    while (true)
+    {
+        if (fstat(fd, &st) < 0)
+            return -1;
+        if (st.st_size > sent)
+        {
+            char line[32];
+            int n = snprintf(line, sizeof(line), "%llx\r\n", (unsigned long long)(st.st_size - sent));
+            if (send_all(line, n, MSG_MORE) < 0 || send_file(fd, sent, st.st_size - sent) < 0 ||
+                send_all("\r\n", 2, follow ? 0 : MSG_MORE) < 0)
+                return -1;
+            sent = st.st_size;
+            last_change = now_ms();
+            continue;
+        }
+        // 下一个切片出现，或者很久没有新数据时，这个切片已经写完
+        struct stat next_st;
+        if (!follow || (!next.empty() && stat(next.c_str(), &next_st) == 0) || now_ms() - last_change >= WATCH_IDLE_MS)
+        {
+            // 判断之前可能又写入了最后一段数据
+            if (follow && fstat(fd, &st) == 0 && st.st_size > sent)
+                continue;
+            break;
+        }
+        sleep_ms(WATCH_POLL_MS);
+    }
+    if (send_all("0\r\n\r\n", 5, 0) < 0)
+        return -1;
+    return 0;
+}
 
-        // 检查是否发送完整个文件
-        if (bytesSentTotal != file_stat.st_size)
+int Publisher::read_response(int &retry_after)
+{
+    // 上传的响应没有响应体，读到空行为止，之后的数据是下一个响应
+    size_t end;
+    char buf[RESPONSE_MAX];
+    while ((end = m_resp.find("\r\n\r\n")) == std::string::npos)
+    {
+        if (m_resp.size() > RESPONSE_MAX)
+            return -1;
+        ssize_t n = recv(m_sock, buf, sizeof(buf), 0);
+        if (n <= 0)
         {
-            perror("没有完全发送");
+            if (n < 0 && errno == EINTR)
+                continue;
             return -1;
         }
-        printf("发送成功: WLWZ%d\n",i);
+        m_resp.append(buf, n);
+    }
+    std::string resp = m_resp.substr(0, end + 4);
+    m_resp.erase(0, end + 4);
+    int status = 0;
+    if (sscanf(resp.c_str(), "HTTP/%*d.%*d %d", &status) != 1)
+        return -1;
+    size_t pos = resp.find("Retry-After: ");
+    if (pos != std::string::npos)
+        retry_after = atoi(resp.c_str() + pos + 13);
+    // 服务端要关闭连接时下次重新连接
+    if (strcasestr(resp.c_str(), "Connection: close") != nullptr)
+        disconnect();
+    return status;
+}
+
+// 切片的实际时长（毫秒），不是TS文件或者没有时间戳时按默认的10秒
+static uint64_t segment_duration(const std::string &path)
+{
+    TsIndexer indexer;
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 10000;
+    uint8_t buf[65536];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+        indexer.feed(buf, n);
+    close(fd);
+    const TsIndex &index = indexer.index();
+    return index.valid() ? (uint64_t)(index.duration() * 1000) : 10000;
+}
+
+// 目录中所有的.ts切片，按文件名中的序号排序
+static std::vector<std::string> list_segments(const std::string &dir)
+{
+    std::vector<std::string> names;
+    DIR *d = opendir(dir.c_str());
+    if (d == NULL)
+    {
+        perror(dir.c_str());
+        return names;
+    }
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL)
+    {
+        std::string name = ent->d_name;
+        if (name.size() > 3 && name.compare(name.size() - 3, 3, ".ts") == 0)
+            names.push_back(name);
+    }
+    closedir(d);
+    auto number = [](const std::string &s) {
+        size_t i = s.find_first_of("0123456789");
+        return i == std::string::npos ? -1L : atol(s.c_str() + i);
+    };
+    std::sort(names.begin(), names.end(), [&](const std::string &a, const std::string &b) {
+        long x = number(a), y = number(b);
+        return x != y ? x < y : a < b;
+    });
+    return names;
+}
 
-        i++;
-        // 关闭套接字
-        close(client);
-        // 休息十秒
-        sleep(10);
+// 按实际时长依次上传，第i个切片在开始后前i个切片时长之和的时刻上传，不会累积误差
+static int publish(const std::vector<std::string> &names)
+{
+    Publisher pub;
+    uint64_t start = now_ms();
+    uint64_t media = 0;
+    for (const std::string &name : names)
+    {
+        uint64_t now = now_ms();
+        if (start + media > now)
+            sleep_ms(start + media - now);
+        std::string path = opt.dir + "/" + name;
+        uint64_t t0 = now_ms();
+        if (pub.upload(path, name, opt.chunked) == 0)
+            printf("发送成功: %s (%llums)\n", name.c_str(), (unsigned long long)(now_ms() - t0));
+        media += segment_duration(path);
     }
+    return 0;
+}
 
+// 上传编码器正在生成的切片：等第i个切片出现后边写边发，直到第i+1个切片出现
+static int watch()
+{
+    Publisher pub;
+    char name[256];
+    for (int i = opt.start;; i++)
+    {
+        snprintf(name, sizeof(name), WATCH_PATTERN, i);
+        std::string path = opt.dir + "/" + name;
+        struct stat st;
+        while (stat(path.c_str(), &st) < 0)
+            sleep_ms(WATCH_POLL_MS);
+        char next[256];
+        snprintf(next, sizeof(next), WATCH_PATTERN, i + 1);
+        uint64_t t0 = now_ms();
+        if (pub.upload(path, name, true, true, opt.dir + "/" + next) == 0)
+            printf("发送成功: %s (%llums)\n", name, (unsigned long long)(now_ms() - t0));
+    }
     return 0;
 }
+
+// 在一条长连接上流水线地补传整个目录，切片按文件名的顺序加入播放列表
+static int backfill(const std::vector<std::string> &names)
+{
+    Publisher pub;
+    uint64_t t0 = now_ms();
+    int failed = pub.pipeline(opt.dir, names, opt.jobs);
+    printf("补传完成: %zu个切片, %d个失败, %llums\n", names.size(), failed, (unsigned long long)(now_ms() - t0));
+    return failed > 0 ? -1 : 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "用法: %s [选项]\n"
+            "  --host IP           服务端地址 (默认 %s)\n"
+            "  --port N            服务端端口 (默认 %d)\n"
+            "  --user NAME         直播流的用户名 (默认 %s)\n"
+            "  --rendition NAME    多码率直播的码率名\n"
+            "  --resolution WxH    这一路码率的分辨率\n"
+            "  --dir DIR           切片目录 (默认 %s)\n"
+            "  --chunked           使用分块传输编码上传\n"
+            "  --watch[=START]     上传正在生成的切片 %s，从序号START开始边写边发\n"
+            "  --backfill          流水线地补传目录中的所有切片，不控制节奏\n"
+            "  --jobs N            补传时同时等待响应的请求数 (默认 %d)\n",
+            prog, IP, PORT, username, VIDEO_DIR, WATCH_PATTERN, BACKFILL_JOBS);
+}
+
+int main(int argc, char *argv[])
+{
+    enum
+    {
+        OPT_HOST = 256,
+        OPT_PORT,
+        OPT_USER,
+        OPT_RENDITION,
+        OPT_RESOLUTION,
+        OPT_DIR,
+        OPT_CHUNKED,
+        OPT_WATCH,
+        OPT_BACKFILL,
+        OPT_JOBS,
+    };
+    static const struct option options[] = {
+        {"host", required_argument, NULL, OPT_HOST},
+        {"port", required_argument, NULL, OPT_PORT},
+        {"user", required_argument, NULL, OPT_USER},
+        {"rendition", required_argument, NULL, OPT_RENDITION},
+        {"resolution", required_argument, NULL, OPT_RESOLUTION},
+        {"dir", required_argument, NULL, OPT_DIR},
+        {"chunked", no_argument, NULL, OPT_CHUNKED},
+        {"watch", optional_argument, NULL, OPT_WATCH},
+        {"backfill", no_argument, NULL, OPT_BACKFILL},
+        {"jobs", required_argument, NULL, OPT_JOBS},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}};
+
+    int c;
+    while ((c = getopt_long(argc, argv, "h", options, NULL)) != -1)
+    {
+        switch (c)
+        {
+        case OPT_HOST:
+            opt.ip = optarg;
+            break;
+        case OPT_PORT:
+            opt.port = atoi(optarg);
+            break;
+        case OPT_USER:
+            opt.user = optarg;
+            break;
+        case OPT_RENDITION:
+            opt.rendition = optarg;
+            break;
+        case OPT_RESOLUTION:
+            opt.resolution = optarg;
+            break;
+        case OPT_DIR:
+            opt.dir = optarg;
+            break;
+        case OPT_CHUNKED:
+            opt.chunked = true;
+            break;
+        case OPT_WATCH:
+            opt.watch = true;
+            opt.start = optarg != NULL ? atoi(optarg) : 0;
+            break;
+        case OPT_BACKFILL:
+            opt.backfill = true;
+            break;
+        case OPT_JOBS:
+            opt.jobs = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return c == 'h' ? 0 : 1;
+        }
+    }
+    if (opt.port <= 0 || opt.jobs <= 0 || (opt.watch && opt.backfill))
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    // 服务端关闭连接后sendfile不应该结束进程，出错后重新连接重传
+    signal(SIGPIPE, SIG_IGN);
+
+    if (opt.watch)
+        return watch();
+    std::vector<std::string> names = list_segments(opt.dir);
+    if (names.empty())
+    {
+        fprintf(stderr, "%s中没有切片\n", opt.dir.c_str());
+        return 1;
+    }
+    return opt.backfill ? (backfill(names) < 0 ? 1 : 0) : publish(names);
+}
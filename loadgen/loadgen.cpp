@@ -0,0 +1,679 @@
+// 压力测试：模拟推流端和观众，对本机的服务端施加完整的直播负载
+// N个推流线程循环上传样例切片，M个观众线程像hls.js一样拉流：从直播边缘往前3个切片开始，
+// 播放列表有更新时隔最后一个切片的时长重新加载，没有更新时隔半个目标时长，依次下载新出现的切片。
+// 结束后输出每秒请求数、播放列表/切片/上传的p50/p99/p999延迟、直播延迟和错误数，
+// 格式和bench目录下的程序一样，每行一个json对象。
+//
+// 用法: loadgen [--publishers N] [--viewers M] [--duration 秒] [--speed 倍数] ...
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <atomic>
+#include <algorithm>
+#include "../bench/bench.h"
+#include "../server/tsIndexer.h"
+
+#define PORT 8080
+#define IP "127.0.0.1"
+#define PUBLISHERS 1          // 默认的推流端个数
+#define VIEWERS 10            // 默认的观众个数
+#define DURATION 60           // 默认的测试时长（秒）
+#define STREAM_PREFIX "load"  // 推流端的用户名是 load0、load1 ...
+#define LIVE_SYNC_COUNT 3     // 和hls.js的liveSyncDurationCount一样，从直播边缘往前3个切片开始播放
+#define RECV_TIMEOUT 10       // 读响应的超时时间（秒）
+#define THREAD_STACK (256 * 1024) // 观众线程很多，减小线程栈
+#define BODY_BUF 65536        // 下载切片时的接收缓冲区
+#define RESPONSE_MAX 8192     // 响应头的最大长度
+#define READY_TIMEOUT 30000   // 等待所有推流端上传完第一个切片的最长时间（毫秒）
+
+// 命令行参数
+struct Options
+{
+    const char *ip = IP;
+    int port = PORT;
+    int publishers = PUBLISHERS;
+    int viewers = VIEWERS;
+    int duration = DURATION;
+    double speed = 1.0;
+    const char *user = "lyj"; // 没有推流端时观众观看的直播
+    std::string dir = std::string(HLS_SOURCE_DIR) + "/client/video-data";
+};
+static Options opt;
+
+static std::atomic<bool> stopping(false);
+
+static uint64_t now_us() { return now_ns() / 1000; }
+
+// 睡眠一段时间，测试结束时提前返回
+static void sleep_us(uint64_t us)
+{
+    uint64_t end = now_us() + us;
+    while (!stopping)
+    {
+        uint64_t now = now_us();
+        if (now >= end)
+            return;
+        uint64_t step = std::min<uint64_t>(end - now, 100000);
+        struct timespec ts = {(time_t)(step / 1000000), (long)(step % 1000000) * 1000};
+        nanosleep(&ts, NULL);
+    }
+}
+
+// 每个线程自己的统计，线程结束时合并，测试过程中不加锁
+struct Stats
+{
+    std::vector<uint32_t> playlist; // 延迟，微秒
+    std::vector<uint32_t> segment;
+    std::vector<uint32_t> upload;
+    std::vector<uint32_t> lag;      // 切片上传完成到观众下载完成的时间，毫秒
+    uint64_t bytes = 0;             // 下载的字节数
+    uint64_t connect_errors = 0;    // 连接失败
+    uint64_t io_errors = 0;         // 发送、接收失败或超时
+    uint64_t shed = 0;              // 服务端过载返回503
+    uint64_t http_errors = 0;       // 其他非200的响应
+    uint64_t behind = 0;            // 观众落后太多，要下载的切片已经移出播放列表
+
+    void merge(const Stats &o)
+    {
+        playlist.insert(playlist.end(), o.playlist.begin(), o.playlist.end());
+        segment.insert(segment.end(), o.segment.begin(), o.segment.end());
+        upload.insert(upload.end(), o.upload.begin(), o.upload.end());
+        lag.insert(lag.end(), o.lag.begin(), o.lag.end());
+        bytes += o.bytes;
+        connect_errors += o.connect_errors;
+        io_errors += o.io_errors;
+        shed += o.shed;
+        http_errors += o.http_errors;
+        behind += o.behind;
+    }
+};
+
+static Stats total;
+static pthread_mutex_t total_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::atomic<uint64_t> requests(0); // 用来每秒打印一次进度
+
+// 每个切片上传完成的时间，观众用来计算直播延迟
+static std::unordered_map<std::string, uint64_t> published;
+static pthread_mutex_t published_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::atomic<int> publishers_ready(0);
+
+// 到服务端的一条长连接，服务端要求关闭或者出错时下次请求重新连接
+class HttpConn
+{
+public:
+    HttpConn(Stats &stats) : m_sock(-1), m_stats(stats) {}
+    ~HttpConn() { disconnect(); }
+
+    // 发送一个请求，body_fd >= 0时请求体用sendfile发送
+    // 响应体保存到out，out为空时只统计字节数；返回HTTP状态码，出错返回-1
+    int request(const std::string &head, int body_fd, size_t body_len, std::string *out);
+
+private:
+    int connect_server();
+    void disconnect();
+    int send_all(const char *data, size_t len, int flags);
+    int read_response(std::string *out);
+
+    int m_sock;
+    Stats &m_stats;
+    std::string m_in; // 已经收到还没有处理的数据
+};
+
+int HttpConn::connect_server()
+{
+    m_sock = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (m_sock == -1)
+    {
+        m_stats.connect_errors++;
+        return -1;
+    }
+    struct timeval tv = {RECV_TIMEOUT, 0};
+    setsockopt(m_sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    int one = 1;
+    setsockopt(m_sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(opt.port);
+    addr.sin_addr.s_addr = inet_addr(opt.ip);
+    if (connect(m_sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        m_stats.connect_errors++;
+        disconnect();
+        return -1;
+    }
+    m_in.clear();
+    return 0;
+}
+
+void HttpConn::disconnect()
+{
+    if (m_sock >= 0)
+        close(m_sock);
+    m_sock = -1;
+}
+
+int HttpConn::send_all(const char *data, size_t len, int flags)
+{
+    while (len > 0)
+    {
+        ssize_t n = send(m_sock, data, len, flags | MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int HttpConn::request(const std::string &head, int body_fd, size_t body_len, std::string *out)
+{
+    if (m_sock < 0 && connect_server() < 0)
+        return -1;
+    int status = -1;
+    if (send_all(head.data(), head.size(), body_fd >= 0 ? MSG_MORE : 0) == 0)
+    {
+        off_t offset = 0;
+        size_t left = body_fd >= 0 ? body_len : 0;
+        while (left > 0)
+        {
+            ssize_t n = sendfile(m_sock, body_fd, &offset, left);
+            if (n <= 0)
+            {
+                if (n < 0 && errno == EINTR)
+                    continue;
+                break;
+            }
+            left -= n;
+        }
+        if (left == 0)
+            status = read_response(out);
+    }
+    if (status < 0)
+    {
+        m_stats.io_errors++;
+        disconnect();
+    }
+    return status;
+}
+
+int HttpConn::read_response(std::string *out)
+{
+    char buf[BODY_BUF];
+    size_t end;
+    while ((end = m_in.find("\r\n\r\n")) == std::string::npos)
+    {
+        if (m_in.size() > RESPONSE_MAX)
+            return -1;
+        ssize_t n = recv(m_sock, buf, sizeof(buf), 0);
+        if (n <= 0)
+        {
+            if (n < 0 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        m_in.append(buf, n);
+    }
+    std::string head = m_in.substr(0, end + 4);
+    m_in.erase(0, end + 4);
+    int status = 0;
+    if (sscanf(head.c_str(), "HTTP/%*d.%*d %d", &status) != 1)
+        return -1;
+    size_t length = 0;
+    const char *p = strcasestr(head.c_str(), "\r\nContent-Length:");
+    if (p != nullptr)
+        length = strtoull(p + 17, NULL, 10);
+    bool close_after = strcasestr(head.c_str(), "\r\nConnection: close") != nullptr;
+
+    // 响应体，切片只统计字节数不保存
+    if (out != nullptr)
+        out->clear();
+    size_t got = std::min(length, m_in.size());
+    if (out != nullptr)
+        out->append(m_in, 0, got);
+    m_in.erase(0, got);
+    while (got < length)
+    {
+        ssize_t n = recv(m_sock, buf, std::min(sizeof(buf), length - got), 0);
+        if (n <= 0)
+        {
+            if (n < 0 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (out != nullptr)
+            out->append(buf, n);
+        got += n;
+    }
+    m_stats.bytes += length;
+    if (close_after)
+        disconnect();
+    return status;
+}
+
+// 按状态码统计错误，返回是否成功
+static bool check_status(Stats &stats, int status)
+{
+    if (status == 200)
+        return true;
+    if (status == 503)
+        stats.shed++;
+    else if (status > 0)
+        stats.http_errors++;
+    return false;
+}
+
+// 样例切片和实际时长
+struct Sample
+{
+    std::string name;
+    std::string path;
+    uint64_t size;
+    uint64_t duration_us;
+};
+static std::vector<Sample> samples;
+
+static int load_samples()
+{
+    DIR *d = opendir(opt.dir.c_str());
+    if (d == NULL)
+    {
+        perror(opt.dir.c_str());
+        return -1;
+    }
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL)
+    {
+        std::string name = ent->d_name;
+        if (name.size() <= 3 || name.compare(name.size() - 3, 3, ".ts") != 0)
+            continue;
+        Sample s;
+        s.name = name;
+        s.path = opt.dir + "/" + name;
+        TsIndexer indexer;
+        int fd = open(s.path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+        uint8_t buf[BODY_BUF];
+        ssize_t n;
+        s.size = 0;
+        while ((n = read(fd, buf, sizeof(buf))) > 0)
+        {
+            indexer.feed(buf, n);
+            s.size += n;
+        }
+        close(fd);
+        const TsIndex &index = indexer.index();
+        s.duration_us = index.valid() ? (uint64_t)(index.duration() * 1e6) : 10000000;
+        samples.push_back(s);
+    }
+    closedir(d);
+    auto number = [](const std::string &s) {
+        size_t i = s.find_first_of("0123456789");
+        return i == std::string::npos ? -1L : atol(s.c_str() + i);
+    };
+    std::sort(samples.begin(), samples.end(), [&](const Sample &a, const Sample &b) {
+        long x = number(a.name), y = number(b.name);
+        return x != y ? x < y : a.name < b.name;
+    });
+    return samples.empty() ? -1 : 0;
+}
+
+static void merge_stats(const Stats &stats)
+{
+    pthread_mutex_lock(&total_lock);
+    total.merge(stats);
+    pthread_mutex_unlock(&total_lock);
+}
+
+// 推流端：按实际时长（除以--speed）循环上传样例切片，播放列表只保留最近几个切片，所以可以重复使用文件名
+static void *publisher(void *arg)
+{
+    long id = (long)arg;
+    std::string user = STREAM_PREFIX + std::to_string(id);
+    Stats stats;
+    HttpConn conn(stats);
+    uint64_t start = now_us();
+    uint64_t media = 0;
+    bool ready = false;
+    for (size_t i = 0; !stopping; i++)
+    {
+        const Sample &s = samples[i % samples.size()];
+        uint64_t now = now_us();
+        if (start + media > now)
+            sleep_us(start + media - now);
+        if (stopping)
+            break;
+        media += (uint64_t)(s.duration_us / opt.speed);
+
+        int fd = open(s.path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+        std::string head = "POST /upload?username=" + user + "&filename=" + s.name +
+                           " HTTP/1.1\r\nContent-Type: video/mp2t\r\nContent-Length: " + std::to_string(s.size) +
+                           "\r\n\r\n";
+        uint64_t t0 = now_us();
+        int status = conn.request(head, fd, s.size, nullptr);
+        uint64_t t1 = now_us();
+        close(fd);
+        requests++;
+        if (!check_status(stats, status))
+            continue;
+        stats.upload.push_back(t1 - t0);
+        pthread_mutex_lock(&published_lock);
+        published["/video/" + user + "/" + s.name] = t1;
+        pthread_mutex_unlock(&published_lock);
+        if (!ready)
+        {
+            ready = true;
+            publishers_ready++;
+        }
+    }
+    merge_stats(stats);
+    return nullptr;
+}
+
+// 解析后的媒体播放列表
+struct MediaPlaylist
+{
+    double target = 0;
+    uint64_t sequence = 0;
+    std::vector<std::pair<std::string, double>> segments; // uri和时长
+};
+
+static bool parse_playlist(const std::string &body, MediaPlaylist &pl)
+{
+    if (body.compare(0, 7, "#EXTM3U") != 0)
+        return false;
+    double duration = 0;
+    size_t pos = 0;
+    while (pos < body.size())
+    {
+        size_t eol = body.find('\n', pos);
+        if (eol == std::string::npos)
+            eol = body.size();
+        std::string line = body.substr(pos, eol - pos);
+        pos = eol + 1;
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        if (line.empty())
+            continue;
+        if (line.compare(0, 22, "#EXT-X-TARGETDURATION:") == 0)
+            pl.target = atof(line.c_str() + 22);
+        else if (line.compare(0, 22, "#EXT-X-MEDIA-SEQUENCE:") == 0)
+            pl.sequence = strtoull(line.c_str() + 22, NULL, 10);
+        else if (line.compare(0, 8, "#EXTINF:") == 0)
+            duration = atof(line.c_str() + 8);
+        else if (line[0] != '#')
+            pl.segments.emplace_back(line, duration);
+    }
+    return pl.target > 0;
+}
+
+// 观众：按hls.js的方式刷新播放列表、下载新切片
+static void *viewer(void *arg)
+{
+    long id = (long)arg;
+    std::string user = opt.publishers > 0 ? STREAM_PREFIX + std::to_string(id % opt.publishers) : opt.user;
+    std::string base = "/video/" + user + "/";
+    std::string playlist_req = "GET " + base + "main.m3u8 HTTP/1.1\r\nHost: " + std::string(opt.ip) + "\r\n\r\n";
+    Stats stats;
+    HttpConn conn(stats);
+    std::string body;
+    int64_t next = -1;      // 下一个要下载的切片序号
+    int64_t last_edge = -1; // 上次播放列表中最新的切片序号
+
+    while (!stopping)
+    {
+        uint64_t t0 = now_us();
+        int status = conn.request(playlist_req, -1, 0, &body);
+        requests++;
+        MediaPlaylist pl;
+        if (!check_status(stats, status) || !parse_playlist(body, pl))
+        {
+            if (status == 200)
+                stats.http_errors++;
+            sleep_us((uint64_t)(1e6 / opt.speed));
+            continue;
+        }
+        stats.playlist.push_back(now_us() - t0);
+
+        int64_t edge = (int64_t)(pl.sequence + pl.segments.size()) - 1;
+        bool changed = edge != last_edge;
+        last_edge = edge;
+        if (next < 0)
+            next = std::max<int64_t>(pl.sequence, edge - LIVE_SYNC_COUNT + 1);
+        else if (next < (int64_t)pl.sequence)
+        {
+            // 要下载的切片已经移出了播放列表，hls.js这时会跳到播放列表中还存在的切片
+            stats.behind++;
+            next = pl.sequence;
+        }
+        for (; next <= edge && !stopping; next++)
+        {
+            std::string uri = pl.segments[next - pl.sequence].first;
+            std::string path = uri[0] == '/' ? uri : base + uri;
+            std::string req = "GET " + path + " HTTP/1.1\r\nHost: " + std::string(opt.ip) + "\r\n\r\n";
+            uint64_t s0 = now_us();
+            status = conn.request(req, -1, 0, nullptr);
+            uint64_t s1 = now_us();
+            requests++;
+            if (!check_status(stats, status))
+                break;
+            stats.segment.push_back(s1 - s0);
+            pthread_mutex_lock(&published_lock);
+            auto it = published.find(path);
+            uint64_t up = it == published.end() ? 0 : it->second;
+            pthread_mutex_unlock(&published_lock);
+            if (up > 0 && s1 > up)
+                stats.lag.push_back((s1 - up) / 1000);
+        }
+
+        // 播放列表有更新时隔最后一个切片的时长刷新，没有更新时隔半个目标时长，扣掉这一轮花掉的时间
+        double interval = changed && !pl.segments.empty() ? pl.segments.back().second : pl.target / 2;
+        uint64_t wait = (uint64_t)(interval * 1e6 / opt.speed);
+        uint64_t spent = now_us() - t0;
+        if (wait > spent)
+            sleep_us(wait - spent);
+    }
+    merge_stats(stats);
+    return nullptr;
+}
+
+static double percentile(std::vector<uint32_t> &v, double p)
+{
+    if (v.empty())
+        return 0;
+    size_t i = std::min(v.size() - 1, (size_t)(p * v.size()));
+    std::nth_element(v.begin(), v.begin() + i, v.end());
+    return v[i];
+}
+
+static void report(const char *name, std::vector<uint32_t> &v, double seconds, double scale)
+{
+    BenchResult("loadgen", name)
+        .add("count", (double)v.size())
+        .add("per_sec", v.size() / seconds)
+        .add("p50_ms", percentile(v, 0.50) / scale)
+        .add("p99_ms", percentile(v, 0.99) / scale)
+        .add("p999_ms", percentile(v, 0.999) / scale)
+        .print();
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "用法: %s [选项]\n"
+            "  --host IP           服务端地址 (默认 %s)\n"
+            "  --port N            服务端端口 (默认 %d)\n"
+            "  --publishers N      推流端个数，用户名为 " STREAM_PREFIX "0.." STREAM_PREFIX "N-1 (默认 %d)\n"
+            "  --viewers M         观众个数，平均分配到各个直播 (默认 %d)\n"
+            "  --duration S        测试时长，秒 (默认 %d)\n"
+            "  --speed X           推流和刷新播放列表的速度是实际的X倍 (默认 1)\n"
+            "  --user NAME         没有推流端时观众观看的直播 (默认 lyj)\n"
+            "  --dir DIR           样例切片目录 (默认 %s/client/video-data)\n",
+            prog, IP, PORT, PUBLISHERS, VIEWERS, DURATION, HLS_SOURCE_DIR);
+}
+
+int main(int argc, char *argv[])
+{
+    enum
+    {
+        OPT_HOST = 256,
+        OPT_PORT,
+        OPT_PUBLISHERS,
+        OPT_VIEWERS,
+        OPT_DURATION,
+        OPT_SPEED,
+        OPT_USER,
+        OPT_DIR,
+    };
+    static const struct option options[] = {
+        {"host", required_argument, NULL, OPT_HOST},
+        {"port", required_argument, NULL, OPT_PORT},
+        {"publishers", required_argument, NULL, OPT_PUBLISHERS},
+        {"viewers", required_argument, NULL, OPT_VIEWERS},
+        {"duration", required_argument, NULL, OPT_DURATION},
+        {"speed", required_argument, NULL, OPT_SPEED},
+        {"user", required_argument, NULL, OPT_USER},
+        {"dir", required_argument, NULL, OPT_DIR},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}};
+
+    int c;
+    while ((c = getopt_long(argc, argv, "h", options, NULL)) != -1)
+    {
+        switch (c)
+        {
+        case OPT_HOST:
+            opt.ip = optarg;
+            break;
+        case OPT_PORT:
+            opt.port = atoi(optarg);
+            break;
+        case OPT_PUBLISHERS:
+            opt.publishers = atoi(optarg);
+            break;
+        case OPT_VIEWERS:
+            opt.viewers = atoi(optarg);
+            break;
+        case OPT_DURATION:
+            opt.duration = atoi(optarg);
+            break;
+        case OPT_SPEED:
+            opt.speed = atof(optarg);
+            break;
+        case OPT_USER:
+            opt.user = optarg;
+            break;
+        case OPT_DIR:
+            opt.dir = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return c == 'h' ? 0 : 1;
+        }
+    }
+    if (opt.port <= 0 || opt.publishers < 0 || opt.viewers < 0 || opt.duration <= 0 || opt.speed <= 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    if (opt.publishers > 0 && load_samples() < 0)
+    {
+        fprintf(stderr, "%s中没有切片\n", opt.dir.c_str());
+        return 1;
+    }
+
+    // 每个观众一条连接，把打开文件数的软限制提高到硬限制
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, THREAD_STACK);
+
+    std::vector<pthread_t> tids;
+    for (long i = 0; i < opt.publishers; i++)
+    {
+        pthread_t tid;
+        if (pthread_create(&tid, &attr, publisher, (void *)i) == 0)
+            tids.push_back(tid);
+    }
+    // 等每个直播都有了切片再让观众进来，避免一开始的404算成错误
+    uint64_t wait_start = now_us();
+    while (publishers_ready < opt.publishers && now_us() - wait_start < READY_TIMEOUT * 1000ull)
+        sleep_us(10000);
+    if (publishers_ready < opt.publishers)
+        fprintf(stderr, "只有%d个推流端上传成功\n", publishers_ready.load());
+
+    uint64_t start = now_us();
+    for (long i = 0; i < opt.viewers; i++)
+    {
+        pthread_t tid;
+        if (pthread_create(&tid, &attr, viewer, (void *)i) != 0)
+        {
+            perror("创建观众线程失败");
+            break;
+        }
+        tids.push_back(tid);
+    }
+    pthread_attr_destroy(&attr);
+
+    uint64_t last = 0;
+    for (int s = 1; s <= opt.duration; s++)
+    {
+        uint64_t now = now_us();
+        if (start + s * 1000000ull > now)
+            sleep_us(start + s * 1000000ull - now);
+        uint64_t n = requests;
+        fprintf(stderr, "%ds: %llu req/s\n", s, (unsigned long long)(n - last));
+        last = n;
+    }
+    stopping = true;
+    for (pthread_t tid : tids)
+        pthread_join(tid, NULL);
+    double seconds = (now_us() - start) / 1e6;
+
+    BenchResult("loadgen", "total")
+        .add("publishers", opt.publishers)
+        .add("viewers", opt.viewers)
+        .add("seconds", seconds)
+        .add("requests", (double)requests)
+        .add("rps", requests / seconds)
+        .add("mbit_per_sec", total.bytes * 8 / seconds / 1e6)
+        .add("connect_errors", (double)total.connect_errors)
+        .add("io_errors", (double)total.io_errors)
+        .add("shed", (double)total.shed)
+        .add("http_errors", (double)total.http_errors)
+        .add("behind", (double)total.behind)
+        .print();
+    report("playlist", total.playlist, seconds, 1000);
+    report("segment", total.segment, seconds, 1000);
+    report("upload", total.upload, seconds, 1000);
+    report("live_lag", total.lag, seconds, 1);
+    return 0;
+}
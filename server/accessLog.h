@@ -0,0 +1,409 @@
+#ifndef _ACCESSLOG_H
+#define _ACCESSLOG_H
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#define LOG_RING_SIZE 2048    // 每个线程环形缓冲区的记录数，必须是2的幂
+#define LOG_TEXT_MAX 128      // 记录中路径或者消息的最大长度，超出的部分截断
+#define LOG_FLUSH_MS 50       // 后台线程取出记录的间隔（毫秒）
+#define LOG_BATCH_BYTES 65536 // 攒够这么多字节就写一次
+
+// 日志级别，低于设置级别的记录在写入缓冲区之前就丢掉
+enum LOG_LEVEL
+{
+    LOG_DEBUG = 0, // 每个请求，包括/metrics的采集
+    LOG_INFO,      // 每个正常完成的请求
+    LOG_WARN,      // 4xx响应、被拒绝的上传等
+    LOG_ERROR,     // 5xx响应、保存失败等
+    LOG_OFF
+};
+
+// 一条日志记录，定长，工作线程直接填进自己的环形缓冲区，由后台线程格式化
+struct LogRecord
+{
+    uint64_t time_ns;    // CLOCK_REALTIME
+    uint64_t elapsed_us; // 访问记录：请求的处理时间
+    uint64_t bytes;      // 访问记录：响应的字节数
+    const char *route;   // 访问记录：路由名称，指向静态字符串；为空表示这是一条消息
+    uint16_t status;
+    uint8_t level;
+    char method[8];
+    uint16_t len;
+    char text[LOG_TEXT_MAX]; // 访问记录是路径，消息记录是消息内容
+};
+
+// 单生产者单消费者的环形缓冲区，生产者是所属的线程，消费者是后台线程
+// head和tail分开放在不同的缓存行，两边不会互相使对方的缓存失效
+struct LogRing
+{
+    alignas(64) std::atomic<uint64_t> head; // 只有生产者修改
+    uint64_t sampled;                        // 生产者本地的采样计数
+    std::atomic<uint64_t> dropped;           // 缓冲区满时丢掉的记录数，只有生产者修改
+    alignas(64) std::atomic<uint64_t> tail; // 只有后台线程修改
+    LogRecord records[LOG_RING_SIZE];
+
+    LogRing() : head(0), sampled(0), dropped(0), tail(0) {}
+};
+
+// 异步访问日志
+// 请求完成时只把一条定长记录写入当前线程的环形缓冲区，不加锁也不做系统调用；
+// 缓冲区满时丢弃记录并计数，请求永远不会等待日志I/O。
+// 后台线程定期取出所有缓冲区中的记录，格式化成文本后一次write写出。
+class AccessLog
+{
+public:
+    // 打开日志文件（"-"表示标准输出）并启动后台线程，sample大于1时INFO及以下的记录每sample条保留一条
+    static int start(int level, int sample, const char *path);
+    // 写出剩余的记录并停止后台线程
+    static void stop();
+    // 这个级别的记录是否需要记录，调用者可以据此跳过准备参数
+    static bool enabled(int level) { return level >= s_level.load(std::memory_order_relaxed); }
+
+    // 一个请求的访问记录
+    static void access(int level, std::string_view method, std::string_view path, int status, uint64_t bytes,
+                       uint64_t elapsed_ns, const char *route);
+    // 一条文本消息，后台线程没有启动时直接写到标准错误
+    static void message(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+    // 因为缓冲区满丢掉的记录数和已经写出的记录数
+    static uint64_t dropped();
+    static uint64_t written() { return s_written.load(std::memory_order_relaxed); }
+    // 解析日志级别的名称，无法识别时返回-1
+    static int parse_level(const char *name);
+
+private:
+    struct Handle
+    {
+        LogRing *ring = nullptr;
+        ~Handle();
+    };
+    static LogRing *local();
+    // 取得一个可以写入的位置，被采样跳过或者缓冲区已满时返回空
+    static LogRecord *reserve(LogRing *ring, int level);
+    static void commit(LogRing *ring) { ring->head.store(ring->head.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+    static void *run(void *arg);
+    // 取出所有缓冲区中的记录追加到buf
+    static void drain(std::string &buf);
+    static void format(const LogRecord &rec, std::string &buf);
+    static void flush(std::string &buf);
+
+    static std::atomic<int> s_level;
+    static int s_sample;
+    static int s_fd;
+    static bool s_running;
+    static pthread_t s_thread;
+    static pthread_mutex_t s_lock;
+    static pthread_cond_t s_cond;
+    static std::vector<LogRing *> s_rings;
+    static std::vector<LogRing *> s_free;
+    static std::atomic<uint64_t> s_written;
+    // 后台线程上次报告时的丢弃总数
+    static uint64_t s_reported;
+    // 同一秒内的记录共用格式化好的时间
+    static time_t s_lastSec;
+    static char s_timeBuf[32];
+};
+
+std::atomic<int> AccessLog::s_level(LOG_OFF);
+int AccessLog::s_sample = 1;
+int AccessLog::s_fd = -1;
+bool AccessLog::s_running = false;
+pthread_t AccessLog::s_thread;
+pthread_mutex_t AccessLog::s_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t AccessLog::s_cond = PTHREAD_COND_INITIALIZER;
+std::vector<LogRing *> AccessLog::s_rings;
+std::vector<LogRing *> AccessLog::s_free;
+std::atomic<uint64_t> AccessLog::s_written(0);
+uint64_t AccessLog::s_reported = 0;
+time_t AccessLog::s_lastSec = -1;
+char AccessLog::s_timeBuf[32];
+
+int AccessLog::parse_level(const char *name)
+{
+    static const char *names[] = {"debug", "info", "warn", "error", "off"};
+    for (int i = 0; i <= LOG_OFF; i++)
+    {
+        if (strcasecmp(name, names[i]) == 0)
+            return i;
+    }
+    return -1;
+}
+
+int AccessLog::start(int level, int sample, const char *path)
+{
+    if (path == nullptr || strcmp(path, "-") == 0)
+        s_fd = STDOUT_FILENO;
+    else
+    {
+        s_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (s_fd < 0)
+        {
+            perror(path);
+            return -1;
+        }
+    }
+    s_sample = sample > 1 ? sample : 1;
+    s_running = true;
+    if (pthread_create(&s_thread, NULL, run, NULL) != 0)
+    {
+        perror("log thread create failed");
+        s_running = false;
+        return -1;
+    }
+    s_level = level;
+    return 0;
+}
+
+void AccessLog::stop()
+{
+    if (!s_running)
+        return;
+    s_level = LOG_OFF;
+    pthread_mutex_lock(&s_lock);
+    s_running = false;
+    pthread_cond_signal(&s_cond);
+    pthread_mutex_unlock(&s_lock);
+    pthread_join(s_thread, NULL);
+    if (s_fd > STDERR_FILENO)
+        close(s_fd);
+    s_fd = -1;
+}
+
+AccessLog::Handle::~Handle()
+{
+    if (ring == nullptr)
+        return;
+    // 还没有取出的记录留在缓冲区里，后台线程照常取出
+    pthread_mutex_lock(&s_lock);
+    s_free.push_back(ring);
+    pthread_mutex_unlock(&s_lock);
+}
+
+LogRing *AccessLog::local()
+{
+    static thread_local Handle handle;
+    if (handle.ring != nullptr)
+        return handle.ring;
+    // 每个线程只在第一次记录时加锁
+    pthread_mutex_lock(&s_lock);
+    if (!s_free.empty())
+    {
+        handle.ring = s_free.back();
+        s_free.pop_back();
+    }
+    else
+    {
+        handle.ring = new LogRing();
+        s_rings.push_back(handle.ring);
+    }
+    pthread_mutex_unlock(&s_lock);
+    return handle.ring;
+}
+
+LogRecord *AccessLog::reserve(LogRing *ring, int level)
+{
+    // 警告和错误不采样
+    if (level < LOG_WARN && s_sample > 1 && ring->sampled++ % s_sample != 0)
+        return nullptr;
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    if (head - ring->tail.load(std::memory_order_acquire) >= LOG_RING_SIZE)
+    {
+        ring->dropped.store(ring->dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        return nullptr;
+    }
+    LogRecord *rec = &ring->records[head & (LOG_RING_SIZE - 1)];
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    rec->time_ns = ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    rec->level = level;
+    return rec;
+}
+
+void AccessLog::access(int level, std::string_view method, std::string_view path, int status, uint64_t bytes,
+                       uint64_t elapsed_ns, const char *route)
+{
+    if (!enabled(level))
+        return;
+    LogRing *ring = local();
+    LogRecord *rec = reserve(ring, level);
+    if (rec == nullptr)
+        return;
+    rec->elapsed_us = elapsed_ns / 1000;
+    rec->bytes = bytes;
+    rec->route = route != nullptr ? route : "-";
+    rec->status = status;
+    size_t m = method.size() < sizeof(rec->method) - 1 ? method.size() : sizeof(rec->method) - 1;
+    memcpy(rec->method, method.data(), m);
+    rec->method[m] = '\0';
+    rec->len = path.size() < LOG_TEXT_MAX ? path.size() : LOG_TEXT_MAX;
+    memcpy(rec->text, path.data(), rec->len);
+    commit(ring);
+}
+
+void AccessLog::message(int level, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    if (!s_running)
+    {
+        // 日志还没有启动，比如解析命令行参数时
+        vfprintf(stderr, fmt, ap);
+        fputc('\n', stderr);
+        va_end(ap);
+        return;
+    }
+    if (!enabled(level))
+    {
+        va_end(ap);
+        return;
+    }
+    LogRing *ring = local();
+    LogRecord *rec = reserve(ring, level);
+    if (rec == nullptr)
+    {
+        va_end(ap);
+        return;
+    }
+    rec->route = nullptr;
+    int n = vsnprintf(rec->text, LOG_TEXT_MAX, fmt, ap);
+    va_end(ap);
+    rec->len = n < 0 ? 0 : (n < LOG_TEXT_MAX ? n : LOG_TEXT_MAX - 1);
+    commit(ring);
+}
+
+uint64_t AccessLog::dropped()
+{
+    uint64_t total = 0;
+    pthread_mutex_lock(&s_lock);
+    for (LogRing *ring : s_rings)
+        total += ring->dropped.load(std::memory_order_relaxed);
+    pthread_mutex_unlock(&s_lock);
+    return total;
+}
+
+void AccessLog::format(const LogRecord &rec, std::string &buf)
+{
+    static const char *levels[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+    time_t sec = rec.time_ns / 1000000000ull;
+    if (sec != s_lastSec)
+    {
+        struct tm tm;
+        localtime_r(&sec, &tm);
+        strftime(s_timeBuf, sizeof(s_timeBuf), "%Y-%m-%d %H:%M:%S", &tm);
+        s_lastSec = sec;
+    }
+    char line[96];
+    snprintf(line, sizeof(line), "%s.%03u %s ", s_timeBuf, (unsigned)(rec.time_ns / 1000000 % 1000),
+             levels[rec.level < LOG_OFF ? rec.level : (int)LOG_ERROR]);
+    buf.append(line);
+    if (rec.route == nullptr)
+    {
+        buf.append(rec.text, rec.len).push_back('\n');
+        return;
+    }
+    buf.append(rec.method).push_back(' ');
+    buf.append(rec.text, rec.len);
+    snprintf(line, sizeof(line), " %u %llu %.3fms %s\n", rec.status, (unsigned long long)rec.bytes,
+             rec.elapsed_us / 1000.0, rec.route);
+    buf.append(line);
+}
+
+void AccessLog::drain(std::string &buf)
+{
+    // 缓冲区只增加不释放，复制一份列表后不用持有锁，格式化和写文件时新线程可以注册
+    static std::vector<LogRing *> rings;
+    pthread_mutex_lock(&s_lock);
+    rings = s_rings;
+    pthread_mutex_unlock(&s_lock);
+
+    uint64_t count = 0, dropped = 0;
+    for (LogRing *ring : rings)
+    {
+        uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        for (; tail < head; tail++)
+        {
+            format(ring->records[tail & (LOG_RING_SIZE - 1)], buf);
+            count++;
+            if (buf.size() >= LOG_BATCH_BYTES)
+                flush(buf);
+        }
+        ring->tail.store(tail, std::memory_order_release);
+        dropped += ring->dropped.load(std::memory_order_relaxed);
+    }
+    s_written.fetch_add(count, std::memory_order_relaxed);
+
+    // 过载时丢掉了记录，在日志中说明
+    if (dropped > s_reported)
+    {
+        LogRecord rec;
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        rec.time_ns = ts.tv_sec * 1000000000ull + ts.tv_nsec;
+        rec.level = LOG_WARN;
+        rec.route = nullptr;
+        int n = snprintf(rec.text, sizeof(rec.text), "日志缓冲区已满，丢弃了%llu条记录",
+                         (unsigned long long)(dropped - s_reported));
+        rec.len = n < LOG_TEXT_MAX ? n : LOG_TEXT_MAX - 1;
+        format(rec, buf);
+        s_reported = dropped;
+    }
+}
+
+void AccessLog::flush(std::string &buf)
+{
+    size_t pos = 0;
+    while (pos < buf.size())
+    {
+        ssize_t n = write(s_fd, buf.data() + pos, buf.size() - pos);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        pos += n;
+    }
+    buf.clear();
+}
+
+void *AccessLog::run(void *arg)
+{
+    (void)arg;
+    std::string buf;
+    buf.reserve(LOG_BATCH_BYTES * 2);
+    pthread_mutex_lock(&s_lock);
+    while (s_running)
+    {
+        // 定期醒来，工作线程写记录时不需要通知后台线程
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += LOG_FLUSH_MS * 1000000L;
+        ts.tv_sec += ts.tv_nsec / 1000000000L;
+        ts.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&s_cond, &s_lock, &ts);
+        pthread_mutex_unlock(&s_lock);
+        drain(buf);
+        flush(buf);
+        pthread_mutex_lock(&s_lock);
+    }
+    pthread_mutex_unlock(&s_lock);
+    drain(buf);
+    flush(buf);
+    return nullptr;
+}
+
+#endif
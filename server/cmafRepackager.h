@@ -0,0 +1,680 @@
+#ifndef _CMAFREPACKAGER_H
+#define _CMAFREPACKAGER_H
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "tsIndexer.h"
+
+#define CMAF_INIT_EXT ".mp4"    // 初始化段的扩展名
+#define CMAF_SEGMENT_EXT ".m4s" // 媒体段的扩展名
+
+// 重新封装的结果
+struct CmafSegment
+{
+    // 初始化段（ftyp+moov），同一路流的参数不变时每个切片都相同
+    std::string init;
+    // 媒体段（styp+moof+mdat）
+    std::string fragment;
+    // 视频的分辨率，没有视频时为0
+    int width;
+    int height;
+};
+
+// 把上传的MPEG-TS切片重新封装成CMAF（分片MP4），不重新编码
+// 解出视频和音频的PES，H.264的Annex B码流改成长度前缀的样本，SPS/PPS放进avcC，
+// AAC去掉ADTS头，配置放进esds。整个切片生成一个moof+mdat，两条轨道各一个traf。
+// 只支持H.264视频和AAC音频，其他格式的切片仍然以TS提供。
+class CmafRepackager
+{
+public:
+    // 转换一个完整的切片，index是上传时扫描得到的索引，用其中的PID和流类型
+    // sequence是moof的序号，同一路流中应该递增。成功返回0，格式不支持或者数据不完整时返回-1
+    int repackage(const uint8_t *data, size_t len, const TsIndex &index, uint32_t sequence, CmafSegment &out);
+
+private:
+    struct Sample
+    {
+        uint32_t size;
+        uint32_t duration;
+        uint32_t cts;
+        bool sync;
+        int64_t dts;
+    };
+    struct Track
+    {
+        int pid;
+        uint32_t id;
+        uint32_t timescale;
+        // 正在拼接的PES，以及它的时间戳
+        std::string pes;
+        std::vector<Sample> samples;
+        // 按顺序保存的样本数据
+        std::string mdat;
+        // 第一个样本的解码时间，单位是timescale
+        uint64_t base;
+    };
+
+    // 拼接好一个PES后按轨道类型拆成样本
+    void flush(Track &track);
+    void video_pes(const uint8_t *p, size_t len, int64_t pts, int64_t dts);
+    void audio_pes(const uint8_t *p, size_t len, int64_t pts);
+    int64_t unwrap(int64_t ts);
+
+    // 解析SPS得到分辨率，失败返回false
+    static bool parse_sps(const std::string &sps, int &width, int &height);
+
+    void write_init(std::string &out);
+    void write_fragment(std::string &out, uint32_t sequence);
+    void write_trak(std::string &out, const Track &track);
+    void write_traf(std::string &out, const Track &track, size_t &data_offset_pos);
+
+private:
+    Track m_video;
+    Track m_audio;
+    bool m_hasAudio;
+    int64_t m_base;
+    // 最后一个视频帧的时长
+    int64_t m_frameDuration;
+    std::string m_sps;
+    std::string m_pps;
+    int m_width;
+    int m_height;
+    // AAC的AudioSpecificConfig和参数
+    uint8_t m_asc[2];
+    uint32_t m_sampleRate;
+    int m_channels;
+    bool m_failed;
+};
+
+namespace mp4
+{
+// 按大端序写入box，begin返回box的起始位置，end时回填长度
+inline void u8(std::string &o, uint8_t v) { o.push_back((char)v); }
+inline void u16(std::string &o, uint16_t v)
+{
+    o.push_back((char)(v >> 8));
+    o.push_back((char)v);
+}
+inline void u32(std::string &o, uint32_t v)
+{
+    u16(o, v >> 16);
+    u16(o, v);
+}
+inline void u64(std::string &o, uint64_t v)
+{
+    u32(o, v >> 32);
+    u32(o, v);
+}
+inline void put32(std::string &o, size_t pos, uint32_t v)
+{
+    o[pos] = (char)(v >> 24);
+    o[pos + 1] = (char)(v >> 16);
+    o[pos + 2] = (char)(v >> 8);
+    o[pos + 3] = (char)v;
+}
+inline size_t begin(std::string &o, const char *type)
+{
+    size_t pos = o.size();
+    u32(o, 0);
+    o.append(type, 4);
+    return pos;
+}
+inline size_t full(std::string &o, const char *type, uint8_t version, uint32_t flags)
+{
+    size_t pos = begin(o, type);
+    u32(o, ((uint32_t)version << 24) | flags);
+    return pos;
+}
+inline void end(std::string &o, size_t pos) { put32(o, pos, o.size() - pos); }
+// 单位矩阵
+inline void matrix(std::string &o)
+{
+    const uint32_t m[9] = {0x00010000, 0, 0, 0, 0x00010000, 0, 0, 0, 0x40000000};
+    for (uint32_t v : m)
+        u32(o, v);
+}
+} // namespace mp4
+
+// 去掉防竞争字节后按位读取，用来解析SPS
+class BitReader
+{
+public:
+    BitReader(const std::string &nal) : m_pos(0)
+    {
+        for (size_t i = 0; i < nal.size(); i++)
+        {
+            if (i >= 2 && nal[i] == 3 && nal[i - 1] == 0 && nal[i - 2] == 0)
+                continue;
+            m_data.push_back(nal[i]);
+        }
+    }
+    bool eof() const { return m_pos >= m_data.size() * 8; }
+    uint32_t bit()
+    {
+        if (eof())
+            return 0;
+        uint32_t b = ((uint8_t)m_data[m_pos / 8] >> (7 - m_pos % 8)) & 1;
+        m_pos++;
+        return b;
+    }
+    uint32_t bits(int n)
+    {
+        uint32_t v = 0;
+        while (n-- > 0)
+            v = (v << 1) | bit();
+        return v;
+    }
+    // 指数哥伦布编码
+    uint32_t ue()
+    {
+        int zeros = 0;
+        while (!eof() && bit() == 0 && zeros < 32)
+            zeros++;
+        return ((1u << zeros) - 1) + bits(zeros);
+    }
+    int32_t se()
+    {
+        uint32_t v = ue();
+        return (v & 1) ? (int32_t)((v + 1) / 2) : -(int32_t)(v / 2);
+    }
+
+private:
+    std::string m_data;
+    size_t m_pos;
+};
+
+int CmafRepackager::repackage(const uint8_t *data, size_t len, const TsIndex &index, uint32_t sequence,
+                              CmafSegment &out)
+{
+    // 只支持H.264，音频只支持AAC（没有音频也可以）
+    if (index.video_pid < 0 || index.video_type != 0x1b)
+        return -1;
+    m_hasAudio = index.audio_pid >= 0;
+    if (m_hasAudio && index.audio_type != 0x0f)
+        return -1;
+
+    m_video = Track{index.video_pid, 1, TS_CLOCK, "", {}, "", 0};
+    m_audio = Track{index.audio_pid, 2, 0, "", {}, "", 0};
+    m_base = -1;
+    m_frameDuration = index.frame_duration;
+    m_sps.clear();
+    m_pps.clear();
+    m_width = m_height = 0;
+    m_sampleRate = 0;
+    m_channels = 0;
+    m_failed = false;
+
+    // 按PID拼接PES，遇到下一个PES的开头时处理上一个
+    for (size_t off = 0; off + TS_PACKET_SIZE <= len; off += TS_PACKET_SIZE)
+    {
+        const uint8_t *p = data + off;
+        if (p[0] != TS_SYNC_BYTE)
+            return -1;
+        int pid = ((p[1] & 0x1f) << 8) | p[2];
+        Track *track = pid == m_video.pid ? &m_video : (m_hasAudio && pid == m_audio.pid) ? &m_audio : nullptr;
+        int afc = (p[3] >> 4) & 0x3;
+        if (track == nullptr || !(afc & 0x1))
+            continue;
+        size_t pos = (afc & 0x2) ? 5 + p[4] : 4;
+        if (pos >= TS_PACKET_SIZE)
+            continue;
+        if (p[1] & 0x40)
+            flush(*track);
+        track->pes.append(reinterpret_cast<const char *>(p + pos), TS_PACKET_SIZE - pos);
+    }
+    flush(m_video);
+    if (m_hasAudio)
+        flush(m_audio);
+
+    if (m_failed || m_video.samples.empty() || m_sps.empty() || m_pps.empty() ||
+        !parse_sps(m_sps, m_width, m_height))
+        return -1;
+    if (m_hasAudio && (m_audio.samples.empty() || m_sampleRate == 0))
+        m_hasAudio = false;
+
+    // 视频帧的时长是相邻两帧的DTS之差，最后一帧按帧间隔
+    std::vector<Sample> &v = m_video.samples;
+    for (size_t i = 0; i + 1 < v.size(); i++)
+        v[i].duration = v[i + 1].dts > v[i].dts ? v[i + 1].dts - v[i].dts : 0;
+    int64_t last = m_frameDuration > 0 ? m_frameDuration : (v.size() > 1 ? v[v.size() - 2].duration : TS_CLOCK / 25);
+    v.back().duration = last;
+    m_video.base = v.front().dts;
+
+    out.init.clear();
+    out.fragment.clear();
+    write_init(out.init);
+    write_fragment(out.fragment, sequence);
+    out.width = m_width;
+    out.height = m_height;
+    return 0;
+}
+
+int64_t CmafRepackager::unwrap(int64_t ts)
+{
+    const int64_t wrap = 1ll << 33;
+    if (m_base < 0)
+        m_base = ts;
+    while (ts < m_base - wrap / 2)
+        ts += wrap;
+    return ts;
+}
+
+void CmafRepackager::flush(Track &track)
+{
+    std::string pes;
+    pes.swap(track.pes);
+    const uint8_t *p = reinterpret_cast<const uint8_t *>(pes.data());
+    if (pes.size() < 14 || p[0] != 0 || p[1] != 0 || p[2] != 1)
+        return;
+    int flags = p[7] >> 6;
+    size_t header_len = 9 + p[8];
+    // PTS在p[9..13]，DTS在p[14..18]，都要在PES头之内
+    if (!(flags & 0x2) || header_len >= pes.size() || header_len < 14 ||
+        ((flags & 0x1) && header_len < 19))
+    {
+        m_failed = true;
+        return;
+    }
+    // 带长度的PES去掉末尾的填充
+    size_t end = pes.size();
+    size_t pes_len = (p[4] << 8) | p[5];
+    if (pes_len > 0 && 6 + pes_len < end)
+        end = 6 + pes_len;
+    int64_t pts = unwrap(TsIndexer::read_timestamp(p + 9));
+    int64_t dts = (flags & 0x1) ? unwrap(TsIndexer::read_timestamp(p + 14)) : pts;
+    if (&track == &m_video)
+        video_pes(p + header_len, end - header_len, pts, dts);
+    else
+        audio_pes(p + header_len, end - header_len, pts);
+}
+
+void CmafRepackager::video_pes(const uint8_t *p, size_t len, int64_t pts, int64_t dts)
+{
+    // 按起始码拆出NAL，去掉AUD，SPS/PPS放进avcC，其余的加上4字节长度
+    Sample s{0, 0, (uint32_t)(pts > dts ? pts - dts : 0), false, dts};
+    size_t i = 0;
+    while (i + 3 <= len && !(p[i] == 0 && p[i + 1] == 0 && p[i + 2] == 1))
+        i++;
+    while (i + 3 <= len)
+    {
+        size_t start = i + 3;
+        size_t next = start;
+        while (next + 3 <= len && !(p[next] == 0 && p[next + 1] == 0 && p[next + 2] == 1))
+            next++;
+        if (next + 3 > len)
+            next = len;
+        // 四字节起始码的第一个0属于上一个NAL的末尾
+        size_t nal_end = next;
+        while (nal_end > start && p[nal_end - 1] == 0)
+            nal_end--;
+        if (nal_end > start)
+        {
+            int type = p[start] & 0x1f;
+            std::string nal(reinterpret_cast<const char *>(p + start), nal_end - start);
+            if (type == 7 && m_sps.empty())
+                m_sps = nal;
+            else if (type == 8 && m_pps.empty())
+                m_pps = nal;
+            else if (type != 7 && type != 8 && type != 9)
+            {
+                if (type == 5)
+                    s.sync = true;
+                mp4::u32(m_video.mdat, nal.size());
+                m_video.mdat.append(nal);
+                s.size += 4 + nal.size();
+            }
+        }
+        i = next;
+    }
+    if (s.size > 0)
+        m_video.samples.push_back(s);
+}
+
+void CmafRepackager::audio_pes(const uint8_t *p, size_t len, int64_t pts)
+{
+    static const uint32_t rates[] = {96000, 88200, 64000, 48000, 44100, 32000, 24000,
+                                     22050, 16000, 12000, 11025, 8000, 7350};
+    size_t i = 0;
+    while (i + 7 <= len)
+    {
+        if (p[i] != 0xff || (p[i + 1] & 0xf0) != 0xf0)
+        {
+            m_failed = true;
+            return;
+        }
+        size_t header = (p[i + 1] & 0x1) ? 7 : 9;
+        int object = (p[i + 2] >> 6) + 1;
+        int rate_index = (p[i + 2] >> 2) & 0xf;
+        int channels = ((p[i + 2] & 0x1) << 2) | (p[i + 3] >> 6);
+        size_t frame_len = ((p[i + 3] & 0x3) << 11) | (p[i + 4] << 3) | (p[i + 5] >> 5);
+        if (rate_index >= 13 || frame_len <= header || i + frame_len > len)
+        {
+            m_failed = true;
+            return;
+        }
+        if (m_sampleRate == 0)
+        {
+            m_sampleRate = rates[rate_index];
+            m_channels = channels;
+            m_asc[0] = (object << 3) | (rate_index >> 1);
+            m_asc[1] = ((rate_index & 1) << 7) | (channels << 3);
+            m_audio.timescale = m_sampleRate;
+            m_audio.base = (uint64_t)((pts * m_sampleRate + TS_CLOCK / 2) / TS_CLOCK);
+        }
+        // 每个AAC帧1024个采样，时间连续
+        m_audio.samples.push_back(Sample{(uint32_t)(frame_len - header), 1024, 0, true, 0});
+        m_audio.mdat.append(reinterpret_cast<const char *>(p + i + header), frame_len - header);
+        i += frame_len;
+    }
+}
+
+bool CmafRepackager::parse_sps(const std::string &sps, int &width, int &height)
+{
+    if (sps.size() < 4)
+        return false;
+    BitReader br(sps.substr(1));
+    uint32_t profile = br.bits(8);
+    br.bits(16); // constraint_set标志和level
+    br.ue();     // seq_parameter_set_id
+    uint32_t chroma = 1;
+    if (profile == 100 || profile == 110 || profile == 122 || profile == 244 || profile == 44 || profile == 83 ||
+        profile == 86 || profile == 118 || profile == 128 || profile == 138 || profile == 139 || profile == 134 ||
+        profile == 135)
+    {
+        chroma = br.ue();
+        if (chroma == 3)
+            br.bit(); // separate_colour_plane_flag
+        br.ue();      // bit_depth_luma
+        br.ue();      // bit_depth_chroma
+        br.bit();     // qpprime_y_zero_transform_bypass_flag
+        if (br.bit()) // seq_scaling_matrix_present_flag
+        {
+            for (int i = 0; i < (chroma != 3 ? 8 : 12); i++)
+            {
+                if (!br.bit())
+                    continue;
+                int size = i < 6 ? 16 : 64;
+                int last = 8, next = 8;
+                for (int j = 0; j < size && next != 0; j++)
+                {
+                    next = (last + br.se() + 256) % 256;
+                    last = next == 0 ? last : next;
+                }
+            }
+        }
+    }
+    br.ue(); // log2_max_frame_num_minus4
+    uint32_t poc_type = br.ue();
+    if (poc_type == 0)
+        br.ue();
+    else if (poc_type == 1)
+    {
+        br.bit();
+        br.se();
+        br.se();
+        uint32_t n = br.ue();
+        for (uint32_t i = 0; i < n && !br.eof(); i++)
+            br.se();
+    }
+    br.ue();  // max_num_ref_frames
+    br.bit(); // gaps_in_frame_num_value_allowed_flag
+    uint32_t mbs_w = br.ue() + 1;
+    uint32_t map_h = br.ue() + 1;
+    uint32_t frame_mbs_only = br.bit();
+    if (!frame_mbs_only)
+        br.bit(); // mb_adaptive_frame_field_flag
+    br.bit();     // direct_8x8_inference_flag
+    uint32_t crop_l = 0, crop_r = 0, crop_t = 0, crop_b = 0;
+    if (br.bit())
+    {
+        crop_l = br.ue();
+        crop_r = br.ue();
+        crop_t = br.ue();
+        crop_b = br.ue();
+    }
+    if (br.eof())
+        return false;
+    // 4:2:0时裁剪单位是2个像素，场编码时高度方向再乘2
+    uint32_t unit_x = chroma == 0 || chroma == 3 ? 1 : 2;
+    uint32_t unit_y = (chroma == 1 ? 2 : 1) * (2 - frame_mbs_only);
+    width = mbs_w * 16 - unit_x * (crop_l + crop_r);
+    height = (2 - frame_mbs_only) * map_h * 16 - unit_y * (crop_t + crop_b);
+    return width > 0 && height > 0;
+}
+
+void CmafRepackager::write_init(std::string &o)
+{
+    size_t ftyp = mp4::begin(o, "ftyp");
+    o.append("iso6", 4);
+    mp4::u32(o, 0);
+    o.append("iso6cmfcisommp41", 16);
+    mp4::end(o, ftyp);
+
+    size_t moov = mp4::begin(o, "moov");
+    size_t mvhd = mp4::full(o, "mvhd", 0, 0);
+    mp4::u32(o, 0);    // creation_time
+    mp4::u32(o, 0);    // modification_time
+    mp4::u32(o, 1000); // timescale
+    mp4::u32(o, 0);    // duration
+    mp4::u32(o, 0x00010000);
+    mp4::u16(o, 0x0100);
+    o.append(10, '\0');
+    mp4::matrix(o);
+    o.append(24, '\0');
+    mp4::u32(o, m_hasAudio ? 3 : 2); // next_track_ID
+    mp4::end(o, mvhd);
+
+    write_trak(o, m_video);
+    if (m_hasAudio)
+        write_trak(o, m_audio);
+
+    size_t mvex = mp4::begin(o, "mvex");
+    for (int i = 0; i < (m_hasAudio ? 2 : 1); i++)
+    {
+        size_t trex = mp4::full(o, "trex", 0, 0);
+        mp4::u32(o, i + 1); // track_ID
+        mp4::u32(o, 1);     // default_sample_description_index
+        mp4::u32(o, 0);
+        mp4::u32(o, 0);
+        mp4::u32(o, 0);
+        mp4::end(o, trex);
+    }
+    mp4::end(o, mvex);
+    mp4::end(o, moov);
+}
+
+void CmafRepackager::write_trak(std::string &o, const Track &track)
+{
+    bool video = &track == &m_video;
+    size_t trak = mp4::begin(o, "trak");
+
+    size_t tkhd = mp4::full(o, "tkhd", 0, 0x3); // enabled | in_movie
+    mp4::u32(o, 0);
+    mp4::u32(o, 0);
+    mp4::u32(o, track.id);
+    mp4::u32(o, 0);
+    mp4::u32(o, 0); // duration
+    o.append(8, '\0');
+    mp4::u16(o, 0); // layer
+    mp4::u16(o, 0); // alternate_group
+    mp4::u16(o, video ? 0 : 0x0100);
+    mp4::u16(o, 0);
+    mp4::matrix(o);
+    mp4::u32(o, video ? (uint32_t)m_width << 16 : 0);
+    mp4::u32(o, video ? (uint32_t)m_height << 16 : 0);
+    mp4::end(o, tkhd);
+
+    size_t mdia = mp4::begin(o, "mdia");
+    size_t mdhd = mp4::full(o, "mdhd", 0, 0);
+    mp4::u32(o, 0);
+    mp4::u32(o, 0);
+    mp4::u32(o, track.timescale);
+    mp4::u32(o, 0);
+    mp4::u16(o, 0x55c4); // und
+    mp4::u16(o, 0);
+    mp4::end(o, mdhd);
+
+    size_t hdlr = mp4::full(o, "hdlr", 0, 0);
+    mp4::u32(o, 0);
+    o.append(video ? "vide" : "soun", 4);
+    o.append(12, '\0');
+    const char *name = video ? "VideoHandler" : "SoundHandler";
+    o.append(name, strlen(name) + 1);
+    mp4::end(o, hdlr);
+
+    size_t minf = mp4::begin(o, "minf");
+    if (video)
+    {
+        size_t vmhd = mp4::full(o, "vmhd", 0, 1);
+        o.append(8, '\0');
+        mp4::end(o, vmhd);
+    }
+    else
+    {
+        size_t smhd = mp4::full(o, "smhd", 0, 0);
+        o.append(4, '\0');
+        mp4::end(o, smhd);
+    }
+    size_t dinf = mp4::begin(o, "dinf");
+    size_t dref = mp4::full(o, "dref", 0, 0);
+    mp4::u32(o, 1);
+    size_t url = mp4::full(o, "url ", 0, 1); // 数据在同一个文件中
+    mp4::end(o, url);
+    mp4::end(o, dref);
+    mp4::end(o, dinf);
+
+    size_t stbl = mp4::begin(o, "stbl");
+    size_t stsd = mp4::full(o, "stsd", 0, 0);
+    mp4::u32(o, 1);
+    if (video)
+    {
+        size_t avc1 = mp4::begin(o, "avc1");
+        o.append(6, '\0');
+        mp4::u16(o, 1); // data_reference_index
+        o.append(16, '\0');
+        mp4::u16(o, m_width);
+        mp4::u16(o, m_height);
+        mp4::u32(o, 0x00480000); // 72dpi
+        mp4::u32(o, 0x00480000);
+        mp4::u32(o, 0);
+        mp4::u16(o, 1); // frame_count
+        o.append(32, '\0');
+        mp4::u16(o, 0x0018);
+        mp4::u16(o, 0xffff);
+        size_t avcc = mp4::begin(o, "avcC");
+        mp4::u8(o, 1);
+        o.append(m_sps, 1, 3); // profile, compatibility, level
+        mp4::u8(o, 0xff);      // 4字节长度前缀
+        mp4::u8(o, 0xe1);
+        mp4::u16(o, m_sps.size());
+        o.append(m_sps);
+        mp4::u8(o, 1);
+        mp4::u16(o, m_pps.size());
+        o.append(m_pps);
+        mp4::end(o, avcc);
+        mp4::end(o, avc1);
+    }
+    else
+    {
+        size_t mp4a = mp4::begin(o, "mp4a");
+        o.append(6, '\0');
+        mp4::u16(o, 1);
+        o.append(8, '\0');
+        mp4::u16(o, m_channels);
+        mp4::u16(o, 16);
+        mp4::u32(o, 0);
+        mp4::u32(o, m_sampleRate << 16);
+        // ES_Descriptor > DecoderConfigDescriptor > DecoderSpecificInfo, SLConfigDescriptor
+        size_t esds = mp4::full(o, "esds", 0, 0);
+        const uint8_t desc[] = {0x03, 25, 0, 0, 0,                  // ES_ID, flags
+                                0x04, 17, 0x40, 0x15, 0, 0, 0,      // AAC, audio stream
+                                0, 0, 0, 0, 0, 0, 0, 0,             // max/avg bitrate
+                                0x05, 2, m_asc[0], m_asc[1], 0x06, 1, 0x02};
+        o.append(reinterpret_cast<const char *>(desc), sizeof(desc));
+        mp4::end(o, esds);
+        mp4::end(o, mp4a);
+    }
+    mp4::end(o, stsd);
+    // 样本都在分片中，这里的表都为空
+    const char *tables[] = {"stts", "stsc", "stco"};
+    for (const char *t : tables)
+    {
+        size_t box = mp4::full(o, t, 0, 0);
+        mp4::u32(o, 0);
+        mp4::end(o, box);
+    }
+    size_t stsz = mp4::full(o, "stsz", 0, 0);
+    mp4::u32(o, 0);
+    mp4::u32(o, 0);
+    mp4::end(o, stsz);
+    mp4::end(o, stbl);
+    mp4::end(o, minf);
+    mp4::end(o, mdia);
+    mp4::end(o, trak);
+}
+
+void CmafRepackager::write_fragment(std::string &o, uint32_t sequence)
+{
+    size_t styp = mp4::begin(o, "styp");
+    o.append("msdh", 4);
+    mp4::u32(o, 0);
+    o.append("msdhmsixcmfs", 12);
+    mp4::end(o, styp);
+
+    size_t moof = mp4::begin(o, "moof");
+    size_t mfhd = mp4::full(o, "mfhd", 0, 0);
+    mp4::u32(o, sequence);
+    mp4::end(o, mfhd);
+    size_t video_offset, audio_offset = 0;
+    write_traf(o, m_video, video_offset);
+    if (m_hasAudio)
+        write_traf(o, m_audio, audio_offset);
+    mp4::end(o, moof);
+
+    // data_offset相对于moof的开头
+    size_t moof_size = o.size() - moof;
+    mp4::put32(o, video_offset, moof_size + 8);
+    if (m_hasAudio)
+        mp4::put32(o, audio_offset, moof_size + 8 + m_video.mdat.size());
+
+    size_t mdat_size = 8 + m_video.mdat.size() + (m_hasAudio ? m_audio.mdat.size() : 0);
+    mp4::u32(o, mdat_size);
+    o.append("mdat", 4);
+    o.append(m_video.mdat);
+    if (m_hasAudio)
+        o.append(m_audio.mdat);
+}
+
+void CmafRepackager::write_traf(std::string &o, const Track &track, size_t &data_offset_pos)
+{
+    bool video = &track == &m_video;
+    size_t traf = mp4::begin(o, "traf");
+    size_t tfhd = mp4::full(o, "tfhd", 0, 0x020000); // default-base-is-moof
+    mp4::u32(o, track.id);
+    mp4::end(o, tfhd);
+    size_t tfdt = mp4::full(o, "tfdt", 1, 0);
+    mp4::u64(o, track.base);
+    mp4::end(o, tfdt);
+
+    // data_offset、每个样本的时长、大小、标志，视频还有显示时间偏移
+    uint32_t flags = 0x000001 | 0x000100 | 0x000200 | 0x000400 | (video ? 0x000800 : 0);
+    size_t trun = mp4::full(o, "trun", 0, flags);
+    mp4::u32(o, track.samples.size());
+    data_offset_pos = o.size();
+    mp4::u32(o, 0);
+    for (const Sample &s : track.samples)
+    {
+        mp4::u32(o, s.duration);
+        mp4::u32(o, s.size);
+        // 关键帧不依赖其他帧，其余的帧是非同步样本
+        mp4::u32(o, s.sync ? 0x02000000 : 0x01010000);
+        if (video)
+            mp4::u32(o, s.cts);
+    }
+    mp4::end(o, trun);
+    mp4::end(o, traf);
+}
+
+#endif
@@ -0,0 +1,260 @@
+#ifndef _CONFIG_H
+#define _CONFIG_H
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "eventLoop.h"
+#include "segmentCache.h"
+#include "playlist.h"
+#include "upload.h"
+#include "diskWriter.h"
+#include "accessLog.h"
+#include "shard.h"
+
+#define PORT 8080
+#define THREAD_MIN 8  // 线程池最少线程数
+#define THREAD_MAX 10 // 线程池最多线程数
+
+// 服务端的运行参数，默认值来自各个模块的宏定义，可以通过命令行修改
+struct ServerConfig
+{
+    int port;
+    // 监听队列长度
+    int backlog;
+    // 分片数，每个分片一个SO_REUSEPORT监听socket和自己的事件循环、线程池，0表示每个CPU一个
+    int shards;
+    // 多个分片时是否把每个分片绑定到一个CPU上
+    bool pin_cpu;
+    int thread_min;
+    int thread_max;
+    // 长连接空闲超时（秒）和每个连接最多处理的请求数
+    int idle_timeout;
+    int max_requests;
+    // 是否使用sendfile发送文件
+    bool sendfile;
+    // 文件缓存大小（字节），0表示不使用缓存
+    size_t cache_bytes;
+    // 直播播放列表中保留的切片数
+    int playlist_window;
+    // 低延迟直播部分切片的目标时长（秒），0表示关闭
+    double part_target;
+    // 整段录像模式，切片追加到每路流的一个文件中
+    bool archive;
+    // 上传的TS切片转换成CMAF（fMP4）提供，不能和整段录像、部分切片同时使用
+    bool cmaf;
+    // 上传切片的持久化策略，以及组提交时一组最多等待的时间（毫秒）
+    int durability;
+    int group_commit_ms;
+    // 线程池中等待执行的请求数上限，超过时回复503
+    int queue_capacity;
+    // 缓存在内存中的请求体的最大长度（字节），超过时回复413，流式上传的切片不受限制
+    size_t max_body;
+    // 使用io_uring代替epoll处理网络读写
+    bool io_uring;
+    // 访问日志的级别、采样比例（每N条INFO记录保留一条）和文件，"-"表示标准输出
+    int log_level;
+    int log_sample;
+    const char *access_log;
+
+    ServerConfig()
+        : port(PORT), backlog(LISTEN_BACKLOG), shards(1), pin_cpu(true), thread_min(THREAD_MIN), thread_max(THREAD_MAX),
+          idle_timeout(IDLE_TIMEOUT), max_requests(MAX_REQUESTS), sendfile(true),
+          cache_bytes((size_t)CACHE_SIZE_MB << 20), playlist_window(PLAYLIST_WINDOW),
+          part_target(PART_TARGET), archive(false), cmaf(false), durability(DURABILITY_NONE),
+          group_commit_ms(GROUP_COMMIT_MS), queue_capacity(QUEUE_CAPACITY), max_body(MAX_BODY_SIZE),
+          io_uring(false),
+          log_level(LOG_INFO), log_sample(1), access_log("-") {}
+
+    // 解析命令行参数，参数错误时打印用法并退出
+    void parse(int argc, char *argv[]);
+    void usage(const char *prog);
+};
+
+void ServerConfig::usage(const char *prog)
+{
+    fprintf(stderr,
+            "用法: %s [选项]\n"
+            "  --port N            监听端口 (默认 %d)\n"
+            "  --backlog N         监听队列长度 (默认 %d)\n"
+            "  --shards N          分片数，每个分片有自己的监听socket（SO_REUSEPORT）、事件循环和线程池，0表示每个CPU一个 (默认 1)\n"
+            "  --no-pin            多个分片时不把分片的事件循环和工作线程绑定到CPU上\n"
+            "  --threads MIN:MAX   线程池线程数，多个分片时平均分给各个分片 (默认 %d:%d)\n"
+            "  --idle-timeout SEC  长连接空闲超时 (默认 %d)\n"
+            "  --max-requests N    每个长连接最多处理的请求数 (默认 %d)\n"
+            "  --queue N           排队等待处理的请求数上限，超过时回复503，0表示不限制 (默认 %d)\n"
+            "  --max-body BYTES    不流式接收的请求体的最大长度，超过时回复413 (默认 %d)\n"
+            "  --no-sendfile       使用pread+send代替sendfile\n"
+            "  --io-uring          使用io_uring代替epoll，编译时需要打开HLS_IO_URING\n"
+            "  --cache-mb N        文件缓存大小，0表示关闭 (默认 %d)\n"
+            "  --window N          直播播放列表保留的切片数 (默认 %d)\n"
+            "  --part-target SEC   低延迟直播部分切片的时长，0表示关闭 (默认 %.1f)\n"
+            "  --archive           上传的切片追加到每路流的" ARCHIVE_NAME "，播放列表使用EXT-X-BYTERANGE\n"
+            "  --cmaf              上传的TS切片转换成fMP4（.m4s + 初始化段），播放列表使用EXT-X-MAP，关闭部分切片\n"
+            "  --durability MODE   上传切片的持久化策略 none|fdatasync|group，落盘后才回复推流端 (默认 none)\n"
+            "  --group-commit-ms N group模式下一组切片最多等待的时间 (默认 %d)\n"
+            "  --log-level LEVEL   访问日志级别 debug|info|warn|error|off (默认 info)\n"
+            "  --log-sample N      INFO及以下的访问日志每N条记录一条，警告和错误总是记录 (默认 1)\n"
+            "  --access-log FILE   访问日志文件，-表示标准输出 (默认 -)\n",
+            prog, PORT, LISTEN_BACKLOG, THREAD_MIN, THREAD_MAX, IDLE_TIMEOUT, MAX_REQUESTS, QUEUE_CAPACITY, MAX_BODY_SIZE, CACHE_SIZE_MB, PLAYLIST_WINDOW,
+            PART_TARGET, GROUP_COMMIT_MS);
+}
+
+void ServerConfig::parse(int argc, char *argv[])
+{
+    enum
+    {
+        OPT_PORT = 256,
+        OPT_BACKLOG,
+        OPT_SHARDS,
+        OPT_NO_PIN,
+        OPT_THREADS,
+        OPT_IDLE_TIMEOUT,
+        OPT_MAX_REQUESTS,
+        OPT_QUEUE,
+        OPT_MAX_BODY,
+        OPT_NO_SENDFILE,
+        OPT_IO_URING,
+        OPT_CACHE_MB,
+        OPT_WINDOW,
+        OPT_PART_TARGET,
+        OPT_ARCHIVE,
+        OPT_CMAF,
+        OPT_DURABILITY,
+        OPT_GROUP_COMMIT_MS,
+        OPT_LOG_LEVEL,
+        OPT_LOG_SAMPLE,
+        OPT_ACCESS_LOG,
+    };
+    static const struct option options[] = {
+        {"port", required_argument, NULL, OPT_PORT},
+        {"backlog", required_argument, NULL, OPT_BACKLOG},
+        {"shards", required_argument, NULL, OPT_SHARDS},
+        {"no-pin", no_argument, NULL, OPT_NO_PIN},
+        {"threads", required_argument, NULL, OPT_THREADS},
+        {"idle-timeout", required_argument, NULL, OPT_IDLE_TIMEOUT},
+        {"max-requests", required_argument, NULL, OPT_MAX_REQUESTS},
+        {"queue", required_argument, NULL, OPT_QUEUE},
+        {"max-body", required_argument, NULL, OPT_MAX_BODY},
+        {"no-sendfile", no_argument, NULL, OPT_NO_SENDFILE},
+        {"io-uring", no_argument, NULL, OPT_IO_URING},
+        {"cache-mb", required_argument, NULL, OPT_CACHE_MB},
+        {"window", required_argument, NULL, OPT_WINDOW},
+        {"part-target", required_argument, NULL, OPT_PART_TARGET},
+        {"archive", no_argument, NULL, OPT_ARCHIVE},
+        {"cmaf", no_argument, NULL, OPT_CMAF},
+        {"durability", required_argument, NULL, OPT_DURABILITY},
+        {"group-commit-ms", required_argument, NULL, OPT_GROUP_COMMIT_MS},
+        {"log-level", required_argument, NULL, OPT_LOG_LEVEL},
+        {"log-sample", required_argument, NULL, OPT_LOG_SAMPLE},
+        {"access-log", required_argument, NULL, OPT_ACCESS_LOG},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}};
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "h", options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case OPT_PORT:
+            port = atoi(optarg);
+            break;
+        case OPT_BACKLOG:
+            backlog = atoi(optarg);
+            break;
+        case OPT_SHARDS:
+            shards = atoi(optarg);
+            break;
+        case OPT_NO_PIN:
+            pin_cpu = false;
+            break;
+        case OPT_THREADS:
+            if (sscanf(optarg, "%d:%d", &thread_min, &thread_max) != 2 || thread_min < 1 || thread_max < thread_min)
+            {
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_IDLE_TIMEOUT:
+            idle_timeout = atoi(optarg);
+            break;
+        case OPT_MAX_REQUESTS:
+            max_requests = atoi(optarg);
+            break;
+        case OPT_QUEUE:
+            queue_capacity = atoi(optarg);
+            break;
+        case OPT_MAX_BODY:
+            max_body = (size_t)atol(optarg);
+            break;
+        case OPT_NO_SENDFILE:
+            sendfile = false;
+            break;
+        case OPT_IO_URING:
+            io_uring = true;
+            break;
+        case OPT_CACHE_MB:
+            cache_bytes = (size_t)atol(optarg) << 20;
+            break;
+        case OPT_WINDOW:
+            playlist_window = atoi(optarg);
+            break;
+        case OPT_PART_TARGET:
+            part_target = atof(optarg);
+            break;
+        case OPT_ARCHIVE:
+            archive = true;
+            break;
+        case OPT_CMAF:
+            cmaf = true;
+            break;
+        case OPT_DURABILITY:
+            durability = DiskWriter::parse_durability(optarg);
+            if (durability < 0)
+            {
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_GROUP_COMMIT_MS:
+            group_commit_ms = atoi(optarg);
+            break;
+        case OPT_LOG_LEVEL:
+            log_level = AccessLog::parse_level(optarg);
+            if (log_level < 0)
+            {
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_LOG_SAMPLE:
+            log_sample = atoi(optarg);
+            break;
+        case OPT_ACCESS_LOG:
+            access_log = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+    if (port <= 0 || backlog <= 0 || shards < 0 || shards > SHARD_MAX || idle_timeout <= 0 || max_requests <= 0 || playlist_window <= 0 || part_target < 0 || queue_capacity < 0 ||
+        group_commit_ms < 0 || log_sample < 1)
+    {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    // 录像文件中的切片以TS引用，部分切片也是TS，和fMP4不能混在一个播放列表中
+    if (cmaf && archive)
+    {
+        fprintf(stderr, "--cmaf不能和--archive同时使用\n");
+        exit(EXIT_FAILURE);
+    }
+    if (cmaf && part_target > 0)
+    {
+        fprintf(stderr, "--cmaf模式下不生成部分切片\n");
+        part_target = 0;
+    }
+}
+
+#endif
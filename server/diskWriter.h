@@ -0,0 +1,417 @@
+#ifndef _DISKWRITER_H
+#define _DISKWRITER_H
+
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+#include "accessLog.h"
+
+#define GROUP_COMMIT_MS 10 // 组提交模式下一组最多等待的时间（毫秒）
+#define WRITE_BATCH 64     // 一次pwritev最多合并的写入个数
+#define WRITE_QUEUE_MAX (64 << 20) // 队列中还没有写入的字节数上限，超过时暂停接收上传
+#define WRITE_SPARE 256    // 写完后留着复用的数据缓冲区个数
+#define WRITE_SPARE_MAX (64 << 10) // 留着复用的缓冲区的最大容量（字节）
+
+// 切片写入磁盘后的持久化策略
+enum DURABILITY
+{
+    DURABILITY_NONE = 0,  // 写入页缓存就确认
+    DURABILITY_FDATASYNC, // 每个切片fdatasync后确认
+    DURABILITY_GROUP,     // 一段时间内完成的切片一起fdatasync后确认
+};
+
+// 由写线程写入的一个文件，最后一个引用释放时关闭
+struct WriteFile
+{
+    int fd;
+    // 正在写入的文件，以及写完后重命名成的文件（为空表示不需要重命名）
+    std::string path;
+    std::string final_path;
+    // 文件所在的目录，重命名后持久化时需要同步目录项
+    std::string dir;
+    // 写入出错后不再写入，提交时返回失败
+    std::atomic<bool> failed;
+
+    WriteFile(int fd, const std::string &path, const std::string &final_path, const std::string &dir)
+        : fd(fd), path(path), final_path(final_path), dir(dir), failed(false) {}
+    ~WriteFile()
+    {
+        if (fd >= 0)
+            close(fd);
+    }
+};
+
+// 写线程中调用的回调，status为0表示成功
+using write_callback = void (*)(WriteFile *file, void *ctx, int status);
+
+// 专门的写磁盘线程
+// 事件循环收到的上传数据拷贝一份后放入队列立即返回，写线程每次取出队列中的所有任务，
+// 写完的数据缓冲区还给队列重复使用，稳定运行后上传不再分配内存。
+// 同一个文件上连续的写入合并成一次pwritev。切片提交时按顺序排在它的所有写入之后：
+// 先重命名并调用published（此时数据已经在页缓存中，可以发布给观众），
+// 再按持久化策略同步到磁盘后调用durable（用来给推流端确认）。
+// 推流端写磁盘的快慢不再影响线程池，也就不影响拉流的请求。
+// 磁盘比网络慢时队列中的数据不会无限增长：超过上限后full()返回true，
+// 上传的连接暂停读取，直到写线程把队列写下去。
+class DiskWriter
+{
+public:
+    DiskWriter(int durability = DURABILITY_NONE, int group_ms = GROUP_COMMIT_MS, size_t limit = WRITE_QUEUE_MAX);
+    // 处理完队列中所有的任务后退出
+    ~DiskWriter();
+
+    // 把data写入文件的pos处，数据会被复制
+    void write(std::shared_ptr<WriteFile> file, uint64_t pos, const char *data, size_t len);
+    // 之前的写入都完成后重命名、调用published，再按持久化策略同步后调用durable
+    void commit(std::shared_ptr<WriteFile> file, write_callback published, write_callback durable, void *ctx);
+    // 之前的写入都完成后删除临时文件，再调用cb（可以为空），用于丢弃没有上传完整的文件
+    void discard(std::shared_ptr<WriteFile> file, write_callback cb, void *ctx);
+
+    int durability() const { return m_durability; }
+    // 队列中的数据已经达到上限，调用者应该暂停产生新的写入
+    bool full() const { return m_queued.load(std::memory_order_relaxed) >= m_limit; }
+    // 统计：处理的批数、pwritev次数、写入的字节数、同步次数、队列中还没有写入的字节数
+    uint64_t batches() const { return m_batches.load(std::memory_order_relaxed); }
+    uint64_t writes() const { return m_writes.load(std::memory_order_relaxed); }
+    uint64_t bytes() const { return m_bytes.load(std::memory_order_relaxed); }
+    uint64_t syncs() const { return m_syncs.load(std::memory_order_relaxed); }
+    uint64_t queued() const { return m_queued.load(std::memory_order_relaxed); }
+
+    // 解析持久化策略的名字，无法识别时返回-1
+    static int parse_durability(const char *name);
+
+private:
+    enum JOB_TYPE
+    {
+        JOB_WRITE,
+        JOB_COMMIT,
+        JOB_DISCARD
+    };
+    struct Job
+    {
+        int type;
+        std::shared_ptr<WriteFile> file;
+        uint64_t pos;
+        std::string data;
+        write_callback published;
+        write_callback durable;
+        void *ctx;
+    };
+
+    static void *worker(void *arg);
+    void run();
+    void push(Job &&job);
+    // 合并同一个文件上连续的写入，返回处理的任务个数
+    size_t write_batch(std::vector<Job> &jobs, size_t i);
+    void do_commit(Job &job);
+    // 同步等待持久化的切片并确认
+    void sync_pending();
+    static uint64_t now_ms();
+
+private:
+    int m_durability;
+    int m_groupMs;
+    size_t m_limit;
+    pthread_t m_thread;
+    pthread_mutex_t m_lock;
+    pthread_cond_t m_notEmpty;
+    std::vector<Job> m_jobs;
+    // 写完的数据缓冲区，保留容量给之后的写入使用
+    std::vector<std::string> m_spare;
+    bool m_stop;
+    // 组提交模式下等待同步的切片，以及第一个切片加入的时间
+    std::vector<Job> m_pending;
+    uint64_t m_pendingSince;
+
+    std::atomic<uint64_t> m_batches;
+    std::atomic<uint64_t> m_writes;
+    std::atomic<uint64_t> m_bytes;
+    std::atomic<uint64_t> m_syncs;
+    std::atomic<uint64_t> m_queued;
+};
+
+DiskWriter::DiskWriter(int durability, int group_ms, size_t limit)
+    : m_durability(durability), m_groupMs(group_ms), m_limit(limit), m_stop(false), m_pendingSince(0),
+      m_batches(0), m_writes(0), m_bytes(0), m_syncs(0), m_queued(0)
+{
+    pthread_mutex_init(&m_lock, NULL);
+    // 组提交需要按单调时钟等待
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&m_notEmpty, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_create(&m_thread, NULL, worker, this);
+}
+
+DiskWriter::~DiskWriter()
+{
+    pthread_mutex_lock(&m_lock);
+    m_stop = true;
+    pthread_cond_signal(&m_notEmpty);
+    pthread_mutex_unlock(&m_lock);
+    pthread_join(m_thread, NULL);
+    pthread_mutex_destroy(&m_lock);
+    pthread_cond_destroy(&m_notEmpty);
+}
+
+int DiskWriter::parse_durability(const char *name)
+{
+    if (strcmp(name, "none") == 0)
+        return DURABILITY_NONE;
+    if (strcmp(name, "fdatasync") == 0)
+        return DURABILITY_FDATASYNC;
+    if (strcmp(name, "group") == 0)
+        return DURABILITY_GROUP;
+    return -1;
+}
+
+uint64_t DiskWriter::now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+}
+
+void DiskWriter::push(Job &&job)
+{
+    pthread_mutex_lock(&m_lock);
+    m_jobs.push_back(std::move(job));
+    // 队列原来不为空时写线程已经被唤醒过了
+    if (m_jobs.size() == 1)
+        pthread_cond_signal(&m_notEmpty);
+    pthread_mutex_unlock(&m_lock);
+}
+
+void DiskWriter::write(std::shared_ptr<WriteFile> file, uint64_t pos, const char *data, size_t len)
+{
+    m_queued += len;
+    std::string buf;
+    pthread_mutex_lock(&m_lock);
+    if (!m_spare.empty())
+    {
+        buf.swap(m_spare.back());
+        m_spare.pop_back();
+    }
+    pthread_mutex_unlock(&m_lock);
+    buf.assign(data, len);
+    push(Job{JOB_WRITE, std::move(file), pos, std::move(buf), nullptr, nullptr, nullptr});
+}
+
+void DiskWriter::commit(std::shared_ptr<WriteFile> file, write_callback published, write_callback durable, void *ctx)
+{
+    push(Job{JOB_COMMIT, std::move(file), 0, std::string(), published, durable, ctx});
+}
+
+void DiskWriter::discard(std::shared_ptr<WriteFile> file, write_callback cb, void *ctx)
+{
+    push(Job{JOB_DISCARD, std::move(file), 0, std::string(), cb, nullptr, ctx});
+}
+
+void *DiskWriter::worker(void *arg)
+{
+    static_cast<DiskWriter *>(arg)->run();
+    return nullptr;
+}
+
+void DiskWriter::run()
+{
+    std::vector<Job> jobs;
+    while (true)
+    {
+        pthread_mutex_lock(&m_lock);
+        while (m_jobs.empty() && !m_stop)
+        {
+            if (m_pending.empty())
+            {
+                pthread_cond_wait(&m_notEmpty, &m_lock);
+                continue;
+            }
+            // 组提交：等到这一组的时间到了为止
+            uint64_t deadline = m_pendingSince + m_groupMs;
+            if (now_ms() >= deadline)
+                break;
+            struct timespec ts;
+            ts.tv_sec = deadline / 1000;
+            ts.tv_nsec = (deadline % 1000) * 1000000;
+            pthread_cond_timedwait(&m_notEmpty, &m_lock, &ts);
+        }
+        bool stop = m_stop && m_jobs.empty();
+        jobs.swap(m_jobs);
+        pthread_mutex_unlock(&m_lock);
+
+        if (!jobs.empty())
+            m_batches++;
+        for (size_t i = 0; i < jobs.size();)
+        {
+            if (jobs[i].type == JOB_WRITE)
+            {
+                i += write_batch(jobs, i);
+                continue;
+            }
+            if (jobs[i].type == JOB_COMMIT)
+            {
+                do_commit(jobs[i]);
+            }
+            else
+            {
+                // 丢弃没有上传完整的临时文件
+                WriteFile *file = jobs[i].file.get();
+                if (!file->final_path.empty())
+                    unlink(file->path.c_str());
+                if (jobs[i].published != nullptr)
+                    jobs[i].published(file, jobs[i].ctx, -1);
+            }
+            i++;
+        }
+        // 回收数据缓冲区，过大的不保留
+        pthread_mutex_lock(&m_lock);
+        for (Job &job : jobs)
+        {
+            if (job.type != JOB_WRITE || job.data.capacity() > WRITE_SPARE_MAX || m_spare.size() >= WRITE_SPARE)
+                continue;
+            job.data.clear();
+            m_spare.push_back(std::move(job.data));
+        }
+        pthread_mutex_unlock(&m_lock);
+        jobs.clear();
+
+        if (!m_pending.empty() && (stop || now_ms() >= m_pendingSince + m_groupMs))
+            sync_pending();
+        if (stop)
+            return;
+    }
+}
+
+size_t DiskWriter::write_batch(std::vector<Job> &jobs, size_t i)
+{
+    // 同一个文件上首尾相接的写入合并成一次pwritev
+    std::shared_ptr<WriteFile> &file = jobs[i].file;
+    struct iovec iov[WRITE_BATCH];
+    size_t n = 0;
+    size_t total = 0;
+    uint64_t pos = jobs[i].pos;
+    while (i + n < jobs.size() && n < WRITE_BATCH && n < IOV_MAX)
+    {
+        Job &job = jobs[i + n];
+        if (job.type != JOB_WRITE || job.file != file || job.pos != pos + total)
+            break;
+        iov[n].iov_base = &job.data[0];
+        iov[n].iov_len = job.data.size();
+        total += job.data.size();
+        n++;
+    }
+    m_queued -= total;
+    if (file->failed)
+        return n;
+
+    struct iovec *cur = iov;
+    int cnt = n;
+    while (cnt > 0)
+    {
+        ssize_t ret = pwritev(file->fd, cur, cnt, pos);
+        m_writes++;
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            AccessLog::message(LOG_ERROR, "pwritev %s: %s", file->path.c_str(), strerror(errno));
+            file->failed = true;
+            break;
+        }
+        m_bytes += ret;
+        pos += ret;
+        // 跳过已经写完的部分
+        while (cnt > 0 && (size_t)ret >= cur->iov_len)
+        {
+            ret -= cur->iov_len;
+            cur++;
+            cnt--;
+        }
+        if (cnt > 0)
+        {
+            cur->iov_base = static_cast<char *>(cur->iov_base) + ret;
+            cur->iov_len -= ret;
+        }
+    }
+    return n;
+}
+
+void DiskWriter::do_commit(Job &job)
+{
+    WriteFile *file = job.file.get();
+    int status = file->failed ? -1 : 0;
+    if (status == 0 && !file->final_path.empty() && rename(file->path.c_str(), file->final_path.c_str()) < 0)
+    {
+        AccessLog::message(LOG_ERROR, "rename %s: %s", file->path.c_str(), strerror(errno));
+        status = -1;
+    }
+    if (status < 0 && !file->final_path.empty())
+        unlink(file->path.c_str());
+    // 数据已经在页缓存中，可以发布
+    if (job.published != nullptr)
+        job.published(file, job.ctx, status);
+
+    if (status < 0 || m_durability == DURABILITY_NONE)
+    {
+        if (job.durable != nullptr)
+            job.durable(file, job.ctx, status);
+        return;
+    }
+    if (m_pending.empty())
+        m_pendingSince = now_ms();
+    m_pending.push_back(std::move(job));
+    // 每个切片单独同步
+    if (m_durability == DURABILITY_FDATASYNC)
+        sync_pending();
+}
+
+void DiskWriter::sync_pending()
+{
+    // 一组切片各自fdatasync，重命名过的文件所在的目录各同步一次
+    std::set<std::string> dirs;
+    std::vector<int> status(m_pending.size(), 0);
+    for (size_t i = 0; i < m_pending.size(); i++)
+    {
+        WriteFile *file = m_pending[i].file.get();
+        m_syncs++;
+        if (fdatasync(file->fd) < 0)
+        {
+            AccessLog::message(LOG_ERROR, "fdatasync %s: %s", file->path.c_str(), strerror(errno));
+            status[i] = -1;
+        }
+        if (!file->final_path.empty())
+            dirs.insert(file->dir);
+    }
+    for (const std::string &dir : dirs)
+    {
+        int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+        m_syncs++;
+        if (fsync(fd) < 0)
+            AccessLog::message(LOG_ERROR, "fsync %s: %s", dir.c_str(), strerror(errno));
+        close(fd);
+    }
+    std::vector<Job> pending;
+    pending.swap(m_pending);
+    for (size_t i = 0; i < pending.size(); i++)
+    {
+        if (pending[i].durable != nullptr)
+            pending[i].durable(pending[i].file.get(), pending[i].ctx, status[i]);
+    }
+}
+
+#endif
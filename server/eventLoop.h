@@ -0,0 +1,1114 @@
+#ifndef _EVENTLOOP_H
+#define _EVENTLOOP_H
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include <list>
+#include <algorithm>
+#include <memory>
+#include <atomic>
+#include "threadPool.h"
+#include "httpHeader.h"
+#include "accessLog.h"
+
+#define MAX_EVENTS 1024          // 每次epoll_wait最多处理的事件数
+#define READ_CHUNK 16384         // 每次read的大小
+#define SENDFILE_CHUNK (1 << 20) // 每次sendfile的最大长度
+#define LISTEN_BACKLOG SOMAXCONN // 监听队列长度
+#define IDLE_TIMEOUT 15          // 长连接空闲超时时间（秒）
+#define MAX_REQUESTS 1000        // 每个长连接最多处理的请求数
+#define CONN_CACHE 1024          // 关闭后留着复用的连接对象个数
+#define CONN_BUFFER_MAX (256 << 10) // 复用的连接最多保留的缓冲区容量（字节）
+#define QUEUE_CAPACITY 512       // 线程池中等待执行的请求数上限，0表示不限制
+#define QUEUE_RESERVE 25         // 队列中为高优先级请求保留的百分比
+#define RETRY_AFTER "1"          // 过载时建议客户端重试的间隔（秒）
+#define CHUNK_LINE_MAX 1024      // 分块编码中块大小一行（包括扩展）的最大长度
+#define MAX_BODY_SIZE (1 << 20)  // 不流式接收、缓存在内存中的请求体的最大长度（字节）
+#define PAUSE_RETRY_MS 10        // 有连接暂停读取请求体时，事件循环检查能否继续读取的间隔（毫秒）
+
+// 无法解析的请求直接返回的响应
+#define BAD_REQUEST_RESPONSE HTTP_VERSION " 400 Bad Request\r\nServer: " SERVER_NAME \
+                             "\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
+// 请求体太大、无法缓存时直接返回的响应
+#define PAYLOAD_TOO_LARGE_RESPONSE HTTP_VERSION " 413 Payload Too Large\r\nServer: " SERVER_NAME \
+                                   "\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
+// 过载时直接返回的响应
+#define SERVICE_UNAVAILABLE_RESPONSE HTTP_VERSION " 503 Service Unavailable\r\nServer: " SERVER_NAME \
+                                     "\r\nRetry-After: " RETRY_AFTER "\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
+// 分块传输编码的解码状态
+enum CHUNK_STATE
+{
+    CHUNK_SIZE = 0, // 等待块大小一行
+    CHUNK_DATA,     // 块数据，剩余长度在body_remaining中
+    CHUNK_DATA_END, // 块数据之后的换行
+    CHUNK_TRAILER,  // 最后一块之后的尾部字段，直到空行
+};
+
+// 客户端发送Expect: 100-continue时的中间响应
+#define CONTINUE_RESPONSE HTTP_VERSION " 100 Continue\r\n\r\n"
+
+class EventLoop;
+
+// 流式接收请求体的接口
+// 请求头解析完成后，上层可以为请求提供一个BodySink，请求体不再缓存在内存中，
+// 而是每读到一段就交给BodySink处理，请求体接收完整后再交给线程池处理请求
+class BodySink
+{
+public:
+    virtual ~BodySink() {}
+    // 收到一段请求体，返回false表示处理出错，剩余的请求体仍然会继续读取
+    virtual bool write(const char *data, size_t len) = 0;
+    // 返回false时事件循环暂停读取请求体，数据留在socket缓冲区中，之后每隔PAUSE_RETRY_MS重试
+    virtual bool ready() { return true; }
+};
+
+// 请求的优先级，线程池的队列快满时先拒绝低优先级的请求
+enum REQUEST_PRIORITY
+{
+    PRIORITY_LOW = 0, // 拉流：播放列表、切片和其他文件
+    PRIORITY_HIGH,    // 推流：上传切片，丢掉后所有观众都会受影响
+    PRIORITY_COUNT
+};
+
+// 连接的状态机
+enum CONN_STATE
+{
+    CONN_READING = 1, // 正在读取请求
+    CONN_PROCESSING,  // 请求已交给线程池处理
+    CONN_WRITING,     // 正在发送响应
+    CONN_CLOSED
+};
+
+// 每个连接的状态
+struct Connection
+{
+    int fd;
+    int state;
+    EventLoop *loop;
+    // 已经读到的请求数据
+    std::string in;
+    // 当前请求的解析状态
+    httpHeader http;
+    // 是否已经询问过上层要不要流式接收请求体
+    bool head_checked;
+    // 流式接收请求体时使用，请求头转移到head中，请求体交给sink
+    std::string head;
+    BodySink *sink;
+    uint64_t body_remaining;
+    // 请求体使用分块传输编码时的解码状态
+    bool chunked;
+    int chunk_state;
+    // sink暂时不能接收数据，已经停止读取，在事件循环的m_paused中
+    bool paused;
+    // 一个完整请求的长度（请求头 + 请求体），未读完时为0
+    size_t request_len;
+    // 待发送的响应头（以及较小的响应体）
+    std::string out;
+    size_t out_pos;
+    // 响应体来自内存时使用，多个连接可以共享同一块只读内存
+    std::shared_ptr<const std::string> body;
+    // 发送body中[body_pos, body_end)的部分，body_end为0表示到结尾
+    size_t body_pos;
+    size_t body_end;
+    // 响应体来自文件时使用，file_fd为-1表示没有文件
+    int file_fd;
+    off_t file_pos;
+    off_t file_end;
+    // 处理过程中对端已经关闭
+    bool peer_closed;
+    // 响应发送完后是否保持连接
+    bool keep_alive;
+    // 这个连接上已经处理的请求数
+    int requests;
+    // 当前请求开始处理（请求完整或者被拒绝）的时间，纳秒，用来统计延迟
+    uint64_t start_ns;
+    // 当前响应已经发出的字节数
+    uint64_t sent;
+    // 最后一次读写的时间，以及在空闲链表中的位置
+    time_t last_active;
+    std::list<Connection *>::iterator idle_it;
+    // 响应还没有生成完的持有者个数，为0时交给事件循环发送
+    std::atomic<int> holds;
+    // io_uring后端使用：还没有完成的操作个数，为0时才能释放连接
+    int io_pending;
+    // 是否有recv、send在进行，以及recv开始前in的长度
+    bool io_reading;
+    bool io_writing;
+    size_t io_in_base;
+    // sendmsg的参数，操作完成前不能释放
+    struct msghdr io_msg;
+    struct iovec io_iov[2];
+    // 发送文件时使用的注册缓冲区，以及其中还没有发送的部分
+    int io_buf;
+    size_t io_buf_pos;
+    size_t io_buf_len;
+
+    Connection(int fd, EventLoop *loop)
+        : fd(fd), state(CONN_READING), loop(loop), head_checked(false),
+          sink(nullptr), body_remaining(0), chunked(false), chunk_state(CHUNK_SIZE), paused(false), request_len(0), out_pos(0), body_pos(0), body_end(0), file_fd(-1), file_pos(0), file_end(0), peer_closed(false),
+          keep_alive(false), requests(0), start_ns(0), sent(0), last_active(0), holds(0), io_pending(0), io_reading(false),
+          io_writing(false), io_in_base(0), io_buf(-1), io_buf_pos(0), io_buf_len(0) {}
+    ~Connection() { delete sink; }
+    // 复用一个已经关闭的连接对象，保留读写缓冲区已经分配的容量
+    void reuse(int new_fd);
+};
+
+void Connection::reuse(int new_fd)
+{
+    fd = new_fd;
+    state = CONN_READING;
+    // 处理过大请求的缓冲区不保留
+    if (in.capacity() > CONN_BUFFER_MAX)
+        std::string().swap(in);
+    if (out.capacity() > CONN_BUFFER_MAX)
+        std::string().swap(out);
+    in.clear();
+    out.clear();
+    head.clear();
+    http.reset();
+    head_checked = false;
+    delete sink;
+    sink = nullptr;
+    body_remaining = 0;
+    chunked = false;
+    chunk_state = CHUNK_SIZE;
+    paused = false;
+    request_len = 0;
+    out_pos = 0;
+    body.reset();
+    body_pos = body_end = 0;
+    file_fd = -1;
+    file_pos = file_end = 0;
+    peer_closed = false;
+    keep_alive = false;
+    requests = 0;
+    start_ns = 0;
+    sent = 0;
+    last_active = 0;
+    holds = 0;
+    io_pending = 0;
+    io_reading = io_writing = false;
+    io_buf = -1;
+    io_buf_pos = io_buf_len = 0;
+}
+
+// 请求处理函数，在线程池中执行，负责填充conn的响应
+using conn_handler = void (*)(Connection *);
+// 请求头解析完成后在事件循环中调用，返回非空时请求体交给返回的BodySink流式处理
+using body_handler = BodySink *(*)(Connection *);
+// 事件循环每秒调用一次的定时函数
+using timer_handler = void (*)();
+// 一个响应发送完毕时在事件循环中调用，elapsed_ns是从请求开始处理到响应发完的时间
+using response_handler = void (*)(Connection *, uint64_t elapsed_ns);
+
+// 基于epoll边沿触发的事件循环，所有socket都是非阻塞的
+// 事件循环线程只负责网络读写，解析请求、生成响应在线程池中完成
+class EventLoop
+{
+public:
+    EventLoop(int listen_fd, ThreadPool *pool, conn_handler handler,
+              int idle_timeout = IDLE_TIMEOUT, int max_requests = MAX_REQUESTS);
+    virtual ~EventLoop();
+
+    int idle_timeout() const { return m_idleTimeout; }
+    int max_requests() const { return m_maxRequests; }
+
+    // 运行事件循环，不会返回
+    virtual void run();
+    // 线程池处理完请求后调用，通知事件循环发送响应
+    void complete(Connection *conn);
+    // 请求处理函数返回后响应还需要等待其他事件时调用hold，
+    // 响应生成后调用release，最后一个release的调用者负责complete
+    void hold(Connection *conn) { conn->holds++; }
+    void release(Connection *conn);
+
+    // 是否使用sendfile发送文件，关闭时使用pread+send
+    void set_sendfile(bool enable) { m_sendfile = enable; }
+    // 设置流式接收请求体的处理函数
+    void set_body_handler(body_handler handler) { m_bodyHandler = handler; }
+    // 设置每秒调用一次的定时函数
+    void set_timer_handler(timer_handler handler) { m_timerHandler = handler; }
+    // 设置响应发送完毕时调用的函数
+    void set_response_handler(response_handler handler) { m_responseHandler = handler; }
+    // 设置线程池队列的容量，0表示不限制
+    void set_queue_capacity(int capacity) { m_queueCapacity = capacity; }
+    // 设置缓存在内存中的请求体的最大长度，流式接收的请求体不受限制
+    void set_body_limit(size_t limit) { m_bodyLimit = limit; }
+    // 过载时拒绝的请求数
+    uint64_t shed_count(int priority) const { return m_shed[priority].load(std::memory_order_relaxed); }
+    // 事件循环线程发起的系统调用次数，用来对比不同的I/O后端
+    uint64_t syscalls() const { return m_syscalls.load(std::memory_order_relaxed); }
+    // 从socket收到和发出的字节数
+    uint64_t bytes_in() const { return m_bytesIn.load(std::memory_order_relaxed); }
+    uint64_t bytes_out() const { return m_bytesOut.load(std::memory_order_relaxed); }
+    // 当前打开的连接数
+    int connections() const { return m_connections.load(std::memory_order_relaxed); }
+    // 单调时钟，纳秒
+    static uint64_t clock_ns();
+
+    // 发送文件的[*pos, end)中的一段，成功时返回发送的字节数并移动*pos，
+    // 出错返回-1并设置errno
+    static ssize_t send_file(int sock, int fd, off_t *pos, off_t end, bool use_sendfile, char *buf, size_t bufsize);
+    // 把fd设置成非阻塞
+    static int set_nonblocking(int fd);
+    // 把打开文件数的软限制提高到硬限制
+    static void raise_fd_limit();
+
+protected:
+    void on_accept();
+    // 接收连接后加入空闲链表
+    Connection *add_conn(int fd);
+    virtual void on_readable(Connection *conn);
+    virtual void on_writable(Connection *conn);
+    void on_complete();
+    // 检查in中是否已经有一个完整的请求
+    bool request_ready(Connection *conn);
+    // 把in中属于请求体的数据交给sink，请求体接收完整时返回true
+    bool pump_body(Connection *conn);
+    // 分块编码的请求体边解码边交给sink，格式错误时回复400
+    bool pump_chunked(Connection *conn);
+    // 请求格式错误，回复400（或者给出的其他错误响应）后关闭连接
+    void bad_request(Connection *conn, const char *response = BAD_REQUEST_RESPONSE);
+    void dispatch(Connection *conn);
+    // 请求的优先级，以及这个优先级的请求允许排队的任务数
+    static int priority(Connection *conn);
+    int queue_limit(int priority);
+    // 过载，回复503后关闭连接
+    void shed(Connection *conn);
+    // 一个响应发送完毕，关闭连接或者准备接收下一个请求
+    void finish_response(Connection *conn);
+    void close_conn(Connection *conn);
+    // 停止连接上的读写，socket和文件在释放连接对象时关闭（已经关闭的fd设为-1）
+    virtual void close_fd(Connection *conn);
+    // 连接对象优先从m_free中复用，稳定运行后接收连接不再分配内存
+    Connection *new_conn(int fd);
+    void free_conn(Connection *conn);
+    // 更新连接的活跃时间
+    void touch(Connection *conn);
+    // 关闭空闲超时的连接
+    void sweep_idle();
+    // 请求体的sink暂时不能接收数据，停止读取这个连接
+    void pause(Connection *conn);
+    // 重新尝试读取暂停的连接，仍然不能接收的会再次暂停
+    void resume_paused();
+    // 事件循环等待事件的最长时间（毫秒），有暂停的连接时要尽快重试
+    int wait_ms() const { return m_paused.empty() ? 1000 : PAUSE_RETRY_MS; }
+    // 更新m_now，进入新的一秒时返回true
+    bool update_clock();
+    // 每轮事件处理完之后：关闭空闲连接、调用定时函数、释放已关闭的连接
+    void after_events(bool tick);
+    void count_syscall(int n = 1) { m_syscalls.fetch_add(n, std::memory_order_relaxed); }
+    // 只有事件循环线程写入，不需要原子加
+    void count_in(size_t n) { m_bytesIn.store(m_bytesIn.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+    void count_out(Connection *conn, size_t n)
+    {
+        conn->sent += n;
+        m_bytesOut.store(m_bytesOut.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+    // 线程池的任务函数
+    static void process(void *arg);
+
+protected:
+    int m_epfd;
+    int m_listenfd;
+    int m_eventfd;
+    ThreadPool *m_pool;
+    conn_handler m_handler;
+    body_handler m_bodyHandler;
+    timer_handler m_timerHandler;
+    response_handler m_responseHandler;
+    int m_idleTimeout;
+    int m_maxRequests;
+    bool m_sendfile;
+    int m_queueCapacity;
+    size_t m_bodyLimit;
+    // 按优先级统计的拒绝的请求数
+    std::atomic<uint64_t> m_shed[PRIORITY_COUNT];
+    std::atomic<uint64_t> m_syscalls;
+    std::atomic<uint64_t> m_bytesIn;
+    std::atomic<uint64_t> m_bytesOut;
+    std::atomic<int> m_connections;
+    // 当前时间（秒），每轮事件循环更新一次
+    time_t m_now;
+    // 按活跃时间排序的连接，最久没有活动的在最前面
+    std::list<Connection *> m_idle;
+    // 处理完成、等待发送的连接
+    pthread_mutex_t m_doneLock;
+    std::vector<Connection *> m_done;
+    // 已关闭、等待释放的连接
+    std::vector<Connection *> m_closed;
+    // 可以复用的连接对象
+    std::vector<Connection *> m_free;
+    // 暂停读取请求体的连接
+    std::vector<Connection *> m_paused;
+    // 事件循环线程专用的发送缓冲区，不能使用sendfile时才会用到
+    char m_buf[READ_CHUNK];
+};
+
+EventLoop::EventLoop(int listen_fd, ThreadPool *pool, conn_handler handler, int idle_timeout, int max_requests)
+    : m_epfd(-1), m_listenfd(listen_fd), m_pool(pool), m_handler(handler), m_bodyHandler(nullptr),
+      m_timerHandler(nullptr), m_responseHandler(nullptr),
+      m_idleTimeout(idle_timeout), m_maxRequests(max_requests), m_sendfile(true), m_queueCapacity(QUEUE_CAPACITY), m_bodyLimit(MAX_BODY_SIZE), m_syscalls(0),
+      m_bytesIn(0), m_bytesOut(0), m_connections(0), m_now(0)
+{
+    for (int i = 0; i < PRIORITY_COUNT; i++)
+        m_shed[i] = 0;
+    pthread_mutex_init(&m_doneLock, NULL);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    m_now = ts.tv_sec;
+    m_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_eventfd < 0)
+    {
+        perror("eventfd init failed");
+        exit(EXIT_FAILURE);
+    }
+    set_nonblocking(m_listenfd);
+}
+
+EventLoop::~EventLoop()
+{
+    for (Connection *conn : m_free)
+        delete conn;
+    close(m_eventfd);
+    if (m_epfd >= 0)
+        close(m_epfd);
+    pthread_mutex_destroy(&m_doneLock);
+}
+
+int EventLoop::set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0)
+        return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+uint64_t EventLoop::clock_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void EventLoop::raise_fd_limit()
+{
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+void EventLoop::run()
+{
+    m_epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (m_epfd < 0)
+    {
+        perror("epoll init failed");
+        exit(EXIT_FAILURE);
+    }
+    // 监听socket的data.ptr为空，eventfd的data.ptr指向m_eventfd，其余都是Connection
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = nullptr;
+    epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_listenfd, &ev);
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &m_eventfd;
+    epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_eventfd, &ev);
+
+    struct epoll_event events[MAX_EVENTS];
+    while (true)
+    {
+        // 每秒至少醒来一次，检查空闲连接
+        int n = epoll_wait(m_epfd, events, MAX_EVENTS, wait_ms());
+        count_syscall();
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait error");
+            return;
+        }
+        bool tick = update_clock();
+        for (int i = 0; i < n; i++)
+        {
+            void *ptr = events[i].data.ptr;
+            if (ptr == nullptr)
+            {
+                on_accept();
+                continue;
+            }
+            if (ptr == &m_eventfd)
+            {
+                on_complete();
+                continue;
+            }
+
+            Connection *conn = static_cast<Connection *>(ptr);
+            uint32_t ev = events[i].events;
+            // 本轮前面的事件已经关闭了这个连接
+            if (conn->state == CONN_CLOSED)
+                continue;
+            if (ev & (EPOLLERR | EPOLLHUP))
+            {
+                close_conn(conn);
+                continue;
+            }
+            if (ev & (EPOLLIN | EPOLLRDHUP))
+                on_readable(conn);
+            if (conn->state == CONN_CLOSED)
+                continue;
+            if (ev & EPOLLOUT)
+                on_writable(conn);
+        }
+        after_events(tick);
+    }
+}
+
+bool EventLoop::update_clock()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    bool tick = ts.tv_sec != m_now;
+    m_now = ts.tv_sec;
+    return tick;
+}
+
+void EventLoop::after_events(bool tick)
+{
+    resume_paused();
+    sweep_idle();
+    if (tick && m_timerHandler != nullptr)
+        m_timerHandler();
+    // 还有操作没有完成的连接留到下一轮再释放，释放前才关闭文件，
+    // 避免fd号被新的连接或文件复用后，还没完成的操作作用到别的文件上
+    size_t keep = 0;
+    for (Connection *conn : m_closed)
+    {
+        if (conn->io_pending > 0)
+        {
+            m_closed[keep++] = conn;
+            continue;
+        }
+        count_syscall((conn->fd >= 0) + (conn->file_fd >= 0));
+        if (conn->fd >= 0)
+            close(conn->fd);
+        if (conn->file_fd >= 0)
+            close(conn->file_fd);
+        conn->fd = conn->file_fd = -1;
+        free_conn(conn);
+    }
+    m_closed.resize(keep);
+}
+
+void EventLoop::on_accept()
+{
+    // 边沿触发，必须一直accept到EAGAIN
+    while (true)
+    {
+        int client_sock = accept4(m_listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        count_syscall();
+        if (client_sock < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                AccessLog::message(LOG_ERROR, "accept error: %s", strerror(errno));
+            return;
+        }
+
+        Connection *conn = add_conn(client_sock);
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = conn;
+        count_syscall();
+        if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, client_sock, &ev) < 0)
+        {
+            AccessLog::message(LOG_ERROR, "epoll_ctl error: %s", strerror(errno));
+            close(client_sock);
+            m_idle.erase(conn->idle_it);
+            m_connections--;
+            free_conn(conn);
+        }
+    }
+}
+
+Connection *EventLoop::add_conn(int fd)
+{
+    Connection *conn = new_conn(fd);
+    m_connections++;
+    conn->last_active = m_now;
+    conn->idle_it = m_idle.insert(m_idle.end(), conn);
+    return conn;
+}
+
+void EventLoop::on_readable(Connection *conn)
+{
+    // 线程池正在使用in中的请求，响应发完时统计和访问日志也要读取请求行，
+    // 继续读会让缓冲区重新分配，等响应发完后由finish_response再读
+    if (conn->state == CONN_PROCESSING || conn->state == CONN_WRITING)
+        return;
+
+    bool eof = false;
+    while (true)
+    {
+        // 写线程积压时不再读取请求体，由TCP的流量控制让推流端放慢
+        if (conn->sink != nullptr && !conn->sink->ready())
+        {
+            pause(conn);
+            break;
+        }
+        size_t old = conn->in.size();
+        conn->in.resize(old + READ_CHUNK);
+        ssize_t n = read(conn->fd, &conn->in[old], READ_CHUNK);
+        count_syscall();
+        conn->in.resize(old + (n > 0 ? n : 0));
+        if (n > 0)
+        {
+            count_in(n);
+            // 每读一次就检查一次，流式接收的请求体不会在内存中堆积
+            if (conn->state == CONN_READING && request_ready(conn))
+                dispatch(conn);
+            if (conn->state == CONN_CLOSED)
+                return;
+            if (conn->state != CONN_READING)
+                break;
+            continue;
+        }
+        if (n == 0)
+        {
+            eof = true;
+            break;
+        }
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            eof = true;
+        break;
+    }
+    touch(conn);
+
+    if (!eof)
+        return;
+
+    // 对端关闭，已经收到的请求仍然处理完、响应发完之后再关闭
+    if (conn->state == CONN_READING)
+        close_conn(conn);
+    else
+        conn->peer_closed = true;
+}
+
+bool EventLoop::request_ready(Connection *conn)
+{
+    // 请求体正在流式接收
+    if (conn->sink != nullptr)
+        return pump_body(conn);
+
+    int ret = conn->http.parse(conn->in.data(), conn->in.size());
+    if (ret != PARSE_ERROR && !conn->head_checked && conn->http.headers_done())
+    {
+        conn->head_checked = true;
+        // 过载时在接收请求体之前就拒绝
+        if (m_queueCapacity > 0 && m_pool->getQueueNumber() >= queue_limit(priority(conn)))
+        {
+            shed(conn);
+            return false;
+        }
+        // 由上层决定请求体是否流式接收
+        if (m_bodyHandler != nullptr && (conn->sink = m_bodyHandler(conn)) != nullptr)
+        {
+            size_t header_len = conn->http.header_length();
+            conn->head.assign(conn->in, 0, header_len);
+            conn->http.detach_body(conn->head.data());
+            conn->in.erase(0, header_len);
+            conn->body_remaining = conn->http.body_length();
+            conn->chunked = conn->http.chunked();
+            conn->request_len = 0;
+            ret = PARSE_AGAIN;
+        }
+        // 分块编码的请求体只支持流式接收
+        else if (conn->http.chunked())
+            ret = PARSE_ERROR;
+        // 请求体要完整地缓存在in中，太大时在接收之前就拒绝
+        else if (conn->http.body_length() > m_bodyLimit)
+        {
+            bad_request(conn, PAYLOAD_TOO_LARGE_RESPONSE);
+            return false;
+        }
+        // 客户端在等待100 Continue才会发送请求体
+        std::string_view expect = conn->http.header("Expect");
+        if (ret == PARSE_AGAIN && expect.size() == 12 && strncasecmp(expect.data(), "100-continue", 12) == 0)
+        {
+            count_syscall();
+            send(conn->fd, CONTINUE_RESPONSE, strlen(CONTINUE_RESPONSE), MSG_NOSIGNAL);
+        }
+        if (conn->sink != nullptr)
+            return pump_body(conn);
+    }
+    if (ret == PARSE_AGAIN)
+        return false;
+    if (ret == PARSE_ERROR)
+    {
+        bad_request(conn);
+        return false;
+    }
+    conn->request_len = conn->http.request_len();
+    return true;
+}
+
+void EventLoop::bad_request(Connection *conn, const char *response)
+{
+    conn->start_ns = clock_ns();
+    conn->out.assign(response);
+    conn->keep_alive = false;
+    conn->state = CONN_WRITING;
+    on_writable(conn);
+}
+
+bool EventLoop::pump_body(Connection *conn)
+{
+    if (conn->chunked)
+        return pump_chunked(conn);
+    size_t n = conn->in.size();
+    if (n > conn->body_remaining)
+        n = conn->body_remaining;
+    if (n > 0)
+    {
+        conn->sink->write(conn->in.data(), n);
+        conn->in.erase(0, n);
+        conn->body_remaining -= n;
+    }
+    return conn->body_remaining == 0;
+}
+
+bool EventLoop::pump_chunked(Connection *conn)
+{
+    std::string &in = conn->in;
+    size_t pos = 0;
+    bool done = false;
+    while (pos < in.size() && !done)
+    {
+        if (conn->chunk_state == CHUNK_DATA)
+        {
+            size_t n = in.size() - pos;
+            if (n > conn->body_remaining)
+                n = conn->body_remaining;
+            conn->sink->write(in.data() + pos, n);
+            pos += n;
+            conn->body_remaining -= n;
+            if (conn->body_remaining == 0)
+                conn->chunk_state = CHUNK_DATA_END;
+            continue;
+        }
+        // 其余状态都按行处理，兼容只有\n没有\r的换行
+        size_t eol = in.find('\n', pos);
+        if (eol == std::string::npos)
+        {
+            if (in.size() - pos > CHUNK_LINE_MAX)
+            {
+                bad_request(conn);
+                return false;
+            }
+            break;
+        }
+        size_t end = eol > pos && in[eol - 1] == '\r' ? eol - 1 : eol;
+        if (conn->chunk_state == CHUNK_SIZE)
+        {
+            // 十六进制的块大小，分号之后是扩展，忽略
+            uint64_t size = 0;
+            size_t i = pos;
+            for (; i < end && isxdigit((unsigned char)in[i]) && size < (1ull << 56); i++)
+                size = size * 16 + (isdigit((unsigned char)in[i]) ? in[i] - '0' : (tolower(in[i]) - 'a' + 10));
+            if (i == pos || (i < end && in[i] != ';' && in[i] != ' ' && in[i] != '\t'))
+            {
+                bad_request(conn);
+                return false;
+            }
+            conn->body_remaining = size;
+            conn->chunk_state = size > 0 ? CHUNK_DATA : CHUNK_TRAILER;
+        }
+        else if (conn->chunk_state == CHUNK_DATA_END)
+        {
+            if (end != pos)
+            {
+                bad_request(conn);
+                return false;
+            }
+            conn->chunk_state = CHUNK_SIZE;
+        }
+        else if (end == pos)
+        {
+            // 尾部字段之后的空行，请求体结束
+            done = true;
+        }
+        pos = eol + 1;
+    }
+    in.erase(0, pos);
+    return done;
+}
+
+void EventLoop::dispatch(Connection *conn)
+{
+    conn->state = CONN_PROCESSING;
+    conn->start_ns = clock_ns();
+    // 流式接收的请求体已经写入磁盘，接收请求头时已经检查过，不能再丢弃
+    if (m_queueCapacity <= 0 || conn->sink != nullptr)
+    {
+        m_pool->addTask(process, conn);
+        return;
+    }
+    if (!m_pool->tryAddTask(process, conn, queue_limit(priority(conn))))
+    {
+        conn->state = CONN_READING;
+        shed(conn);
+    }
+}
+
+int EventLoop::priority(Connection *conn)
+{
+    return conn->http.get_method() == METHOD_POST ? PRIORITY_HIGH : PRIORITY_LOW;
+}
+
+int EventLoop::queue_limit(int priority)
+{
+    // 低优先级的请求不能占用为高优先级保留的部分
+    if (priority == PRIORITY_HIGH)
+        return m_queueCapacity;
+    int reserve = m_queueCapacity * QUEUE_RESERVE / 100;
+    if (reserve < 1)
+        reserve = 1;
+    return m_queueCapacity > reserve ? m_queueCapacity - reserve : 1;
+}
+
+void EventLoop::shed(Connection *conn)
+{
+    m_shed[priority(conn)]++;
+    conn->start_ns = clock_ns();
+    // 没有读完的请求体不再读取，只能关闭连接
+    conn->out.assign(SERVICE_UNAVAILABLE_RESPONSE);
+    conn->keep_alive = false;
+    conn->state = CONN_WRITING;
+    on_writable(conn);
+}
+
+void EventLoop::process(void *arg)
+{
+    Connection *conn = static_cast<Connection *>(arg);
+    conn->holds = 1;
+    conn->loop->m_handler(conn);
+    conn->loop->release(conn);
+}
+
+void EventLoop::release(Connection *conn)
+{
+    // 处理函数和挂起的请求谁最后完成谁通知事件循环
+    if (--conn->holds == 0)
+        complete(conn);
+}
+
+void EventLoop::complete(Connection *conn)
+{
+    pthread_mutex_lock(&m_doneLock);
+    m_done.push_back(conn);
+    pthread_mutex_unlock(&m_doneLock);
+    uint64_t one = 1;
+    write(m_eventfd, &one, sizeof(one));
+}
+
+void EventLoop::on_complete()
+{
+    uint64_t cnt;
+    do
+        count_syscall();
+    while (read(m_eventfd, &cnt, sizeof(cnt)) > 0);
+
+    std::vector<Connection *> done;
+    pthread_mutex_lock(&m_doneLock);
+    done.swap(m_done);
+    pthread_mutex_unlock(&m_doneLock);
+
+    for (Connection *conn : done)
+    {
+        conn->state = CONN_WRITING;
+        on_writable(conn);
+    }
+}
+
+void EventLoop::on_writable(Connection *conn)
+{
+    if (conn->state != CONN_WRITING)
+        return;
+
+    // 先发送响应头和内存中的响应体，两者用一次sendmsg发出；
+    // 后面还有文件内容时带上MSG_MORE，内核会把响应头和文件开头合并在同一个包里
+    int flags = MSG_NOSIGNAL;
+    if (conn->file_fd >= 0 && conn->file_pos < conn->file_end)
+        flags |= MSG_MORE;
+    size_t body_size = conn->body ? (conn->body_end > 0 ? conn->body_end : conn->body->size()) : 0;
+    while (conn->out_pos < conn->out.size() || conn->body_pos < body_size)
+    {
+        struct iovec iov[2];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        if (conn->out_pos < conn->out.size())
+        {
+            iov[msg.msg_iovlen].iov_base = (void *)(conn->out.data() + conn->out_pos);
+            iov[msg.msg_iovlen++].iov_len = conn->out.size() - conn->out_pos;
+        }
+        if (conn->body_pos < body_size)
+        {
+            iov[msg.msg_iovlen].iov_base = (void *)(conn->body->data() + conn->body_pos);
+            iov[msg.msg_iovlen++].iov_len = body_size - conn->body_pos;
+        }
+
+        ssize_t n = sendmsg(conn->fd, &msg, flags);
+        count_syscall();
+        if (n > 0)
+        {
+            count_out(conn, n);
+            size_t head = conn->out.size() - conn->out_pos;
+            if ((size_t)n <= head)
+            {
+                conn->out_pos += n;
+            }
+            else
+            {
+                conn->out_pos = conn->out.size();
+                conn->body_pos += n - head;
+            }
+            touch(conn);
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return; // 等待下一次EPOLLOUT
+        close_conn(conn);
+        return;
+    }
+
+    // 再发送文件内容
+    while (conn->file_fd >= 0 && conn->file_pos < conn->file_end)
+    {
+        ssize_t n = send_file(conn->fd, conn->file_fd, &conn->file_pos, conn->file_end,
+                              m_sendfile, m_buf, sizeof(m_buf));
+        count_syscall(m_sendfile ? 1 : 2);
+        if (n > 0)
+        {
+            count_out(conn, n);
+            touch(conn);
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        // 文件系统不支持sendfile，以后都改用拷贝的方式
+        if (n < 0 && m_sendfile && (errno == EINVAL || errno == ENOSYS))
+        {
+            m_sendfile = false;
+            continue;
+        }
+        close_conn(conn);
+        return;
+    }
+
+    finish_response(conn);
+}
+
+ssize_t EventLoop::send_file(int sock, int fd, off_t *pos, off_t end, bool use_sendfile, char *buf, size_t bufsize)
+{
+    size_t want = end - *pos;
+    if (use_sendfile)
+    {
+        // 数据直接从页缓存发送到socket，不经过用户态
+        if (want > SENDFILE_CHUNK)
+            want = SENDFILE_CHUNK;
+        ssize_t n = sendfile(sock, fd, pos, want);
+        if (n == 0)
+        {
+            // 文件被截断了
+            errno = EIO;
+            return -1;
+        }
+        return n;
+    }
+
+    if (want > bufsize)
+        want = bufsize;
+    ssize_t r = pread(fd, buf, want, *pos);
+    if (r <= 0)
+    {
+        if (r == 0)
+            errno = EIO;
+        return -1;
+    }
+    ssize_t n = send(sock, buf, r, MSG_NOSIGNAL);
+    if (n > 0)
+        *pos += n;
+    return n;
+}
+
+void EventLoop::finish_response(Connection *conn)
+{
+    if (m_responseHandler != nullptr && conn->start_ns > 0)
+        m_responseHandler(conn, clock_ns() - conn->start_ns);
+    conn->start_ns = 0;
+    conn->sent = 0;
+    if (!conn->keep_alive || conn->peer_closed)
+    {
+        close_conn(conn);
+        return;
+    }
+
+    // 丢弃已经处理的请求，保留流水线上的后续数据
+    conn->in.erase(0, conn->request_len);
+    conn->request_len = 0;
+    conn->http.reset();
+    conn->head_checked = false;
+    conn->head.clear();
+    delete conn->sink;
+    conn->sink = nullptr;
+    conn->body_remaining = 0;
+    conn->chunked = false;
+    conn->chunk_state = CHUNK_SIZE;
+    conn->out.clear();
+    conn->out_pos = 0;
+    conn->body.reset();
+    conn->body_pos = conn->body_end = 0;
+    if (conn->file_fd >= 0)
+    {
+        count_syscall();
+        close(conn->file_fd);
+    }
+    conn->file_fd = -1;
+    conn->file_pos = conn->file_end = 0;
+    conn->state = CONN_READING;
+
+    // 流水线请求：缓冲区里已经有下一个完整请求，否则继续读取处理期间到达的数据
+    if (request_ready(conn))
+        dispatch(conn);
+    else if (conn->state == CONN_READING)
+        on_readable(conn);
+}
+
+void EventLoop::touch(Connection *conn)
+{
+    conn->last_active = m_now;
+    m_idle.splice(m_idle.end(), m_idle, conn->idle_it);
+}
+
+void EventLoop::pause(Connection *conn)
+{
+    if (conn->paused)
+        return;
+    conn->paused = true;
+    m_paused.push_back(conn);
+}
+
+void EventLoop::resume_paused()
+{
+    if (m_paused.empty())
+        return;
+    std::vector<Connection *> paused;
+    paused.swap(m_paused);
+    for (Connection *conn : paused)
+    {
+        conn->paused = false;
+        // 等待的是服务端，不算空闲
+        touch(conn);
+        if (conn->state == CONN_READING)
+            on_readable(conn);
+    }
+}
+
+void EventLoop::sweep_idle()
+{
+    while (!m_idle.empty())
+    {
+        Connection *conn = m_idle.front();
+        if (m_now - conn->last_active < m_idleTimeout)
+            break;
+        // 正在处理的连接不算空闲
+        if (conn->state == CONN_PROCESSING)
+        {
+            touch(conn);
+            continue;
+        }
+        close_conn(conn);
+    }
+}
+
+Connection *EventLoop::new_conn(int fd)
+{
+    if (m_free.empty())
+        return new Connection(fd, this);
+    Connection *conn = m_free.back();
+    m_free.pop_back();
+    conn->reuse(fd);
+    return conn;
+}
+
+void EventLoop::free_conn(Connection *conn)
+{
+    if (m_free.size() >= CONN_CACHE)
+    {
+        delete conn;
+        return;
+    }
+    // 先释放请求体和响应体占用的资源，缓冲区留到复用时再清空
+    delete conn->sink;
+    conn->sink = nullptr;
+    conn->body.reset();
+    m_free.push_back(conn);
+}
+
+void EventLoop::close_conn(Connection *conn)
+{
+    if (conn->state == CONN_CLOSED)
+        return;
+    // 线程池还在使用这个连接，等处理完成后再关闭
+    if (conn->state == CONN_PROCESSING)
+    {
+        conn->peer_closed = true;
+        return;
+    }
+    conn->state = CONN_CLOSED;
+    m_connections--;
+    m_idle.erase(conn->idle_it);
+    if (conn->paused)
+    {
+        conn->paused = false;
+        m_paused.erase(std::find(m_paused.begin(), m_paused.end(), conn));
+    }
+    close_fd(conn);
+    // 同一批事件中可能还有这个连接，延迟到本轮事件处理完再释放
+    m_closed.push_back(conn);
+}
+
+void EventLoop::close_fd(Connection *conn)
+{
+    count_syscall(2);
+    epoll_ctl(m_epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    conn->fd = -1;
+}
+
+#endif
@@ -3,9 +3,17 @@
 
 #include <unordered_map>
 #include <string>
+#include <string_view>
 #include <cstring>
+#include <cstdint>
+#include <vector>
+#include <sys/types.h>
+#include <strings.h>
 #include <iostream>
 #include <sys/socket.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define SERVER_NAME "LYJ's server" // 服务端名称
 #define HTTP_VERSION "HTTP/1.1"    // 服务端http协议版本
@@ -17,29 +25,119 @@ enum METHOD
     METHOD_POST
 };
 
+// 解析结果
+enum PARSE_RESULT
+{
+    PARSE_ERROR = -1, // 请求格式错误
+    PARSE_AGAIN = 0,  // 数据不完整，需要继续读取
+    PARSE_DONE = 1    // 已经得到一个完整的请求
+};
+
+#define MAX_HEADERS 64        // 请求头个数的上限，超过时按格式错误处理
+#define MAX_PARAMS 32         // 最多保存的参数个数
+#define MAX_HEADER_SIZE 65536 // 请求头的最大长度
+#define MAX_RANGES 16         // Range请求头最多的范围个数，超过时按完整文件处理
+#define MAX_CONTENT_LENGTH (1ull << 50) // Content-Length的上限，更大的值按格式错误处理，计算时不会溢出
+
+// 可恢复的增量式http请求解析器
+// 解析器不拷贝数据，所有字段都以偏移量的形式记录在调用者的缓冲区中，
+// 通过std::string_view访问，缓冲区被修改之前这些视图都有效。
+// 非阻塞读取时每次读到新数据就用整个缓冲区再调用一次parse，
+// 解析会从上次停下的位置继续。
 class httpHeader
 {
 private:
-    // 请求头中的参数
-    std::unordered_map<std::string, std::string> cache;
+    // 缓冲区中的一段数据
+    struct span
+    {
+        uint32_t off;
+        uint32_t len;
+    };
+    struct field
+    {
+        span key;
+        span val;
+    };
+    // 解析阶段
+    enum STAGE
+    {
+        STAGE_REQUEST_LINE = 0,
+        STAGE_HEADERS,
+        STAGE_BODY,
+        STAGE_DONE
+    };
+
+    // 最近一次parse传入的缓冲区
+    const char *data;
+    size_t len;
+    // 下一行的起始位置
+    size_t pos;
+    // 从这里开始继续查找换行符，之前的数据中没有换行符
+    size_t scan;
+    int stage;
+    span m_method;
+    span m_path;
+    span m_query;
+    span m_version;
+    // 请求头
+    field headers[MAX_HEADERS];
+    int nheaders;
     // 请求携带的参数
-    std::unordered_map<std::string, std::string> param;
-    // 获取一行，最后一个字符是换行符，没有\r，只有\n
-    int get_line(int sock, std::string& buf);
-    // 文件描述符
-    int sock;
-    // 是否有额外参数
-    bool hasOtherParam;
+    field params[MAX_PARAMS];
+    int nparams;
+    // 请求头的长度以及请求体的长度
+    size_t header_len;
+    size_t content_length;
+    // 请求体不在缓冲区中，由调用者流式处理
+    bool detached;
+
+    std::string_view view(span s) const { return std::string_view(data + s.off, s.len); }
+    // 查找换行符
+    static const char *find_eol(const char *p, const char *end);
+    // 解析请求行
+    bool parse_request_line(size_t begin, size_t end);
+    // 解析一行请求头
+    bool parse_header_line(size_t begin, size_t end);
+    // 解析 key=value&key=value 形式的参数
+    void parse_params(span s);
 
 public:
-    httpHeader(const int sock);
+    httpHeader();
     ~httpHeader();
 
-    std::string get(const char *key);
-    std::string get(std::string &key);
-    int get_method();
+    // 输入缓冲区的全部数据，返回PARSE_RESULT
+    int parse(const char *buf, size_t buflen);
+    // 准备解析下一个请求
+    void reset();
+    // 完整请求（请求头 + 请求体）的长度，解析完成后有效
+    size_t request_len() const { return header_len + content_length; }
+    // 请求头是否已经解析完成，之后header_length和body_length有效
+    bool headers_done() const { return stage >= STAGE_BODY; }
+    size_t header_length() const { return header_len; }
+    size_t body_length() const { return content_length; }
+    // 请求体改由调用者流式处理，已经解析的请求头转移到head中（内容与原缓冲区的开头相同）
+    void detach_body(const char *head);
+
+    std::string_view method() const { return view(m_method); }
+    std::string_view path() const { return view(m_path); }
+    std::string_view version() const { return view(m_version); }
+    std::string_view body() const { return detached ? std::string_view() : std::string_view(data + header_len, content_length); }
+    // 请求头，大小写不敏感
+    std::string_view header(std::string_view key) const;
+    // url或者表单中的参数
+    std::string_view param(std::string_view key) const;
+    // 先查找请求头，再查找参数，找不到时返回空
+    std::string_view get(std::string_view key) const;
+    int get_method() const;
+    // 请求结束后连接是否可以继续使用
+    bool keep_alive() const;
+    // 请求体是否使用分块传输编码（Transfer-Encoding: chunked），同时带有Content-Length的请求在解析时被拒绝
+    bool chunked() const;
+    // 解析Range请求头，范围按[first, last]闭区间保存在out中
+    // 返回0表示没有Range或者无法识别（按完整文件处理），1表示有可以满足的范围，-1表示所有范围都无法满足
+    int ranges(off_t size, std::vector<std::pair<off_t, off_t>> &out) const;
     // 打印键值对
-    void print();
+    void print() const;
     // 处理x_www_form_urlencoded方法的post参数
     void handle_pos_x_www_form_urlencoded();
     // 根据键值对信息生成相应的头
@@ -48,216 +146,356 @@ public:
     // 状态码与描述之间的映射
     static std::unordered_map<std::string, std::string> status_2_description;
     static std::unordered_map<std::string, std::string> params_200;
-    static std::unordered_map<std::string, std::string> params_400;
-    static std::unordered_map<std::string, std::string> params_404;
-    static std::unordered_map<std::string, std::string> params_500;
 };
 
-httpHeader::httpHeader(const int sock) : sock(sock), hasOtherParam(false)
+httpHeader::httpHeader()
 {
-    std::string buf;
-    char buff[BUFSIZE];
-
-    // 单独处理第一行
-    if (get_line(sock, buf) > 1){
-        // 找到第一个部分
-        int pos1 = buf.find(' ');
-        std::string method = buf.substr(0, pos1);
-        // 找到第二个部分
-        int pos2 = buf.find(" HTTP/");
-        std::string path = buf.substr(pos1+1, pos2-pos1-1);
-        // 找到第三个部分
-        int pos3 = buf.find('\n');
-        std::string version = buf.substr(pos2+1, pos3-pos2-1);
-        // 添加到map中
-        cache["method"] = method;
-        cache["path"] = path;
-        cache["version"] = version;
-
-        buf.clear();
-    }
+    reset();
+}
 
-    // 循环处理头的其他行
-    while (get_line(sock, buf) > 1) {
-        // 找到第一个部分
-        int pos1 = buf.find(' ');
-        std::string key = buf.substr(0, pos1-1);
-        // 找到第二个部分
-        int pos2 = buf.find('\n');
-        std::string val = buf.substr(pos1+1, pos2-pos1-1);
-        cache[key] = val;
-        buf.clear();
-    }
+httpHeader::~httpHeader() {}
 
-    // 保存外带数据
-    if (cache.find("Content-Length") != cache.end()) {
-        int bytes_read = 0;
-        cache["OutBandData"] = "";
-        while ((bytes_read = recv(sock, buff, BUFSIZE, 0)) > 0) {
-            cache["OutBandData"].append(buff, bytes_read);
-        }
-        // 校验外带数据
-        if (cache["OutBandData"].size() != std::stoi(cache["Content-Length"])) {
-            std::cerr << "外带数据不完整\n";
-            return;
-        }
+void httpHeader::reset()
+{
+    data = nullptr;
+    len = 0;
+    pos = 0;
+    scan = 0;
+    stage = STAGE_REQUEST_LINE;
+    m_method = m_path = m_query = m_version = span{0, 0};
+    nheaders = 0;
+    nparams = 0;
+    header_len = 0;
+    content_length = 0;
+    detached = false;
+}
+
+void httpHeader::detach_body(const char *head)
+{
+    data = head;
+    len = header_len;
+    detached = true;
+    stage = STAGE_DONE;
+}
+
+const char *httpHeader::find_eol(const char *p, const char *end)
+{
+#ifdef __SSE2__
+    // 一次比较16个字节
+    const __m128i nl = _mm_set1_epi8('\n');
+    while (p + 16 <= end)
+    {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, nl));
+        if (mask != 0)
+            return p + __builtin_ctz(mask);
+        p += 16;
     }
+#endif
+    return static_cast<const char *>(memchr(p, '\n', end - p));
+}
 
+int httpHeader::parse(const char *buf, size_t buflen)
+{
+    data = buf;
+    len = buflen;
 
-    // 处理 URL 中携带的参数
-    std::string line = cache["path"];
-    int pos = line.find('?');
-    if (pos != std::string::npos)
+    while (stage == STAGE_REQUEST_LINE || stage == STAGE_HEADERS)
     {
-        // url中存在额外参数
-        hasOtherParam = true;
-        cache["path"] = line.substr(0, pos);
-        line.erase(0, pos + 1);
-        // 循环处理参数部分
-        while (!line.empty())
+        const char *eol = find_eol(data + scan, data + len);
+        if (eol == nullptr)
+        {
+            scan = len;
+            if (len - pos > MAX_HEADER_SIZE)
+                return PARSE_ERROR;
+            return PARSE_AGAIN;
+        }
+
+        size_t next = eol - data + 1;
+        size_t end = next - 1;
+        // 兼容只有\n没有\r的换行
+        if (end > pos && data[end - 1] == '\r')
+            end--;
+
+        if (stage == STAGE_REQUEST_LINE)
         {
-            pos = line.find('=');
-            if (pos != std::string::npos)
+            // 忽略请求之前多余的空行
+            if (end > pos)
             {
-                std::string key = line.substr(0, pos); // 提取参数名
-                line.erase(0, pos + 1);                // 删除参数名
-                pos = line.find('&');                      // 查找下一个参数的分隔符
-                std::string value;
-                if (pos != std::string::npos)
-                {
-                    value = line.substr(0, pos); // 提取参数值
-                    line.erase(0, pos + 1);      // 删除参数值及分隔符
-                }
-                else
+                if (!parse_request_line(pos, end))
+                    return PARSE_ERROR;
+                stage = STAGE_HEADERS;
+            }
+        }
+        else if (end == pos)
+        {
+            // 空行，请求头结束
+            header_len = next;
+            // 多个Content-Length的值必须相同；和分块编码同时出现时请求体的边界有歧义，也按错误处理
+            bool has_length = false;
+            for (int i = 0; i < nheaders; i++)
+            {
+                std::string_view k = view(headers[i].key);
+                if (k.size() != 14 || strncasecmp(k.data(), "Content-Length", 14) != 0)
+                    continue;
+                std::string_view cl = view(headers[i].val);
+                if (cl.empty())
+                    return PARSE_ERROR;
+                uint64_t n = 0;
+                for (char c : cl)
                 {
-                    value = line; // 如果没有下一个分隔符，说明这是最后一个参数
-                    line.clear(); // 清空行
+                    if (c < '0' || c > '9')
+                        return PARSE_ERROR;
+                    n = n * 10 + (c - '0');
+                    if (n > MAX_CONTENT_LENGTH)
+                        return PARSE_ERROR;
                 }
-                param[key] = value; // 将参数名和参数值存入 map
+                if (has_length && n != content_length)
+                    return PARSE_ERROR;
+                content_length = n;
+                has_length = true;
             }
+            if (has_length && chunked())
+                return PARSE_ERROR;
+            stage = STAGE_BODY;
         }
+        else if (!parse_header_line(pos, end))
+        {
+            return PARSE_ERROR;
+        }
+        pos = scan = next;
+        if (pos > MAX_HEADER_SIZE)
+            return PARSE_ERROR;
     }
 
+    if (stage == STAGE_BODY)
+    {
+        if (len < header_len + content_length)
+            return PARSE_AGAIN;
+        stage = STAGE_DONE;
+    }
+    return PARSE_DONE;
 }
 
-httpHeader::~httpHeader() {}
+bool httpHeader::parse_request_line(size_t begin, size_t end)
+{
+    std::string_view line(data + begin, end - begin);
+    // 找到第一个部分
+    size_t pos1 = line.find(' ');
+    // 找到第三个部分
+    size_t pos2 = line.rfind(' ');
+    if (pos1 == std::string_view::npos || pos2 == pos1)
+        return false;
+    m_method = span{uint32_t(begin), uint32_t(pos1)};
+    m_path = span{uint32_t(begin + pos1 + 1), uint32_t(pos2 - pos1 - 1)};
+    m_version = span{uint32_t(begin + pos2 + 1), uint32_t(line.size() - pos2 - 1)};
+    if (m_path.len == 0 || version().compare(0, 5, "HTTP/") != 0)
+        return false;
+
+    // 处理 URL 中携带的参数
+    std::string_view url = path();
+    size_t q = url.find('?');
+    if (q != std::string_view::npos)
+    {
+        m_query = span{uint32_t(m_path.off + q + 1), uint32_t(url.size() - q - 1)};
+        m_path.len = q;
+        parse_params(m_query);
+    }
+    return true;
+}
 
-int httpHeader::get_line(int sock, std::string& buf)
+bool httpHeader::parse_header_line(size_t begin, size_t end)
 {
-    int i = 0;
-    char c = '\0';
-    int n;
+    const char *line = data + begin;
+    const char *colon = static_cast<const char *>(memchr(line, ':', end - begin));
+    if (colon == nullptr)
+        return false;
+    // 请求头太多时按错误处理，丢弃多出的请求头可能漏掉Content-Length等影响请求边界的字段
+    if (nheaders == MAX_HEADERS)
+        return false;
+
+    size_t key_len = colon - line;
+    size_t val = colon - data + 1;
+    // 去掉值前后的空白
+    while (val < end && (data[val] == ' ' || data[val] == '\t'))
+        val++;
+    size_t val_end = end;
+    while (val_end > val && (data[val_end - 1] == ' ' || data[val_end - 1] == '\t'))
+        val_end--;
+    headers[nheaders++] = field{span{uint32_t(begin), uint32_t(key_len)},
+                                span{uint32_t(val), uint32_t(val_end - val)}};
+    return true;
+}
 
-    while (c != '\n')
+void httpHeader::parse_params(span s)
+{
+    size_t p = s.off;
+    size_t end = s.off + s.len;
+    // 循环处理参数部分
+    while (p < end && nparams < MAX_PARAMS)
     {
-        n = recv(sock, &c, 1, 0);
-        if (n > 0)
+        const char *amp = static_cast<const char *>(memchr(data + p, '&', end - p));
+        size_t item_end = amp ? amp - data : end;
+        const char *eq = static_cast<const char *>(memchr(data + p, '=', item_end - p));
+        if (eq != nullptr)
         {
-            if (c == '\r')
-            {
-                n = recv(sock, &c, 1, MSG_PEEK);
-                if ((n > 0) && (c == '\n'))
-                    recv(sock, &c, 1, 0);
-                else
-                    c = '\n';
-            }
-            buf.push_back(c);
-            i++;
+            size_t key_end = eq - data;
+            params[nparams++] = field{span{uint32_t(p), uint32_t(key_end - p)},
+                                      span{uint32_t(key_end + 1), uint32_t(item_end - key_end - 1)}};
         }
-        else
-            c = '\n';
+        p = item_end + 1;
     }
-
-    return i;
 }
 
-std::string httpHeader::get(std::string& k) 
+std::string_view httpHeader::header(std::string_view key) const
 {
-    if (cache.find(k) != cache.end())
+    for (int i = 0; i < nheaders; i++)
     {
-        return cache[k];
+        std::string_view k = view(headers[i].key);
+        if (k.size() == key.size() && strncasecmp(k.data(), key.data(), k.size()) == 0)
+            return view(headers[i].val);
     }
-    if (param.find(k) != param.end())
+    return std::string_view();
+}
+
+std::string_view httpHeader::param(std::string_view key) const
+{
+    for (int i = 0; i < nparams; i++)
     {
-        return param[k];
+        if (view(params[i].key) == key)
+            return view(params[i].val);
     }
-    return nullptr;
+    return std::string_view();
 }
 
-std::string httpHeader::get(const char *key)
-{  
-    std::string k(key);  
-  
-    // 首先检查 cache  
-    if (cache.find(k) != cache.end())  
-    {  
-        return cache[k];  
-    }  
-  
-    // 然后检查 param  
-    if (param.find(k) != param.end())  
-    {  
-        return param[k];  
-    }  
-  
-    // 如果没有找到，可以返回一个空字符串或抛出异常  
-    return std::string(); // 或者可以抛出 std::out_of_range 异常  
+std::string_view httpHeader::get(std::string_view key) const
+{
+    std::string_view v = header(key);
+    if (!v.empty())
+        return v;
+    return param(key);
 }
 
-int httpHeader::get_method()
+int httpHeader::get_method() const
 {
-    if (cache.find("method") == cache.end())
-        return -1;
-    if (cache["method"].compare("GET") == 0 || cache["method"].compare("get") == 0)
+    std::string_view m = method();
+    if (m.size() == 3 && strncasecmp(m.data(), "GET", 3) == 0)
         return METHOD_GET;
-    if (cache["method"].compare("POST") == 0 || cache["method"].compare("post") == 0)
+    if (m.size() == 4 && strncasecmp(m.data(), "POST", 4) == 0)
         return METHOD_POST;
     return -1;
 }
 
+int httpHeader::ranges(off_t size, std::vector<std::pair<off_t, off_t>> &out) const
+{
+    out.clear();
+    std::string_view value = header("Range");
+    if (value.size() < 6 || strncasecmp(value.data(), "bytes=", 6) != 0)
+        return 0;
+    value.remove_prefix(6);
+
+    off_t total = 0;
+    size_t count = 0;
+    while (!value.empty())
+    {
+        size_t comma = value.find(',');
+        std::string_view spec = value.substr(0, comma);
+        value = comma == std::string_view::npos ? std::string_view() : value.substr(comma + 1);
+        while (!spec.empty() && (spec.front() == ' ' || spec.front() == '\t'))
+            spec.remove_prefix(1);
+        while (!spec.empty() && (spec.back() == ' ' || spec.back() == '\t'))
+            spec.remove_suffix(1);
+        if (spec.empty())
+            continue;
+        if (++count > MAX_RANGES)
+            return 0;
+
+        size_t dash = spec.find('-');
+        if (dash == std::string_view::npos)
+            return 0;
+        // 解析十进制数，空字符串返回-1，格式错误返回-2
+        auto number = [](std::string_view s) -> off_t {
+            if (s.empty())
+                return -1;
+            off_t n = 0;
+            for (char c : s)
+            {
+                if (c < '0' || c > '9' || n > (INT64_MAX - 9) / 10)
+                    return -2;
+                n = n * 10 + (c - '0');
+            }
+            return n;
+        };
+        off_t first = number(spec.substr(0, dash));
+        off_t last = number(spec.substr(dash + 1));
+        if (first == -2 || last == -2 || (first < 0 && last < 0) || (first >= 0 && last >= 0 && last < first))
+            return 0;
+
+        if (first < 0)
+        {
+            // 最后last个字节
+            if (last == 0 || size == 0)
+                continue;
+            first = last >= size ? 0 : size - last;
+            last = size - 1;
+        }
+        else
+        {
+            if (first >= size)
+                continue;
+            if (last < 0 || last >= size)
+                last = size - 1;
+        }
+        out.emplace_back(first, last);
+        total += last - first + 1;
+    }
+    if (count == 0)
+        return 0;
+    if (out.empty())
+        return -1;
+    // 重叠的范围加起来比整个文件还大时直接发送完整文件
+    if (total > size)
+    {
+        out.clear();
+        return 0;
+    }
+    return 1;
+}
 
-void httpHeader::print()
+bool httpHeader::keep_alive() const
 {
-    for (const auto &pair : cache)
+    std::string_view conn = header("Connection");
+    // HTTP/1.1默认长连接，HTTP/1.0需要显式声明
+    if (version() == "HTTP/1.0")
+        return conn.size() == 10 && strncasecmp(conn.data(), "keep-alive", 10) == 0;
+    return !(conn.size() == 5 && strncasecmp(conn.data(), "close", 5) == 0);
+}
+
+bool httpHeader::chunked() const
+{
+    // chunked必须是最后一个编码
+    std::string_view te = header("Transfer-Encoding");
+    return te.size() >= 7 && strncasecmp(te.data() + te.size() - 7, "chunked", 7) == 0;
+}
+
+void httpHeader::print() const
+{
+    std::cout << method() << ' ' << path() << ' ' << version() << "\n";
+    for (int i = 0; i < nheaders; i++)
     {
-        std::cout << pair.first << ": " << pair.second << "\n";
+        std::cout << view(headers[i].key) << ": " << view(headers[i].val) << "\n";
     }
-    for (const auto &pair : param)
+    for (int i = 0; i < nparams; i++)
     {
-        std::cout << pair.first << ": " << pair.second << "\n";
+        std::cout << view(params[i].key) << ": " << view(params[i].val) << "\n";
     }
 }
 
 void httpHeader::handle_pos_x_www_form_urlencoded()
 {
-    std::string header = cache["OutBandData"];
-    size_t pos = 0;
     // 处理post中携带的数据
-    if (cache["method"].compare("POST") == 0 || cache["method"].compare("post") == 0)
-    {
-        while (!header.empty())
-        {
-            pos = header.find('=');
-            if (pos != std::string::npos)
-            {
-                std::string key = header.substr(0, pos); // 提取参数名
-                header.erase(0, pos + 1);                // 删除参数名
-                pos = header.find('&');                  // 查找下一个参数的分隔符
-                std::string value;
-                if (pos != std::string::npos)
-                {
-                    value = header.substr(0, pos); // 提取参数值
-                    header.erase(0, pos + 1);      // 删除参数值及分隔符
-                }
-                else
-                {
-                    value = header; // 如果没有下一个分隔符，说明这是最后一个参数
-                    header.clear(); // 清空行
-                }
-                param[key] = value; // 将参数名和参数值存入 map
-            }
-        }
-    }
+    if (get_method() == METHOD_POST)
+        parse_params(span{uint32_t(header_len), uint32_t(content_length)});
 }
 
 int httpHeader::makeheader(std::unordered_map<std::string, std::string> &params, char *buf, int bufsize)
@@ -324,6 +562,7 @@ std::unordered_map<std::string, std::string> httpHeader::status_2_description =
     {"201", "Created"},               // 已创建
     {"202", "Accepted"},              // 已接受
     {"204", "No Content"},            // 无内容
+    {"206", "Partial Content"},       // 部分内容
     {"301", "Moved Permanently"},     // 永久移动
     {"302", "Found"},                 // 临时移动
     {"303", "See Other"},             // 查看其他
@@ -336,6 +575,7 @@ std::unordered_map<std::string, std::string> httpHeader::status_2_description =
     {"404", "Not Found"},             // 找不到
     {"405", "Method Not Allowed"},    // 方法不允许
     {"408", "Request Timeout"},       // 请求超时
+    {"416", "Range Not Satisfiable"}, // 范围无法满足
     {"429", "Too Many Requests"},     // 请求过多
     {"500", "Internal Server Error"}, // 内部服务器错误
     {"501", "Not Implemented"},       // 未实现
@@ -350,22 +590,4 @@ std::unordered_map<std::string, std::string> httpHeader::params_200 = {
     {"Server", SERVER_NAME},
 };
 
-std::unordered_map<std::string, std::string> httpHeader::params_400 = {
-    {"http_version", HTTP_VERSION},
-    {"status", "400"},
-    {"Server", SERVER_NAME},
-    {"Content-Type", "text/html"}};
-
-std::unordered_map<std::string, std::string> httpHeader::params_404 = {
-    {"http_version", HTTP_VERSION},
-    {"status", "404"},
-    {"Server", SERVER_NAME},
-    {"Content-Type", "text/html"}};
-
-std::unordered_map<std::string, std::string> httpHeader::params_500 = {
-    {"http_version", HTTP_VERSION},
-    {"status", "500"},
-    {"Server", SERVER_NAME},
-    {"Content-Type", "text/html"}};
-
 #endif
\ No newline at end of file
@@ -0,0 +1,257 @@
+#ifndef _METRICS_H
+#define _METRICS_H
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#define LATENCY_BUCKETS 18 // 延迟直方图的桶数，上界从64微秒开始每次翻倍，最后一个约8.4秒
+#define LATENCY_MIN_SHIFT 6 // 第一个桶的上界为2^6微秒
+
+// 请求的路由，按路由分别统计请求数和延迟
+enum METRIC_ROUTE
+{
+    ROUTE_PLAYLIST = 0, // 直播流的播放列表
+    ROUTE_MASTER,       // 多码率直播的主播放列表
+    ROUTE_PART,         // 低延迟直播的部分切片
+    ROUTE_SEGMENT,      // 切片文件
+    ROUTE_UPLOAD,       // 推流端上传切片
+    ROUTE_STATIC,       // 网页等其他文件
+    ROUTE_METRICS,      // /metrics本身
+    ROUTE_OTHER,        // 无法解析或者不支持的请求
+    ROUTE_COUNT
+};
+
+// 单独统计的状态码，其他状态码归入最后一项
+constexpr int METRIC_STATUSES[] = {100, 200, 206, 304, 400, 404, 413, 416, 429, 500, 503};
+#define STATUS_COUNT (sizeof(METRIC_STATUSES) / sizeof(METRIC_STATUSES[0]) + 1)
+
+// 一个线程的计数器，只有所属的线程写入，所以用普通的读加写代替原子加，
+// 热点路径上没有锁也没有总线锁定的指令；采集时其他线程只读
+struct MetricsShard
+{
+    std::atomic<uint64_t> requests[ROUTE_COUNT][STATUS_COUNT];
+    // 延迟直方图，最后一个桶是+Inf
+    std::atomic<uint64_t> latency[ROUTE_COUNT][LATENCY_BUCKETS + 1];
+    std::atomic<uint64_t> latency_sum_us[ROUTE_COUNT];
+
+    MetricsShard();
+};
+
+MetricsShard::MetricsShard()
+{
+    for (int r = 0; r < ROUTE_COUNT; r++)
+    {
+        for (size_t s = 0; s < STATUS_COUNT; s++)
+            requests[r][s].store(0, std::memory_order_relaxed);
+        for (int b = 0; b <= LATENCY_BUCKETS; b++)
+            latency[r][b].store(0, std::memory_order_relaxed);
+        latency_sum_us[r].store(0, std::memory_order_relaxed);
+    }
+}
+
+// 按线程分片的请求统计，每个线程第一次记录时注册自己的分片，
+// 线程退出后分片留给以后的线程继续使用，计数不会丢失；/metrics请求时把所有分片加起来
+class Metrics
+{
+public:
+    // 记录一个已经发送完的响应，在任意线程中调用
+    static void request(int route, int status, uint64_t elapsed_ns);
+    // 以Prometheus文本格式输出请求数和延迟直方图
+    static void render(std::string &out);
+
+    // 输出一个指标的HELP和TYPE
+    static void describe(std::string &out, const char *name, const char *type, const char *help);
+    // 输出一个样本，labels为空时不带标签
+    static void sample(std::string &out, const char *name, const std::string &labels, double value);
+    static const char *route_name(int route);
+    // 标签值中的反斜杠、双引号和换行需要转义
+    static std::string escape(const std::string &value);
+
+private:
+    // 分片在线程退出时归还
+    struct Handle
+    {
+        MetricsShard *shard = nullptr;
+        ~Handle();
+    };
+    static MetricsShard *local();
+    static void bump(std::atomic<uint64_t> &c, uint64_t n)
+    {
+        c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+    static size_t status_index(int status);
+    static int bucket(uint64_t us);
+
+    static pthread_mutex_t s_lock;
+    static std::vector<MetricsShard *> s_shards;
+    static std::vector<MetricsShard *> s_free;
+};
+
+pthread_mutex_t Metrics::s_lock = PTHREAD_MUTEX_INITIALIZER;
+std::vector<MetricsShard *> Metrics::s_shards;
+std::vector<MetricsShard *> Metrics::s_free;
+
+Metrics::Handle::~Handle()
+{
+    if (shard == nullptr)
+        return;
+    pthread_mutex_lock(&s_lock);
+    s_free.push_back(shard);
+    pthread_mutex_unlock(&s_lock);
+}
+
+MetricsShard *Metrics::local()
+{
+    static thread_local Handle handle;
+    if (handle.shard != nullptr)
+        return handle.shard;
+    // 每个线程只在第一次记录时加锁
+    pthread_mutex_lock(&s_lock);
+    if (!s_free.empty())
+    {
+        handle.shard = s_free.back();
+        s_free.pop_back();
+    }
+    else
+    {
+        handle.shard = new MetricsShard();
+        s_shards.push_back(handle.shard);
+    }
+    pthread_mutex_unlock(&s_lock);
+    return handle.shard;
+}
+
+size_t Metrics::status_index(int status)
+{
+    for (size_t i = 0; i + 1 < STATUS_COUNT; i++)
+    {
+        if (METRIC_STATUSES[i] == status)
+            return i;
+    }
+    return STATUS_COUNT - 1;
+}
+
+int Metrics::bucket(uint64_t us)
+{
+    if (us <= (1ull << LATENCY_MIN_SHIFT))
+        return 0;
+    // 上界为2^(b+LATENCY_MIN_SHIFT)的桶
+    int b = 64 - __builtin_clzll(us - 1) - LATENCY_MIN_SHIFT;
+    return b < LATENCY_BUCKETS ? b : LATENCY_BUCKETS;
+}
+
+void Metrics::request(int route, int status, uint64_t elapsed_ns)
+{
+    if (route < 0 || route >= ROUTE_COUNT)
+        route = ROUTE_OTHER;
+    MetricsShard *s = local();
+    uint64_t us = elapsed_ns / 1000;
+    bump(s->requests[route][status_index(status)], 1);
+    bump(s->latency[route][bucket(us)], 1);
+    bump(s->latency_sum_us[route], us);
+}
+
+const char *Metrics::route_name(int route)
+{
+    static const char *names[ROUTE_COUNT] = {"playlist", "master", "part", "segment",
+                                             "upload", "static", "metrics", "other"};
+    return route >= 0 && route < ROUTE_COUNT ? names[route] : "other";
+}
+
+void Metrics::describe(std::string &out, const char *name, const char *type, const char *help)
+{
+    out.append("# HELP ").append(name).append(" ").append(help).append("\n");
+    out.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+}
+
+void Metrics::sample(std::string &out, const char *name, const std::string &labels, double value)
+{
+    char num[64];
+    if (value == (double)(uint64_t)value)
+        snprintf(num, sizeof(num), "%llu", (unsigned long long)value);
+    else
+        snprintf(num, sizeof(num), "%.9g", value);
+    out.append(name);
+    if (!labels.empty())
+        out.append("{").append(labels).append("}");
+    out.append(" ").append(num).append("\n");
+}
+
+std::string Metrics::escape(const std::string &value)
+{
+    std::string out;
+    out.reserve(value.size());
+    for (char c : value)
+    {
+        if (c == '\\' || c == '"')
+            out.push_back('\\');
+        if (c == '\n')
+            out.append("\\n");
+        else
+            out.push_back(c);
+    }
+    return out;
+}
+
+void Metrics::render(std::string &out)
+{
+    // 合并所有分片，读到的值可能比正在写的线程稍旧，但每个计数器本身是完整的
+    uint64_t requests[ROUTE_COUNT][STATUS_COUNT] = {};
+    uint64_t latency[ROUTE_COUNT][LATENCY_BUCKETS + 1] = {};
+    uint64_t sum_us[ROUTE_COUNT] = {};
+    pthread_mutex_lock(&s_lock);
+    for (MetricsShard *s : s_shards)
+    {
+        for (int r = 0; r < ROUTE_COUNT; r++)
+        {
+            for (size_t i = 0; i < STATUS_COUNT; i++)
+                requests[r][i] += s->requests[r][i].load(std::memory_order_relaxed);
+            for (int b = 0; b <= LATENCY_BUCKETS; b++)
+                latency[r][b] += s->latency[r][b].load(std::memory_order_relaxed);
+            sum_us[r] += s->latency_sum_us[r].load(std::memory_order_relaxed);
+        }
+    }
+    pthread_mutex_unlock(&s_lock);
+
+    describe(out, "hls_requests_total", "counter", "Responses sent, by route and status code.");
+    for (int r = 0; r < ROUTE_COUNT; r++)
+    {
+        for (size_t i = 0; i < STATUS_COUNT; i++)
+        {
+            if (requests[r][i] == 0)
+                continue;
+            std::string labels = std::string("route=\"") + route_name(r) + "\",status=\"" +
+                                 (i + 1 < STATUS_COUNT ? std::to_string(METRIC_STATUSES[i]) : "other") + "\"";
+            sample(out, "hls_requests_total", labels, requests[r][i]);
+        }
+    }
+
+    describe(out, "hls_request_duration_seconds", "histogram",
+             "Time from a complete request to the last byte of its response.");
+    for (int r = 0; r < ROUTE_COUNT; r++)
+    {
+        uint64_t count = 0;
+        for (int b = 0; b <= LATENCY_BUCKETS; b++)
+            count += latency[r][b];
+        if (count == 0)
+            continue;
+        std::string route = std::string("route=\"") + route_name(r) + "\"";
+        uint64_t cumulative = 0;
+        char le[32];
+        for (int b = 0; b < LATENCY_BUCKETS; b++)
+        {
+            cumulative += latency[r][b];
+            snprintf(le, sizeof(le), "%g", (double)(1ull << (b + LATENCY_MIN_SHIFT)) / 1e6);
+            sample(out, "hls_request_duration_seconds_bucket", route + ",le=\"" + le + "\"", cumulative);
+        }
+        sample(out, "hls_request_duration_seconds_bucket", route + ",le=\"+Inf\"", count);
+        sample(out, "hls_request_duration_seconds_sum", route, sum_us[r] / 1e6);
+        sample(out, "hls_request_duration_seconds_count", route, count);
+    }
+}
+
+#endif
@@ -0,0 +1,713 @@
+#ifndef _PLAYLIST_H
+#define _PLAYLIST_H
+
+#include <pthread.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+#include <string>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <algorithm>
+#include "tsIndexer.h"
+
+#define PLAYLIST_WINDOW 6  // 直播列表中保留的切片个数
+#define TARGET_DURATION 10 // 默认的切片目标时长（秒）
+#define PART_TARGET 1.0    // 默认的部分切片目标时长（秒），0表示不生成部分切片
+#define PART_SEGMENTS 3    // 最近几个切片在播放列表中列出部分切片
+
+// 低延迟直播的部分切片，切片还在上传时就可以拉取
+struct Part
+{
+    std::string uri;
+    double duration;
+    // 是否从关键帧开始
+    bool independent;
+    // 部分切片的内容，保存在内存中
+    std::shared_ptr<const std::string> data;
+};
+
+// 播放列表中的一个切片
+struct Segment
+{
+    // 媒体序号，从0开始递增
+    uint64_t msn;
+    // 相对于播放列表的地址
+    std::string uri;
+    // 时长（秒）
+    double duration;
+    // 上传时生成的切片索引，可能为空
+    std::shared_ptr<const TsIndex> index;
+    // 低延迟直播时切片的各个部分
+    std::vector<Part> parts;
+    // 预先生成的EXTINF和地址两行，生成播放列表时直接拷贝
+    std::string line;
+    // 上传时的文件名，用来给部分切片命名，为空时与uri相同
+    std::string name;
+    // 切片保存在整段录像文件中时，在文件中的位置和长度，length为0表示整个文件
+    uint64_t offset;
+    uint64_t length;
+    // 切片的字节数，用来统计码率，0表示未知
+    uint64_t size;
+    // fMP4切片的初始化段地址（EXT-X-MAP），TS切片为空
+    std::string map;
+};
+
+// 阻塞刷新的请求满足条件或者超时后的回调，data为空表示超时或者请求的内容不存在
+using playlist_callback = void (*)(void *ctx, std::shared_ptr<const std::string> data);
+
+// 等待播放列表更新的请求
+struct PlaylistWaiter
+{
+    // 等待的切片序号和部分切片序号，part小于0表示等待整个切片
+    uint64_t msn;
+    int part;
+    // 等待的是部分切片的内容时为部分切片的地址，否则为空
+    std::string uri;
+    // 是否请求增量播放列表
+    bool skip;
+    time_t deadline;
+    void *ctx;
+    playlist_callback callback;
+};
+
+// 一路直播流的滑动窗口播放列表
+// 只保留最新的若干个切片，旧切片移出窗口时EXT-X-MEDIA-SEQUENCE随之增加。
+// 每次变化时重新生成一次m3u8，生成结果是只读的，所有拉流请求共享同一份。
+//
+// 低延迟直播（LL-HLS）：正在上传的切片每收到PART-TARGET时长的数据就发布一个部分切片，
+// 播放列表带上EXT-X-PART和下一个部分切片的EXT-X-PRELOAD-HINT。
+// 带_HLS_msn/_HLS_part的阻塞刷新请求和预加载请求在内容出现之前挂起，不占用线程。
+//
+// 增量更新：带_HLS_skip的请求返回增量播放列表，CAN-SKIP-UNTIL之前的切片用EXT-X-SKIP代替，
+// 窗口再长，每次刷新生成和发送的内容也只有最后一段。两种播放列表都在第一次请求时才生成。
+class LivePlaylist
+{
+public:
+    LivePlaylist(size_t window, double part_target = PART_TARGET);
+    ~LivePlaylist();
+
+    // 开始上传一个新切片，返回这次上传的编号，之后用这个编号添加部分切片。
+    // 同一时间只有一个切片可以发布部分切片，已经有切片在上传时返回0
+    uint64_t begin(const std::string &uri);
+    // 正在上传的切片收到了一个部分切片
+    void add_part(uint64_t upload, std::shared_ptr<const std::string> data, double duration, bool independent);
+    // 正在上传的切片上传失败
+    void abort(uint64_t upload);
+    // 添加一个新切片，正在上传的同名切片的部分切片随之转移，序号由播放列表分配；
+    // 窗口中已经有同名的切片时（推流端重传）原地替换
+    void append(Segment seg);
+    void append(const std::string &uri, double duration, std::shared_ptr<const TsIndex> index = nullptr,
+                uint64_t size = 0);
+    // 当前的m3u8内容，skip为true时返回增量播放列表
+    std::shared_ptr<const std::string> playlist(bool skip = false);
+
+    // 阻塞刷新：播放列表包含序号为msn的切片（part不小于0时为它的第part个部分切片）后返回播放列表
+    // 返回0表示条件已经满足，结果保存在out中；返回1表示请求已经挂起，满足条件或超时后调用callback；
+    // 返回-1表示请求的位置太靠后
+    int wait(uint64_t msn, int part, bool skip, void *ctx, playlist_callback callback,
+             std::shared_ptr<const std::string> &out);
+    // 获取部分切片的内容，请求的是预加载提示的部分切片时挂起，返回值同wait
+    int wait_part(const std::string &uri, void *ctx, playlist_callback callback, std::shared_ptr<const std::string> &out);
+    // 超时的请求返回空的结果
+    void expire(time_t now);
+
+    // 窗口内切片的峰值码率和平均码率（比特/秒），没有可以统计的切片时都为0
+    void bandwidth(uint64_t &peak, uint64_t &average);
+    // 主播放列表中这一路的分辨率，例如1280x720，为空表示未知
+    void set_resolution(const std::string &resolution);
+    std::string resolution();
+    // 启动以来这一路流收到的切片数和字节数
+    void ingested(uint64_t &segments, uint64_t &bytes);
+
+    double part_target() const { return m_partTarget; }
+    // 第n个部分切片的地址，A.ts的第3个部分切片为A.part3.ts
+    static std::string part_uri(const std::string &uri, size_t n);
+    static time_t now();
+
+private:
+    // 播放列表发生了变化，调用前需要加锁
+    void changed();
+    // 获取m3u8，没有生成过时生成一次，调用前需要加锁
+    std::shared_ptr<const std::string> get(bool skip);
+    std::shared_ptr<const std::string> render(bool skip);
+    // 查找条件是否满足，调用前需要加锁
+    bool ready(uint64_t msn, int part);
+    const Part *find_part(const std::string &uri);
+    // 取出已经满足条件的请求，调用前需要加锁，回调在解锁之后执行
+    void collect(std::vector<std::pair<PlaylistWaiter, std::shared_ptr<const std::string>>> &done);
+    static void fire(std::vector<std::pair<PlaylistWaiter, std::shared_ptr<const std::string>>> &done);
+
+private:
+    pthread_mutex_t m_lock;
+    std::deque<Segment> m_segments;
+    // 正在上传的切片，序号为m_nextMsn，m_pendingId是这次上传的编号
+    bool m_uploading;
+    Segment m_pending;
+    uint64_t m_pendingId;
+    uint64_t m_lastId;
+    // 下一个切片的序号
+    uint64_t m_nextMsn;
+    size_t m_window;
+    double m_partTarget;
+    // EXT-X-TARGETDURATION，不小于出现过的最长切片四舍五入后的时长
+    int m_targetDuration;
+    // 是否有EXT-X-BYTERANGE切片和EXT-X-MAP
+    bool m_byterange;
+    bool m_map;
+    // 完整的和增量的播放列表，发生变化后为空
+    std::shared_ptr<const std::string> m_full;
+    std::shared_ptr<const std::string> m_delta;
+    std::vector<PlaylistWaiter> m_waiters;
+    std::string m_resolution;
+    uint64_t m_ingestSegments;
+    uint64_t m_ingestBytes;
+};
+
+LivePlaylist::LivePlaylist(size_t window, double part_target)
+    : m_uploading(false), m_pendingId(0), m_lastId(0), m_nextMsn(0), m_window(window), m_partTarget(part_target),
+      m_targetDuration(TARGET_DURATION), m_byterange(false), m_map(false), m_ingestSegments(0), m_ingestBytes(0)
+{
+    pthread_mutex_init(&m_lock, NULL);
+}
+
+LivePlaylist::~LivePlaylist()
+{
+    pthread_mutex_destroy(&m_lock);
+}
+
+std::string LivePlaylist::part_uri(const std::string &uri, size_t n)
+{
+    size_t dot = uri.rfind('.');
+    if (dot == std::string::npos)
+        return uri + ".part" + std::to_string(n);
+    return uri.substr(0, dot) + ".part" + std::to_string(n) + uri.substr(dot);
+}
+
+time_t LivePlaylist::now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+uint64_t LivePlaylist::begin(const std::string &uri)
+{
+    std::vector<std::pair<PlaylistWaiter, std::shared_ptr<const std::string>>> done;
+    pthread_mutex_lock(&m_lock);
+    // 同一时间只有一个切片在上传，之后的上传不发布部分切片，完成时作为完整的切片加入
+    if (m_uploading)
+    {
+        pthread_mutex_unlock(&m_lock);
+        return 0;
+    }
+    m_uploading = true;
+    m_pending = Segment{m_nextMsn, uri, 0, nullptr, {}, "", uri, 0, 0, 0, ""};
+    m_pendingId = ++m_lastId;
+    changed();
+    collect(done);
+    uint64_t upload = m_pendingId;
+    pthread_mutex_unlock(&m_lock);
+    fire(done);
+    return upload;
+}
+
+void LivePlaylist::add_part(uint64_t upload, std::shared_ptr<const std::string> data, double duration, bool independent)
+{
+    std::vector<std::pair<PlaylistWaiter, std::shared_ptr<const std::string>>> done;
+    pthread_mutex_lock(&m_lock);
+    if (m_uploading && m_pendingId == upload)
+    {
+        m_pending.parts.push_back(Part{part_uri(m_pending.name, m_pending.parts.size()), duration, independent, data});
+        changed();
+        collect(done);
+    }
+    pthread_mutex_unlock(&m_lock);
+    fire(done);
+}
+
+void LivePlaylist::abort(uint64_t upload)
+{
+    pthread_mutex_lock(&m_lock);
+    if (m_uploading && m_pendingId == upload)
+    {
+        m_uploading = false;
+        m_pendingId = 0;
+        m_pending = Segment();
+        changed();
+    }
+    pthread_mutex_unlock(&m_lock);
+}
+
+void LivePlaylist::append(const std::string &uri, double duration, std::shared_ptr<const TsIndex> index, uint64_t size)
+{
+    append(Segment{0, uri, duration, index, {}, "", uri, 0, 0, size, ""});
+}
+
+void LivePlaylist::append(Segment seg)
+{
+    if (seg.name.empty())
+        seg.name = seg.uri;
+    double duration = seg.duration;
+    char line[128];
+    snprintf(line, sizeof(line), "#EXTINF:%.3f,\n", duration);
+    seg.line.assign(line);
+    if (seg.length > 0)
+    {
+        snprintf(line, sizeof(line), "#EXT-X-BYTERANGE:%llu@%llu\n",
+                 (unsigned long long)seg.length, (unsigned long long)seg.offset);
+        seg.line.append(line);
+    }
+    seg.line.append(seg.uri).push_back('\n');
+
+    std::vector<std::pair<PlaylistWaiter, std::shared_ptr<const std::string>>> done;
+    pthread_mutex_lock(&m_lock);
+    m_ingestSegments++;
+    m_ingestBytes += seg.size;
+    if (seg.length > 0)
+        m_byterange = true;
+    if (!seg.map.empty())
+        m_map = true;
+    // 推流端没有收到响应时会重传同一个切片，窗口中已经有的切片原地替换，不重复列出
+    auto old = std::find_if(m_segments.begin(), m_segments.end(),
+                            [&seg](const Segment &s) { return s.name == seg.name; });
+    if (old != m_segments.end())
+    {
+        seg.msn = old->msn;
+        seg.parts.swap(old->parts);
+        if (m_uploading && m_pending.name == seg.name)
+        {
+            m_uploading = false;
+            m_pendingId = 0;
+            m_pending = Segment();
+        }
+        *old = std::move(seg);
+    }
+    else
+    {
+        seg.msn = m_nextMsn++;
+        if (m_uploading && m_pending.name == seg.name)
+        {
+            seg.parts.swap(m_pending.parts);
+            m_uploading = false;
+            m_pendingId = 0;
+            m_pending = Segment();
+        }
+        // 没有发布部分切片的上传先完成了，正在上传的切片和等待它的部分切片的请求顺延到下一个序号
+        else if (m_uploading)
+        {
+            for (PlaylistWaiter &w : m_waiters)
+                if (!w.uri.empty() && w.msn == m_pending.msn)
+                    w.msn = m_nextMsn;
+            m_pending.msn = m_nextMsn;
+        }
+        m_segments.push_back(std::move(seg));
+        // 移出窗口之外的旧切片
+        while (m_segments.size() > m_window)
+            m_segments.pop_front();
+        // 较早的切片不再列出部分切片，释放它们的内存
+        if (m_segments.size() > PART_SEGMENTS)
+            std::vector<Part>().swap(m_segments[m_segments.size() - PART_SEGMENTS - 1].parts);
+    }
+    // 四舍五入后的切片时长不能超过EXT-X-TARGETDURATION
+    int target = (int)lround(duration);
+    if (target > m_targetDuration)
+        m_targetDuration = target;
+    changed();
+    collect(done);
+    pthread_mutex_unlock(&m_lock);
+    fire(done);
+}
+
+void LivePlaylist::bandwidth(uint64_t &peak, uint64_t &average)
+{
+    // BANDWIDTH是单个切片的最大码率，AVERAGE-BANDWIDTH是总字节数除以总时长
+    double max = 0, bytes = 0, seconds = 0;
+    pthread_mutex_lock(&m_lock);
+    for (const Segment &seg : m_segments)
+    {
+        uint64_t size = seg.size > 0 ? seg.size : seg.length;
+        if (size == 0 || seg.duration <= 0)
+            continue;
+        max = std::max(max, size * 8 / seg.duration);
+        bytes += size;
+        seconds += seg.duration;
+    }
+    pthread_mutex_unlock(&m_lock);
+    peak = (uint64_t)ceil(max);
+    average = seconds > 0 ? (uint64_t)ceil(bytes * 8 / seconds) : 0;
+}
+
+void LivePlaylist::set_resolution(const std::string &resolution)
+{
+    pthread_mutex_lock(&m_lock);
+    m_resolution = resolution;
+    pthread_mutex_unlock(&m_lock);
+}
+
+std::string LivePlaylist::resolution()
+{
+    pthread_mutex_lock(&m_lock);
+    std::string r = m_resolution;
+    pthread_mutex_unlock(&m_lock);
+    return r;
+}
+
+void LivePlaylist::ingested(uint64_t &segments, uint64_t &bytes)
+{
+    pthread_mutex_lock(&m_lock);
+    segments = m_ingestSegments;
+    bytes = m_ingestBytes;
+    pthread_mutex_unlock(&m_lock);
+}
+
+std::shared_ptr<const std::string> LivePlaylist::playlist(bool skip)
+{
+    pthread_mutex_lock(&m_lock);
+    std::shared_ptr<const std::string> p = get(skip);
+    pthread_mutex_unlock(&m_lock);
+    return p;
+}
+
+int LivePlaylist::wait(uint64_t msn, int part, bool skip, void *ctx, playlist_callback callback,
+                       std::shared_ptr<const std::string> &out)
+{
+    pthread_mutex_lock(&m_lock);
+    int ret = 0;
+    if (ready(msn, part))
+        out = get(skip);
+    // 请求的切片比下一个切片还要靠后两个以上
+    else if (msn > m_nextMsn + 2)
+        ret = -1;
+    else
+    {
+        // 最多等待3倍的目标时长
+        m_waiters.push_back(PlaylistWaiter{msn, part, "", skip, now() + 3 * m_targetDuration, ctx, callback});
+        ret = 1;
+    }
+    pthread_mutex_unlock(&m_lock);
+    return ret;
+}
+
+int LivePlaylist::wait_part(const std::string &uri, void *ctx, playlist_callback callback,
+                            std::shared_ptr<const std::string> &out)
+{
+    pthread_mutex_lock(&m_lock);
+    int ret = -1;
+    const Part *p = find_part(uri);
+    if (p != nullptr)
+    {
+        out = p->data;
+        ret = 0;
+    }
+    // 预加载提示的部分切片
+    else if (m_uploading && uri == part_uri(m_pending.name, m_pending.parts.size()))
+    {
+        m_waiters.push_back(PlaylistWaiter{m_pending.msn, (int)m_pending.parts.size(), uri, false,
+                                           now() + 3 * m_targetDuration, ctx, callback});
+        ret = 1;
+    }
+    pthread_mutex_unlock(&m_lock);
+    return ret;
+}
+
+void LivePlaylist::expire(time_t now)
+{
+    std::vector<std::pair<PlaylistWaiter, std::shared_ptr<const std::string>>> done;
+    pthread_mutex_lock(&m_lock);
+    for (size_t i = 0; i < m_waiters.size();)
+    {
+        if (m_waiters[i].deadline <= now)
+        {
+            done.emplace_back(m_waiters[i], nullptr);
+            m_waiters[i] = m_waiters.back();
+            m_waiters.pop_back();
+        }
+        else
+            i++;
+    }
+    pthread_mutex_unlock(&m_lock);
+    fire(done);
+}
+
+bool LivePlaylist::ready(uint64_t msn, int part)
+{
+    // 已经上传完成的切片
+    if (msn < m_nextMsn)
+    {
+        if (part < 0 || m_segments.empty() || msn < m_segments.front().msn)
+            return true;
+        // 超出这个切片的部分切片个数时，等待下一个切片的第一个部分切片
+        const Segment &seg = m_segments[msn - m_segments.front().msn];
+        if ((size_t)part >= seg.parts.size() && !seg.parts.empty())
+            return ready(msn + 1, 0);
+        return true;
+    }
+    // 正在上传的切片
+    return msn == m_nextMsn && part >= 0 && m_uploading && (size_t)part < m_pending.parts.size();
+}
+
+const Part *LivePlaylist::find_part(const std::string &uri)
+{
+    if (m_uploading)
+    {
+        for (const Part &p : m_pending.parts)
+            if (p.uri == uri)
+                return &p;
+    }
+    // 只有最近几个切片保留了部分切片
+    size_t n = 0;
+    for (auto it = m_segments.rbegin(); it != m_segments.rend() && n < PART_SEGMENTS; ++it, ++n)
+    {
+        for (const Part &p : it->parts)
+            if (p.uri == uri)
+                return &p;
+    }
+    return nullptr;
+}
+
+void LivePlaylist::collect(std::vector<std::pair<PlaylistWaiter, std::shared_ptr<const std::string>>> &done)
+{
+    for (size_t i = 0; i < m_waiters.size();)
+    {
+        PlaylistWaiter &w = m_waiters[i];
+        if (!ready(w.msn, w.part))
+        {
+            i++;
+            continue;
+        }
+        std::shared_ptr<const std::string> data;
+        if (w.uri.empty())
+            data = get(w.skip);
+        else
+        {
+            const Part *p = find_part(w.uri);
+            data = p ? p->data : nullptr;
+        }
+        done.emplace_back(w, data);
+        w = m_waiters.back();
+        m_waiters.pop_back();
+    }
+}
+
+void LivePlaylist::fire(std::vector<std::pair<PlaylistWaiter, std::shared_ptr<const std::string>>> &done)
+{
+    for (auto &d : done)
+        d.first.callback(d.first.ctx, d.second);
+}
+
+void LivePlaylist::changed()
+{
+    m_full.reset();
+    m_delta.reset();
+}
+
+std::shared_ptr<const std::string> LivePlaylist::get(bool skip)
+{
+    std::shared_ptr<const std::string> &p = skip ? m_delta : m_full;
+    if (!p)
+        p = render(skip);
+    return p;
+}
+
+std::shared_ptr<const std::string> LivePlaylist::render(bool skip)
+{
+    uint64_t first = m_segments.empty() ? m_nextMsn : m_segments.front().msn;
+    // 播放列表结尾之前CAN-SKIP-UNTIL秒以内的切片必须列出，更早的切片可以跳过
+    double skip_until = 6.0 * m_targetDuration;
+    size_t skipped = 0;
+    if (skip)
+    {
+        double tail = 0;
+        size_t keep = 0;
+        while (keep < m_segments.size() && tail + m_segments[m_segments.size() - 1 - keep].duration <= skip_until)
+            tail += m_segments[m_segments.size() - 1 - keep++].duration;
+        skipped = m_segments.size() - keep;
+    }
+
+    std::shared_ptr<std::string> out = std::make_shared<std::string>();
+    size_t body = 0;
+    for (size_t i = skipped; i < m_segments.size(); i++)
+        body += m_segments[i].line.size();
+    out->reserve(512 + body + (m_partTarget > 0 ? 1024 : 0));
+
+    char line[512];
+    // 增量播放列表要求版本9
+    int version = skip ? 9 : (m_partTarget > 0 || m_map ? 6 : (m_byterange ? 4 : 3));
+    if (m_partTarget > 0)
+    {
+        // 播放器至少落后3个部分切片
+        snprintf(line, sizeof(line),
+                 "#EXTM3U\n#EXT-X-VERSION:%d\n#EXT-X-TARGETDURATION:%d\n"
+                 "#EXT-X-SERVER-CONTROL:CAN-BLOCK-RELOAD=YES,CAN-SKIP-UNTIL=%.1f,CAN-SKIP-DATERANGES=YES,"
+                 "PART-HOLD-BACK=%.3f\n#EXT-X-PART-INF:PART-TARGET=%.3f\n#EXT-X-MEDIA-SEQUENCE:%llu\n",
+                 version, m_targetDuration, skip_until, 3 * m_partTarget, m_partTarget, (unsigned long long)first);
+    }
+    else
+    {
+        snprintf(line, sizeof(line),
+                 "#EXTM3U\n#EXT-X-VERSION:%d\n#EXT-X-TARGETDURATION:%d\n"
+                 "#EXT-X-SERVER-CONTROL:CAN-BLOCK-RELOAD=YES,CAN-SKIP-UNTIL=%.1f,CAN-SKIP-DATERANGES=YES\n"
+                 "#EXT-X-MEDIA-SEQUENCE:%llu\n",
+                 version, m_targetDuration, skip_until, (unsigned long long)first);
+    }
+    out->append(line);
+    if (skip)
+    {
+        snprintf(line, sizeof(line), "#EXT-X-SKIP:SKIPPED-SEGMENTS=%zu\n", skipped);
+        out->append(line);
+    }
+
+    auto append_parts = [&](const Segment &seg) {
+        for (const Part &p : seg.parts)
+        {
+            snprintf(line, sizeof(line), "#EXT-X-PART:DURATION=%.3f,URI=\"%s\"%s\n",
+                     p.duration, p.uri.c_str(), p.independent ? ",INDEPENDENT=YES" : "");
+            out->append(line);
+        }
+    };
+    // 初始化段发生变化时重新给出EXT-X-MAP，第一个列出的切片总是带上
+    const std::string *map = nullptr;
+    for (size_t i = skipped; i < m_segments.size(); i++)
+    {
+        const Segment &seg = m_segments[i];
+        if (!seg.map.empty() && (map == nullptr || *map != seg.map))
+        {
+            out->append("#EXT-X-MAP:URI=\"").append(seg.map).append("\"\n");
+            map = &seg.map;
+        }
+        if (i + PART_SEGMENTS >= m_segments.size())
+            append_parts(seg);
+        out->append(seg.line);
+    }
+    if (m_uploading)
+    {
+        append_parts(m_pending);
+        snprintf(line, sizeof(line), "#EXT-X-PRELOAD-HINT:TYPE=PART,URI=\"%s\"\n",
+                 part_uri(m_pending.name, m_pending.parts.size()).c_str());
+        out->append(line);
+    }
+    return out;
+}
+
+// 所有直播流的播放列表，按流的名称（用户名）索引
+// 多码率直播时每个码率是一路单独的流，名称为 用户名/码率名，
+// 主播放列表列出同一个用户名下的所有码率，播放器根据带宽选择其中一路。
+class PlaylistRegistry
+{
+public:
+    PlaylistRegistry(size_t window, double part_target = PART_TARGET)
+        : m_window(window), m_partTarget(part_target) { pthread_mutex_init(&m_lock, NULL); }
+    ~PlaylistRegistry() { pthread_mutex_destroy(&m_lock); }
+
+    // 查找直播流的播放列表，create为true时不存在就创建
+    std::shared_ptr<LivePlaylist> get(const std::string &stream, bool create);
+    // 所有直播流中超时的阻塞请求返回空的结果
+    void expire();
+    // 当前所有直播流的名称和播放列表
+    std::vector<std::pair<std::string, std::shared_ptr<LivePlaylist>>> streams();
+    // 用户名为stream的主播放列表，列出它的所有码率，还没有可以统计码率的切片时返回空
+    std::shared_ptr<const std::string> master(const std::string &stream);
+
+private:
+    pthread_mutex_t m_lock;
+    std::unordered_map<std::string, std::shared_ptr<LivePlaylist>> m_streams;
+    // 每个用户名下的码率名称
+    std::unordered_map<std::string, std::vector<std::string>> m_renditions;
+    size_t m_window;
+    double m_partTarget;
+};
+
+std::shared_ptr<LivePlaylist> PlaylistRegistry::get(const std::string &stream, bool create)
+{
+    pthread_mutex_lock(&m_lock);
+    std::shared_ptr<LivePlaylist> p;
+    auto it = m_streams.find(stream);
+    if (it != m_streams.end())
+        p = it->second;
+    else if (create)
+    {
+        p = m_streams[stream] = std::make_shared<LivePlaylist>(m_window, m_partTarget);
+        size_t slash = stream.find('/');
+        if (slash != std::string::npos)
+            m_renditions[stream.substr(0, slash)].push_back(stream.substr(slash + 1));
+    }
+    pthread_mutex_unlock(&m_lock);
+    return p;
+}
+
+std::vector<std::pair<std::string, std::shared_ptr<LivePlaylist>>> PlaylistRegistry::streams()
+{
+    std::vector<std::pair<std::string, std::shared_ptr<LivePlaylist>>> list;
+    pthread_mutex_lock(&m_lock);
+    list.reserve(m_streams.size());
+    for (auto &it : m_streams)
+        list.push_back(it);
+    pthread_mutex_unlock(&m_lock);
+    return list;
+}
+
+void PlaylistRegistry::expire()
+{
+    time_t now = LivePlaylist::now();
+    for (auto &it : streams())
+        it.second->expire(now);
+}
+
+std::shared_ptr<const std::string> PlaylistRegistry::master(const std::string &stream)
+{
+    // 没有码率名称的流也作为一个码率，地址相对于主播放列表
+    std::vector<std::pair<std::string, std::shared_ptr<LivePlaylist>>> variants;
+    pthread_mutex_lock(&m_lock);
+    auto it = m_streams.find(stream);
+    if (it != m_streams.end())
+        variants.emplace_back("main.m3u8", it->second);
+    auto r = m_renditions.find(stream);
+    if (r != m_renditions.end())
+    {
+        for (const std::string &name : r->second)
+            variants.emplace_back(name + "/main.m3u8", m_streams[stream + "/" + name]);
+    }
+    pthread_mutex_unlock(&m_lock);
+
+    struct Variant
+    {
+        uint64_t peak;
+        uint64_t average;
+        std::string resolution;
+        const std::string *uri;
+    };
+    std::vector<Variant> list;
+    for (auto &v : variants)
+    {
+        Variant item;
+        v.second->bandwidth(item.peak, item.average);
+        if (item.peak == 0)
+            continue;
+        item.resolution = v.second->resolution();
+        item.uri = &v.first;
+        list.push_back(std::move(item));
+    }
+    if (list.empty())
+        return nullptr;
+    // 从低码率到高码率
+    std::sort(list.begin(), list.end(), [](const Variant &a, const Variant &b) { return a.peak < b.peak; });
+
+    std::shared_ptr<std::string> out = std::make_shared<std::string>("#EXTM3U\n#EXT-X-VERSION:3\n");
+    char line[256];
+    for (const Variant &v : list)
+    {
+        snprintf(line, sizeof(line), "#EXT-X-STREAM-INF:BANDWIDTH=%llu,AVERAGE-BANDWIDTH=%llu",
+                 (unsigned long long)v.peak, (unsigned long long)v.average);
+        out->append(line);
+        if (!v.resolution.empty())
+            out->append(",RESOLUTION=").append(v.resolution);
+        out->append("\n").append(*v.uri).append("\n");
+    }
+    return out;
+}
+
+#endif
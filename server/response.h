@@ -0,0 +1,162 @@
+#ifndef _RESPONSE_H
+#define _RESPONSE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <charconv>
+#include <string>
+#include <string_view>
+#include "httpHeader.h"
+
+// 文件扩展名对应的Content-Type
+struct MimeType
+{
+    std::string_view ext;
+    std::string_view type;
+};
+
+constexpr MimeType MIME_TYPES[] = {
+    {"m3u8", "application/vnd.apple.mpegurl"},
+    {"ts", "video/mp2t"},
+    {"m4s", "video/iso.segment"},
+    {"mp4", "video/mp4"},
+    {"png", "image/png"},
+    {"html", "text/html"},
+    {"js", "application/javascript"},
+};
+
+#define DEFAULT_MIME_TYPE "application/octet-stream"
+
+// 根据路径的扩展名查找Content-Type，找不到时返回application/octet-stream
+constexpr std::string_view mime_type(std::string_view path)
+{
+    size_t dot = path.rfind('.');
+    if (dot == std::string_view::npos || path.find('/', dot) != std::string_view::npos)
+        return DEFAULT_MIME_TYPE;
+    std::string_view ext = path.substr(dot + 1);
+    for (const MimeType &m : MIME_TYPES)
+    {
+        if (m.ext == ext)
+            return m.type;
+    }
+    return DEFAULT_MIME_TYPE;
+}
+
+static_assert(mime_type("/video/lyj/main.m3u8") == "application/vnd.apple.mpegurl", "m3u8");
+static_assert(mime_type("WLWZ0.ts") == "video/mp2t", "ts");
+static_assert(mime_type("/a.b/c") == DEFAULT_MIME_TYPE, "no extension");
+
+// 状态行，编译时拼好
+constexpr std::string_view status_line(int status)
+{
+    switch (status)
+    {
+    case 100: return HTTP_VERSION " 100 Continue\r\n";
+    case 200: return HTTP_VERSION " 200 OK\r\n";
+    case 206: return HTTP_VERSION " 206 Partial Content\r\n";
+    case 304: return HTTP_VERSION " 304 Not Modified\r\n";
+    case 400: return HTTP_VERSION " 400 Bad Request\r\n";
+    case 404: return HTTP_VERSION " 404 Not Found\r\n";
+    case 413: return HTTP_VERSION " 413 Payload Too Large\r\n";
+    case 416: return HTTP_VERSION " 416 Range Not Satisfiable\r\n";
+    case 429: return HTTP_VERSION " 429 Too Many Requests\r\n";
+    case 500: return HTTP_VERSION " 500 Internal Server Error\r\n";
+    case 503: return HTTP_VERSION " 503 Service Unavailable\r\n";
+    default: return HTTP_VERSION " 500 Internal Server Error\r\n";
+    }
+}
+
+// 每个响应都有的响应头
+#define SERVER_HEADER "Server: " SERVER_NAME "\r\n"
+
+// 直接写入调用者缓冲区的响应头生成器
+// 状态行和固定的响应头是编译时常量，数字用to_chars在栈上转换，
+// 输出缓冲区（一般是连接的out）在连接上重复使用，容量够用后不再分配内存
+class ResponseBuilder
+{
+public:
+    explicit ResponseBuilder(std::string &out) : m_out(out) {}
+
+    // 状态行和Server头
+    ResponseBuilder &status(int code);
+    ResponseBuilder &header(std::string_view key, std::string_view value);
+    ResponseBuilder &header(std::string_view key, uint64_t value);
+    ResponseBuilder &content_type(std::string_view path) { return header("Content-Type", mime_type(path)); }
+    ResponseBuilder &content_length(uint64_t len) { return header("Content-Length", len); }
+    // Content-Range: bytes first-last/size，first为负数时为bytes */size
+    ResponseBuilder &content_range(int64_t first, int64_t last, uint64_t size);
+    // 长连接相关的响应头
+    ResponseBuilder &connection(bool keep_alive, int timeout, int remaining);
+    // 结束响应头
+    void end() { m_out.append("\r\n", 2); }
+
+private:
+    std::string &m_out;
+};
+
+ResponseBuilder &ResponseBuilder::status(int code)
+{
+    m_out.append(status_line(code));
+    m_out.append(SERVER_HEADER, sizeof(SERVER_HEADER) - 1);
+    return *this;
+}
+
+ResponseBuilder &ResponseBuilder::header(std::string_view key, std::string_view value)
+{
+    m_out.append(key).append(": ", 2).append(value).append("\r\n", 2);
+    return *this;
+}
+
+ResponseBuilder &ResponseBuilder::header(std::string_view key, uint64_t value)
+{
+    char num[24];
+    char *end = std::to_chars(num, num + sizeof(num), value).ptr;
+    return header(key, std::string_view(num, end - num));
+}
+
+ResponseBuilder &ResponseBuilder::content_range(int64_t first, int64_t last, uint64_t size)
+{
+    // 每个数最多20位，不会写满；每写一个数都检查结果，后面的分隔符一定在缓冲区之内
+    char num[72];
+    char *p = num;
+    char *end = num + sizeof(num);
+    std::to_chars_result r;
+    if (first < 0)
+    {
+        *p++ = '*';
+    }
+    else
+    {
+        r = std::to_chars(p, end, first);
+        if (r.ec != std::errc() || r.ptr == end)
+            return *this;
+        p = r.ptr;
+        *p++ = '-';
+        r = std::to_chars(p, end, last);
+        if (r.ec != std::errc() || r.ptr == end)
+            return *this;
+        p = r.ptr;
+    }
+    *p++ = '/';
+    r = std::to_chars(p, end, size);
+    if (r.ec != std::errc())
+        return *this;
+    m_out.append("Content-Range: bytes ", 21).append(num, r.ptr - num).append("\r\n", 2);
+    return *this;
+}
+
+ResponseBuilder &ResponseBuilder::connection(bool keep_alive, int timeout, int remaining)
+{
+    if (!keep_alive)
+        return header("Connection", "close");
+    char num[64];
+    char *p = num;
+    memcpy(p, "timeout=", 8);
+    p = std::to_chars(p + 8, num + sizeof(num), timeout).ptr;
+    memcpy(p, ", max=", 6);
+    p = std::to_chars(p + 6, num + sizeof(num), remaining).ptr;
+    header("Connection", "keep-alive");
+    return header("Keep-Alive", std::string_view(num, p - num));
+}
+
+#endif
@@ -0,0 +1,199 @@
+#ifndef _SEGMENTCACHE_H
+#define _SEGMENTCACHE_H
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <string>
+#include <list>
+#include <memory>
+#include <unordered_map>
+
+#define CACHE_SIZE_MB 256          // 缓存默认大小（MB）
+#define CACHE_MAX_FILE (16 << 20)  // 超过这个大小的文件不缓存
+
+// 缓存中的一个文件
+struct CacheEntry
+{
+    std::string path;
+    // 预先生成的响应头，不包含连接相关的字段和结尾的空行
+    std::string header;
+    // 文件内容
+    std::string body;
+};
+
+// 生成缓存文件响应头的函数
+using header_builder = std::string (*)(const std::string &path, off_t size);
+
+// 最近访问文件的内存缓存，按路径索引，总大小有上限，超出时淘汰最久没有访问的文件
+// 缓存项是只读的，通过shared_ptr在多个连接之间共享，不会拷贝文件内容
+class SegmentCache
+{
+public:
+    SegmentCache(size_t capacity, header_builder builder);
+    ~SegmentCache();
+
+    // 查找缓存，不存在时从磁盘读取并加入缓存。同一个文件同时只有一个线程读取，
+    // 其他请求这个文件的线程等它读完后直接使用缓存（刚发布的切片会被很多观众同时请求）
+    // 文件不存在或者太大时返回空，由调用者自己处理
+    std::shared_ptr<const CacheEntry> get(const std::string &path);
+    // 文件被修改了，删除对应的缓存
+    void invalidate(const std::string &path);
+
+    // 统计信息
+    void stats(size_t &bytes, size_t &hits, size_t &misses);
+
+private:
+    // 从磁盘读取文件
+    std::shared_ptr<CacheEntry> load(const std::string &path);
+    // 加入缓存并淘汰多余的文件，调用前需要加锁
+    void insert(std::shared_ptr<const CacheEntry> entry);
+    void evict();
+
+private:
+    using lru_list = std::list<std::shared_ptr<const CacheEntry>>;
+
+    pthread_mutex_t m_lock;
+    // 最近访问的在最前面
+    lru_list m_lru;
+    std::unordered_map<std::string, lru_list::iterator> m_map;
+    // 正在从磁盘读取的文件，读完后通过m_loaded通知等待的线程。
+    // 读取期间文件被修改时标记为true，读到的可能是旧的内容，不加入缓存
+    std::unordered_map<std::string, bool> m_loading;
+    pthread_cond_t m_loaded;
+    size_t m_capacity;
+    size_t m_bytes;
+    size_t m_hits;
+    size_t m_misses;
+    header_builder m_builder;
+};
+
+SegmentCache::SegmentCache(size_t capacity, header_builder builder)
+    : m_capacity(capacity), m_bytes(0), m_hits(0), m_misses(0), m_builder(builder)
+{
+    pthread_mutex_init(&m_lock, NULL);
+    pthread_cond_init(&m_loaded, NULL);
+}
+
+SegmentCache::~SegmentCache()
+{
+    pthread_cond_destroy(&m_loaded);
+    pthread_mutex_destroy(&m_lock);
+}
+
+std::shared_ptr<const CacheEntry> SegmentCache::get(const std::string &path)
+{
+    pthread_mutex_lock(&m_lock);
+    while (true)
+    {
+        auto it = m_map.find(path);
+        if (it != m_map.end())
+        {
+            // 移到链表头部
+            m_lru.splice(m_lru.begin(), m_lru, it->second);
+            std::shared_ptr<const CacheEntry> entry = *it->second;
+            m_hits++;
+            pthread_mutex_unlock(&m_lock);
+            return entry;
+        }
+        // 另一个线程正在读取这个文件，读完后重新查找；没能加入缓存时由自己读取
+        if (m_loading.find(path) == m_loading.end())
+            break;
+        pthread_cond_wait(&m_loaded, &m_lock);
+    }
+    m_misses++;
+    m_loading[path] = false;
+    pthread_mutex_unlock(&m_lock);
+
+    // 读取文件时不持有锁
+    std::shared_ptr<CacheEntry> entry = load(path);
+
+    pthread_mutex_lock(&m_lock);
+    auto loading = m_loading.find(path);
+    if (entry && !loading->second && m_map.find(path) == m_map.end())
+        insert(entry);
+    m_loading.erase(loading);
+    pthread_cond_broadcast(&m_loaded);
+    pthread_mutex_unlock(&m_lock);
+    return entry;
+}
+
+void SegmentCache::invalidate(const std::string &path)
+{
+    pthread_mutex_lock(&m_lock);
+    auto loading = m_loading.find(path);
+    if (loading != m_loading.end())
+        loading->second = true;
+    auto it = m_map.find(path);
+    if (it != m_map.end())
+    {
+        m_bytes -= (*it->second)->body.size();
+        m_lru.erase(it->second);
+        m_map.erase(it);
+    }
+    pthread_mutex_unlock(&m_lock);
+}
+
+void SegmentCache::stats(size_t &bytes, size_t &hits, size_t &misses)
+{
+    pthread_mutex_lock(&m_lock);
+    bytes = m_bytes;
+    hits = m_hits;
+    misses = m_misses;
+    pthread_mutex_unlock(&m_lock);
+}
+
+std::shared_ptr<CacheEntry> SegmentCache::load(const std::string &path)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return nullptr;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size > CACHE_MAX_FILE ||
+        (size_t)st.st_size > m_capacity)
+    {
+        close(fd);
+        return nullptr;
+    }
+
+    std::shared_ptr<CacheEntry> entry = std::make_shared<CacheEntry>();
+    entry->path = path;
+    entry->body.resize(st.st_size);
+    off_t pos = 0;
+    while (pos < st.st_size)
+    {
+        ssize_t n = pread(fd, &entry->body[pos], st.st_size - pos, pos);
+        if (n <= 0)
+        {
+            close(fd);
+            return nullptr;
+        }
+        pos += n;
+    }
+    close(fd);
+    entry->header = m_builder(path, st.st_size);
+    return entry;
+}
+
+void SegmentCache::insert(std::shared_ptr<const CacheEntry> entry)
+{
+    m_lru.push_front(entry);
+    m_map[entry->path] = m_lru.begin();
+    m_bytes += entry->body.size();
+    evict();
+}
+
+void SegmentCache::evict()
+{
+    // 被淘汰的缓存项如果还在发送，由正在使用的连接持有，发送完才释放
+    while (m_bytes > m_capacity && !m_lru.empty())
+    {
+        const std::shared_ptr<const CacheEntry> &victim = m_lru.back();
+        m_bytes -= victim->body.size();
+        m_map.erase(victim->path);
+        m_lru.pop_back();
+    }
+}
+
+#endif
@@ -10,20 +10,81 @@
 #include <unistd.h>
 #include <stdbool.h>
 #include <stdlib.h>
-#include <fstream>  
+#include <fcntl.h>
+#include <signal.h>
 #include "httpHeader.h"
+#include "response.h"
 #include "threadPool.h"
+#include "eventLoop.h"
+#include "segmentCache.h"
+#include "playlist.h"
+#include "tsIndexer.h"
+#include "upload.h"
+#include "config.h"
+#include "metrics.h"
+#include "accessLog.h"
+#include "shard.h"
+#ifdef HLS_IO_URING
+#include "uringLoop.h"
+#endif
 
-#define PORT 8080
 #define IP "127.0.0.1"
-#define BUFSIZE 8192
 
 // 保存路径
 const std::string serverpath("/home/lyj/hls/server/");
-// 缓冲区
-char buf[BUFSIZE];
+// 最近访问文件的缓存，为空表示不使用缓存
+SegmentCache* cache = nullptr;
+// 直播流的播放列表
+PlaylistRegistry* playlists = nullptr;
+// 整段录像模式，上传的切片追加到每路流的一个录像文件中
+bool archive_mode = false;
+// 上传的TS切片转换成CMAF（fMP4）提供
+bool cmaf_mode = false;
+// 上传的切片由专门的写线程写入磁盘
+DiskWriter* writer = nullptr;
+// 接收和处理连接的分片，每个分片有自己的事件循环和线程池
+ShardSet* shards = nullptr;
+
+/* 检查用作路径一部分的名称，不能为空，不能包含目录 */
+bool valid_name(const std::string& name)
+{
+    return !name.empty() && name.find('/') == std::string::npos && name != "." && name != "..";
+}
+
+/* 检查直播流的名称，用户名或者 用户名/码率名 */
+bool valid_stream(const std::string& stream)
+{
+    size_t slash = stream.find('/');
+    if (slash == std::string::npos) return valid_name(stream);
+    return valid_name(stream.substr(0, slash)) && valid_name(stream.substr(slash + 1));
+}
+
+/* 上传请求对应的直播流名称，多码率直播时带上码率名，不合法时返回空 */
+std::string upload_stream(httpHeader& http)
+{
+    std::string username(http.get("username"));
+    std::string rendition(http.get("rendition"));
+    if (!valid_name(username) || (!rendition.empty() && !valid_name(rendition)))
+        return "";
+    return rendition.empty() ? username : username + "/" + rendition;
+}
 
-void handle_cgi(int client_sock, httpHeader& http)
+/* 添加长连接相关的响应头 */
+void add_conn_headers(Connection* conn, ResponseBuilder& rb)
+{
+    rb.connection(conn->keep_alive, conn->loop->idle_timeout(), conn->loop->max_requests() - conn->requests);
+}
+
+/* 发送没有响应体的状态响应 */
+void send_status(Connection* conn, int status)
+{
+    ResponseBuilder rb(conn->out);
+    rb.status(status).content_length(0);
+    add_conn_headers(conn, rb);
+    rb.end();
+}
+
+void handle_cgi(Connection* conn)
 {
     int cgi_output[2];
     int cgi_input[2];
@@ -37,8 +98,13 @@ void handle_cgi(int client_sock, httpHeader& http)
     pid_t pid = fork();
     if (pid < 0)
     {
-        perror("fork error\n");
-        exit(0);
+        AccessLog::message(LOG_ERROR, "fork error: %s", strerror(errno));
+        close(cgi_output[0]);
+        close(cgi_output[1]);
+        close(cgi_input[0]);
+        close(cgi_input[1]);
+        send_status(conn, 500);
+        return;
     }
     if (pid == 0)
     {
@@ -62,15 +128,19 @@ void handle_cgi(int client_sock, httpHeader& http)
         close(cgi_output[1]);
         close(cgi_input[0]);
 
-        httpHeader::makeheader(httpHeader::params_200, buf, BUFSIZ);
-        printf("%s", buf);
-        send(client_sock, buf, strlen(buf), 0);
+        // cgi的输出没有长度，发送完关闭连接
+        conn->keep_alive = false;
+        ResponseBuilder rb(conn->out);
+        rb.status(200);
+        add_conn_headers(conn, rb);
+        rb.end();
 
-        // 读取cgi脚本返回数据
+        // 读取cgi脚本返回数据，缓冲区在当前线程的栈上
+        char buf[READ_CHUNK];
         int read_bytes = 0;
-        while ((read_bytes = read(cgi_output[0], buf, BUFSIZ)) > 0)
+        while ((read_bytes = read(cgi_output[0], buf, sizeof(buf))) > 0)
         {
-            send(client_sock, buf, read_bytes, 0);
+            conn->out.append(buf, read_bytes);
         }
 
         // 关闭管道
@@ -80,61 +150,339 @@ void handle_cgi(int client_sock, httpHeader& http)
         int status;
         if (waitpid(pid, &status, 0) == -1)
         {
-            printf("waitpid error %d", status);
+            AccessLog::message(LOG_ERROR, "waitpid error %d", errno);
         }
     }
 }
 
-/* 保存推流端上传的文件 */
-int handle_save(int client_sock, httpHeader& http) {
-    // 保存文件的地址
-    std::string filepath = serverpath;
-    std::string m3u8path = serverpath;
-    filepath += std::string("httpfile/video/") + http.get("username") + "/" + http.get("filename");
-    m3u8path += std::string("httpfile/video/") + http.get("username") + "/main.m3u8";
-
-    // 打开文件，如果文件不存在则创建它  
-    // 使用 std::ios::binary 以二进制模式打开文件  
-    // 使用 std::ios::out 以写入模式打开文件  
-    std::fstream file(filepath, std::ios::binary | std::ios::out);
-    // 检查文件是否成功打开  
-    if (!file) {  
-        std::cerr << "无法打开文件" << filepath << '!' << std::endl;  
-        close(client_sock);
-        return -1;  
-    }   
-    // 写入数据
-    std::string data = http.get("OutBandData");
-    file.write(data.c_str(), data.size());
-    // 关闭文件
-    file.close();
-
-
-    // 打开m3u8文件，并追加内容
-    std::fstream file2(m3u8path, std::ios::app);
-    // 检查文件是否成功打开  
-    if (!file2) {  
-        std::cerr << "无法打开文件" << m3u8path << '!' << std::endl;  
-        close(client_sock);
-        return -1;  
-    }   
-    // 写入数据
-    std::string data2 = "#EXTINF:10\n";
-    data2 += "http://" + http.get("Host") + "/video/" + http.get("username") + "/" + http.get("filename") + "\n";
-    file2.write(data2.c_str(), data2.size());
-    // 关闭文件
-    file2.close();
+/* 切片已经写入页缓存并重命名，加入直播流的播放列表，在写线程中调用 */
+void save_published(WriteFile* file, void* ctx, int status)
+{
+    (void)file;
+    if (status < 0) return;
+    Connection* conn = static_cast<Connection*>(ctx);
+    UploadSink* upload = static_cast<UploadSink*>(conn->sink);
+    std::shared_ptr<TsIndex> index = std::make_shared<TsIndex>(upload->indexer().index());
+    // 不是TS文件或者没有时间戳时按默认时长处理
+    double duration = index->valid() ? index->duration() : TARGET_DURATION;
+    if (cache != nullptr) cache->invalidate(upload->path());
+
+    std::string stream = upload_stream(conn->http);
+    std::string filename(conn->http.get("filename"));
+    std::shared_ptr<LivePlaylist> live = playlists->get(stream, true);
+    // 推流端没有给出分辨率时使用转换fMP4时从SPS中得到的分辨率
+    if (!upload->resolution().empty() && live->resolution().empty())
+        live->set_resolution(upload->resolution());
+    if (upload->archive())
+        live->append(
+            Segment{0, ARCHIVE_NAME, duration, index, {}, "", filename, upload->offset(), upload->bytes(), upload->bytes(), ""});
+    else
+        live->append(Segment{0, upload->uri(), duration, index, {}, "", filename, 0, 0, upload->stored(), upload->map()});
+}
+
+/* 切片按持久化策略落盘后回复推流端，在写线程中调用 */
+void save_durable(WriteFile* file, void* ctx, int status)
+{
+    (void)file;
+    Connection* conn = static_cast<Connection*>(ctx);
+    send_status(conn, status == 0 ? 200 : 500);
+    conn->loop->release(conn);
+}
+
+/* 保存推流端上传的文件，交给写线程后返回0，响应由写线程完成后发送 */
+int handle_save(Connection* conn) {
+    // 请求体已经由事件循环交给写线程，上传时已经扫描过切片，得到实际时长和关键帧位置
+    UploadSink* upload = static_cast<UploadSink*>(conn->sink);
+    if (upload == nullptr) return -1;
+    std::shared_ptr<TsIndex> index = std::make_shared<TsIndex>(upload->indexer().index());
+    double duration = index->valid() ? index->duration() : TARGET_DURATION;
+
+    // 推流端等写线程写完再收到响应，线程池不等待磁盘
+    conn->loop->hold(conn);
+    if (upload->commit(duration, save_published, save_durable, conn) < 0) {
+        conn->loop->release(conn);
+        AccessLog::message(LOG_ERROR, "无法保存文件%s!", upload->path().c_str());
+        return -1;
+    }
+    return 0;
+}
+
+/* 请求头解析完成后在事件循环中调用，上传的文件边接收边写入磁盘 */
+BodySink* stream_body(Connection* conn)
+{
+    httpHeader& http = conn->http;
+    if (http.path() != "/upload" || http.get_method() != METHOD_POST)
+        return nullptr;
+
+    // 用户名、码率名和文件名都会成为路径的一部分
+    std::string stream = upload_stream(http);
+    std::string filename(http.get("filename"));
+    std::string resolution(http.get("resolution"));
+    int width, height;
+    char end;
+    if (stream.empty() || !valid_name(filename) ||
+        (!resolution.empty() && sscanf(resolution.c_str(), "%dx%d%c", &width, &height, &end) != 2)) {
+        std::string username(http.get("username"));
+        AccessLog::message(LOG_WARN, "非法的文件名%s/%s", username.c_str(), filename.c_str());
+        return nullptr;
+    }
+
+    // 整段录像模式需要按Content-Length预留位置，不接受分块编码的上传
+    if (archive_mode && http.chunked()) {
+        AccessLog::message(LOG_WARN, "整段录像模式不支持分块上传");
+        return nullptr;
+    }
+
+    // 保存文件的地址，多码率直播时每个码率一个子目录
+    std::string dirpath = serverpath + "httpfile/video/" + stream;
+    size_t slash = stream.find('/');
+    if (slash != std::string::npos)
+        mkdir((serverpath + "httpfile/video/" + stream.substr(0, slash)).c_str(), 0755);
+    mkdir(dirpath.c_str(), 0755);
+
+    UploadSink* upload = new UploadSink(writer, dirpath, filename, archive_mode, cmaf_mode);
+    if (upload->open(http.body_length()) < 0) {
+        delete upload;
+        return nullptr;
+    }
+    // 低延迟直播，边接收边发布部分切片
+    std::shared_ptr<LivePlaylist> live = playlists->get(stream, true);
+    if (!resolution.empty())
+        live->set_resolution(resolution);
+    upload->publish(live);
+    return upload;
+}
+
+/* 发送内存中的响应体 */
+void send_body(Connection* conn, std::shared_ptr<const std::string> body, std::string_view content_type)
+{
+    ResponseBuilder rb(conn->out);
+    rb.status(200)
+      .header("Content-Type", content_type)
+      .header("Cache-Control", "no-cache")
+      .content_length(body->size());
+    add_conn_headers(conn, rb);
+    rb.end();
+    conn->body = body;
+    conn->body_pos = 0;
+}
+
+/* 阻塞刷新的播放列表或者预加载的部分切片准备好了，也可能是等待超时 */
+void live_ready(void* ctx, std::shared_ptr<const std::string> data)
+{
+    Connection* conn = static_cast<Connection*>(ctx);
+    if (!data)
+        send_status(conn, 503);
+    else
+        send_body(conn, data, mime_type(conn->http.path()));
+    conn->loop->release(conn);
+}
+
+/* 发送直播流的播放列表，这路流不在内存中时返回false */
+bool handle_playlist(Connection* conn, httpHeader& http, const std::string& stream)
+{
+    std::shared_ptr<LivePlaylist> live = playlists->get(stream, false);
+    if (!live) return false;
+
+    // 增量更新 _HLS_skip=YES|v2，没有日期范围标签，两者相同
+    std::string_view skip_param = http.param("_HLS_skip");
+    bool skip = skip_param == "YES" || skip_param == "v2";
+
+    // 所有请求共享同一份生成好的m3u8
+    std::shared_ptr<const std::string> body = live->playlist(skip);
+
+    // 阻塞刷新 _HLS_msn=<M>&_HLS_part=<P>
+    std::string msn(http.param("_HLS_msn"));
+    std::string part(http.param("_HLS_part"));
+    if (!msn.empty()) {
+        conn->loop->hold(conn);
+        int ret = live->wait(strtoull(msn.c_str(), NULL, 10), part.empty() ? -1 : atoi(part.c_str()), skip,
+                             conn, live_ready, body);
+        if (ret == 1) return true;
+        conn->loop->release(conn);
+        if (ret < 0) {
+            send_status(conn, 400);
+            return true;
+        }
+    }
+    else if (!part.empty()) {
+        send_status(conn, 400);
+        return true;
+    }
+
+    send_body(conn, body, mime_type(http.path()));
+    return true;
+}
+
+/* 发送多码率直播的主播放列表，还没有可用的码率时返回false */
+bool handle_master(Connection* conn, const std::string& stream)
+{
+    std::shared_ptr<const std::string> body = playlists->master(stream);
+    if (!body) return false;
+    send_body(conn, body, mime_type(conn->http.path()));
+    return true;
+}
+
+/* 发送低延迟直播的部分切片，不是部分切片时返回false */
+bool handle_part(Connection* conn, const std::string& stream, const std::string& name)
+{
+    if (name.find(".part") == std::string::npos) return false;
+    std::shared_ptr<LivePlaylist> live = playlists->get(stream, false);
+    if (!live) return false;
+
+    std::shared_ptr<const std::string> data;
+    conn->loop->hold(conn);
+    int ret = live->wait_part(name, conn, live_ready, data);
+    if (ret == 1) return true;
+    conn->loop->release(conn);
+    if (ret < 0) {
+        send_status(conn, 404);
+        return true;
+    }
+    send_body(conn, data, mime_type(name));
+    return true;
+}
+
+/* 缓存使用的响应头，不包含连接相关的字段和结尾的空行 */
+std::string file_header(const std::string& path, off_t size)
+{
+    std::string header;
+    ResponseBuilder(header).status(200)
+        .content_type(path)
+        .content_length(size)
+        .header("Accept-Ranges", "bytes");
+    return header;
+}
+
+/* 发送文件的一个或多个范围，entry不为空时从缓存发送，否则从file发送 */
+int send_ranges(Connection* conn, const std::string& path, off_t size, int ret,
+                const std::vector<std::pair<off_t, off_t>>& ranges,
+                std::shared_ptr<const CacheEntry> entry, int file)
+{
+    ResponseBuilder rb(conn->out);
+
+    // 所有范围都无法满足
+    if (ret < 0) {
+        if (file >= 0) close(file);
+        rb.status(416).content_range(-1, -1, size).content_length(0);
+        add_conn_headers(conn, rb);
+        rb.end();
+        return 0;
+    }
+
+    // 只有一个范围，直接发送文件的这一段
+    if (ranges.size() == 1) {
+        off_t first = ranges[0].first, last = ranges[0].second;
+        rb.status(206)
+          .content_type(path)
+          .header("Accept-Ranges", "bytes")
+          .content_range(first, last, size)
+          .content_length(last - first + 1);
+        add_conn_headers(conn, rb);
+        rb.end();
+        if (entry) {
+            conn->body = std::shared_ptr<const std::string>(entry, &entry->body);
+            conn->body_pos = first;
+            conn->body_end = last + 1;
+        }
+        else {
+            conn->file_fd = file;
+            conn->file_pos = first;
+            conn->file_end = last + 1;
+        }
+        return 0;
+    }
 
+    // 多个范围，用multipart/byteranges拼成一个响应体
+    static std::atomic<unsigned long> counter(0);
+    std::string boundary = "hls_byteranges_" + std::to_string(counter++);
+    std::shared_ptr<std::string> body = std::make_shared<std::string>();
+    for (auto& r : ranges) {
+        body->append("\r\n--").append(boundary).append("\r\n");
+        ResponseBuilder part(*body);
+        part.content_type(path).content_range(r.first, r.second, size).end();
+        size_t len = r.second - r.first + 1;
+        if (entry) {
+            body->append(entry->body, r.first, len);
+            continue;
+        }
+        size_t old = body->size();
+        body->resize(old + len);
+        ssize_t n = pread(file, &(*body)[old], len, r.first);
+        if (n != (ssize_t)len) {
+            close(file);
+            conn->out.clear();
+            send_status(conn, 500);
+            return -1;
+        }
+    }
+    body->append("\r\n--").append(boundary).append("--\r\n");
+    if (file >= 0) close(file);
+
+    rb.status(206)
+      .header("Accept-Ranges", "bytes")
+      .header("Content-Type", "multipart/byteranges; boundary=" + boundary)
+      .content_length(body->size());
+    add_conn_headers(conn, rb);
+    rb.end();
+    conn->body = body;
+    conn->body_pos = 0;
     return 0;
 }
 
 /* 将拉流端的文件传出 */
-int handle_file(int client_sock, httpHeader& http) {
-    std::string path = http.get("path");
-    path = serverpath + "/httpfile" + path;
+int handle_file(Connection* conn, httpHeader& http) {
+    // 路径在每个线程的同一个字符串中拼接，容量够用后不再分配内存
+    static thread_local std::string path;
+    path.assign(serverpath).append("httpfile").append(http.path());
     // 如果是目录就添加html的头
     if (path.back() == '/') path += "index.html";
 
+    // 直播流的播放列表 /video/<username>[/<rendition>]/main.m3u8、
+    // 主播放列表 /video/<username>/master.m3u8 和部分切片在内存中
+    std::string_view url = http.path();
+    if (url.size() > 17 && url.compare(0, 7, "/video/") == 0 &&
+        url.compare(url.size() - 10, 10, "/main.m3u8") == 0) {
+        std::string stream(url.substr(7, url.size() - 17));
+        if (valid_stream(stream) && handle_playlist(conn, http, stream))
+            return 0;
+    }
+    else if (url.size() > 19 && url.compare(0, 7, "/video/") == 0 &&
+             url.compare(url.size() - 12, 12, "/master.m3u8") == 0) {
+        std::string stream(url.substr(7, url.size() - 19));
+        if (valid_name(stream) && handle_master(conn, stream))
+            return 0;
+    }
+    else if (url.size() > 7 && url.compare(0, 7, "/video/") == 0) {
+        size_t slash = url.rfind('/');
+        if (slash > 7) {
+            std::string stream(url.substr(7, slash - 7));
+            std::string name(url.substr(slash + 1));
+            if (valid_stream(stream) && valid_name(name) && handle_part(conn, stream, name))
+                return 0;
+        }
+    }
+
+    // 请求文件的一部分
+    static thread_local std::vector<std::pair<off_t, off_t>> ranges;
+
+    // 优先从缓存发送，多个连接共享同一份文件内容
+    if (cache != nullptr) {
+        std::shared_ptr<const CacheEntry> entry = cache->get(path);
+        int ret = entry ? http.ranges(entry->body.size(), ranges) : 0;
+        if (ret != 0)
+            return send_ranges(conn, path, entry->body.size(), ret, ranges, entry, -1);
+        if (entry) {
+            conn->out = entry->header;
+            ResponseBuilder rb(conn->out);
+            add_conn_headers(conn, rb);
+            rb.end();
+            conn->body = std::shared_ptr<const std::string>(entry, &entry->body);
+            conn->body_pos = 0;
+            return 0;
+        }
+    }
+
     // 查看文件状态
     struct stat st;
     int ret = stat(path.c_str(),&st);
@@ -142,183 +490,281 @@ int handle_file(int client_sock, httpHeader& http) {
     // 文件不存在
     if (ret < 0) {
         // 发送 404 的头
-        memset(buf,0,BUFSIZE);
-        httpHeader::makeheader(httpHeader::params_404, buf, BUFSIZE);
-        send(client_sock, buf, strlen(buf), 0);
+        send_status(conn, 404);
         return -1;
     }
 
-    // 获取文件大小,字符串
-    std::string file_size = std::to_string(st.st_size);
-
     // 打开文件
-    FILE *file = fopen(path.c_str(), "rb");
-    if (file == NULL) {
+    int file = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (file < 0) {
         // 发送 400 的头
-        memset(buf,0,BUFSIZE);
-        httpHeader::makeheader(httpHeader::params_400, buf, BUFSIZE);
-        send(client_sock, buf, strlen(buf), 0);
+        send_status(conn, 400);
         return -1;
     }
 
-    // 如果请求的是图片
-    else if (path.substr(path.size()-3).compare("png") == 0) {
-        std::unordered_map<std::string,std::string> params = {
-            {"http_version",HTTP_VERSION},
-            {"status","200"},
-            {"Server",SERVER_NAME},
-            {"Content-Type","image/png"},
-            {"Content-Length", file_size}
-        };
-        // 发送 200 的头
-        memset(buf,0,BUFSIZE);
-        httpHeader::makeheader(params, buf, BUFSIZE);
-        send(client_sock, buf, strlen(buf), 0);
-    }
+    int ret_range = http.ranges(st.st_size, ranges);
+    if (ret_range != 0)
+        return send_ranges(conn, path, st.st_size, ret_range, ranges, nullptr, file);
 
-    // 如果请求的是视频
-    else if (path.substr(path.size()-3).compare("mp4") == 0) {
-        std::unordered_map<std::string,std::string> params = {
-            {"http_version",HTTP_VERSION},
-            {"status","200"},
-            {"Server",SERVER_NAME},
-            {"Content-Type","video/mp4"},
-            {"Content-Length", file_size}
-        };
-        // 发送 200 的头
-        memset(buf,0,BUFSIZE);
-        httpHeader::makeheader(params, buf, BUFSIZE);
-        send(client_sock, buf, strlen(buf), 0);
-    }
+    // 发送 200 的头
+    ResponseBuilder rb(conn->out);
+    rb.status(200)
+      .content_type(path)
+      .content_length(st.st_size)
+      .header("Accept-Ranges", "bytes");
+    add_conn_headers(conn, rb);
+    rb.end();
+
+    // 文件内容由事件循环负责发送
+    conn->file_fd = file;
+    conn->file_pos = 0;
+    conn->file_end = st.st_size;
+
+    return 0;
+}
 
-    // 如果请求的是视频
-    else if (path.substr(path.size()-2).compare("ts") == 0) {
-        std::unordered_map<std::string,std::string> params = {
-            {"http_version",HTTP_VERSION},
-            {"status","200"},
-            {"Server",SERVER_NAME},
-            {"Content-Type","video/ts"},
-            {"Content-Length", file_size}
-        };
-        // 发送 200 的头
-        memset(buf,0,BUFSIZE);
-        httpHeader::makeheader(params, buf, BUFSIZE);
-        send(client_sock, buf, strlen(buf), 0);
+/* 请求属于哪一类路由，用来分别统计请求数和延迟 */
+int request_route(httpHeader& http)
+{
+    std::string_view url = http.path();
+    int method = http.get_method();
+    if (method == METHOD_POST)
+        return url == "/upload" ? ROUTE_UPLOAD : ROUTE_OTHER;
+    if (method != METHOD_GET)
+        return ROUTE_OTHER;
+    if (url == "/metrics")
+        return ROUTE_METRICS;
+    if (url.size() > 7 && url.compare(0, 7, "/video/") == 0) {
+        if (url.size() > 10 && url.compare(url.size() - 10, 10, "/main.m3u8") == 0)
+            return ROUTE_PLAYLIST;
+        if (url.size() > 12 && url.compare(url.size() - 12, 12, "/master.m3u8") == 0)
+            return ROUTE_MASTER;
+        if (url.find(".part", url.rfind('/')) != std::string_view::npos)
+            return ROUTE_PART;
+        return ROUTE_SEGMENT;
     }
+    return ROUTE_STATIC;
+}
 
-    // 如果请求的是m3u8请求
-    else if (path.substr(path.size()-2).compare("ts") == 0) {
-        std::unordered_map<std::string,std::string> params = {
-            {"http_version",HTTP_VERSION},
-            {"status","200"},
-            {"Server",SERVER_NAME},
-            {"Content-Type","text/m3u8"},
-            {"Content-Length", file_size}
-        };
-        // 发送 200 的头
-        memset(buf,0,BUFSIZE);
-        httpHeader::makeheader(params, buf, BUFSIZE);
-        send(client_sock, buf, strlen(buf), 0);
+/* 响应发送完毕，在事件循环中记录请求数、延迟和访问日志，状态码从响应的状态行中取出 */
+void response_done(Connection* conn, uint64_t elapsed_ns)
+{
+    const std::string& out = conn->out;
+    int status = 0;
+    if (out.size() > 12 && out.compare(0, 5, "HTTP/") == 0)
+        status = atoi(out.c_str() + 9);
+    int route = request_route(conn->http);
+    Metrics::request(route, status, elapsed_ns);
+
+    // 采集/metrics的请求很频繁，只在debug级别记录
+    int level = status >= 500 ? LOG_ERROR : status >= 400 ? LOG_WARN : route == ROUTE_METRICS ? LOG_DEBUG : LOG_INFO;
+    if (AccessLog::enabled(level))
+        AccessLog::access(level, conn->http.method(), conn->http.path(), status, conn->sent, elapsed_ns,
+                          Metrics::route_name(route));
+}
+
+/* 以Prometheus文本格式输出服务端的运行状态 */
+void handle_metrics(Connection* conn)
+{
+    std::shared_ptr<std::string> body = std::make_shared<std::string>();
+    std::string& out = *body;
+    Metrics::render(out);
+
+    // 所有分片的统计加在一起
+    uint64_t bytes_in = 0, bytes_out = 0, shed_low = 0, shed_high = 0, syscalls = 0;
+    int connections = 0, queued = 0, busy = 0, alive = 0;
+    for (int i = 0; i < shards->size(); i++)
+    {
+        Shard& s = (*shards)[i];
+        bytes_in += s.loop->bytes_in();
+        bytes_out += s.loop->bytes_out();
+        connections += s.loop->connections();
+        shed_low += s.loop->shed_count(PRIORITY_LOW);
+        shed_high += s.loop->shed_count(PRIORITY_HIGH);
+        syscalls += s.loop->syscalls();
+        queued += s.pool->getQueueNumber();
+        busy += s.pool->getBusyNumber();
+        alive += s.pool->getAliveNumber();
+    }
+    Metrics::describe(out, "hls_received_bytes_total", "counter", "Bytes read from client sockets.");
+    Metrics::sample(out, "hls_received_bytes_total", "", bytes_in);
+    Metrics::describe(out, "hls_sent_bytes_total", "counter", "Bytes written to client sockets.");
+    Metrics::sample(out, "hls_sent_bytes_total", "", bytes_out);
+    Metrics::describe(out, "hls_connections", "gauge", "Open client connections.");
+    Metrics::sample(out, "hls_connections", "", connections);
+    Metrics::describe(out, "hls_shed_total", "counter", "Requests rejected with 503 because the worker queue was full.");
+    Metrics::sample(out, "hls_shed_total", "priority=\"low\"", shed_low);
+    Metrics::sample(out, "hls_shed_total", "priority=\"high\"", shed_high);
+    Metrics::describe(out, "hls_event_loop_syscalls_total", "counter", "System calls issued by the event loop threads.");
+    Metrics::sample(out, "hls_event_loop_syscalls_total", "", syscalls);
+
+    Metrics::describe(out, "hls_worker_queue_depth", "gauge", "Requests waiting for a worker thread.");
+    Metrics::sample(out, "hls_worker_queue_depth", "", queued);
+    Metrics::describe(out, "hls_workers_busy", "gauge", "Worker threads handling a request.");
+    Metrics::sample(out, "hls_workers_busy", "", busy);
+    Metrics::describe(out, "hls_workers_alive", "gauge", "Worker threads started.");
+    Metrics::sample(out, "hls_workers_alive", "", alive);
+
+    // 每个分片的连接数，用来观察内核分配连接是否均匀
+    Metrics::describe(out, "hls_shard_connections", "gauge", "Open client connections per listener shard.");
+    for (int i = 0; i < shards->size(); i++)
+    {
+        Shard& s = (*shards)[i];
+        std::string labels = "shard=\"" + std::to_string(i) + "\",cpu=\"" + (s.cpu >= 0 ? std::to_string(s.cpu) : "any") + "\"";
+        Metrics::sample(out, "hls_shard_connections", labels, s.loop->connections());
     }
 
-    else {
-        // 发送 200 的头
-        memset(buf,0,BUFSIZE);
-        httpHeader::makeheader(httpHeader::params_200, buf, BUFSIZE);
-        send(client_sock, buf, strlen(buf), 0);
+    Metrics::describe(out, "hls_log_records_total", "counter", "Access log records written, or dropped because a ring buffer was full.");
+    Metrics::sample(out, "hls_log_records_total", "result=\"written\"", AccessLog::written());
+    Metrics::sample(out, "hls_log_records_total", "result=\"dropped\"", AccessLog::dropped());
+
+    Metrics::describe(out, "hls_disk_batches_total", "counter", "Batches processed by the disk writer thread.");
+    Metrics::sample(out, "hls_disk_batches_total", "", writer->batches());
+    Metrics::describe(out, "hls_disk_writes_total", "counter", "pwritev calls issued by the disk writer thread.");
+    Metrics::sample(out, "hls_disk_writes_total", "", writer->writes());
+    Metrics::describe(out, "hls_disk_written_bytes_total", "counter", "Bytes written to disk by the disk writer thread.");
+    Metrics::sample(out, "hls_disk_written_bytes_total", "", writer->bytes());
+    Metrics::describe(out, "hls_disk_syncs_total", "counter", "fdatasync and fsync calls issued by the disk writer thread.");
+    Metrics::sample(out, "hls_disk_syncs_total", "", writer->syncs());
+    Metrics::describe(out, "hls_disk_queued_bytes", "gauge", "Upload bytes queued for the disk writer thread and not yet written.");
+    Metrics::sample(out, "hls_disk_queued_bytes", "", writer->queued());
+
+    if (cache != nullptr) {
+        size_t bytes, hits, misses;
+        cache->stats(bytes, hits, misses);
+        Metrics::describe(out, "hls_cache_bytes", "gauge", "Bytes held by the file cache.");
+        Metrics::sample(out, "hls_cache_bytes", "", bytes);
+        Metrics::describe(out, "hls_cache_lookups_total", "counter", "File cache lookups.");
+        Metrics::sample(out, "hls_cache_lookups_total", "result=\"hit\"", hits);
+        Metrics::sample(out, "hls_cache_lookups_total", "result=\"miss\"", misses);
     }
 
-    // 读取文件并发送
-    size_t bytesRead;
-    while ((bytesRead = fread(buf, 1, BUFSIZE, file)) > 0) {
-        send(client_sock, buf, bytesRead, 0);
+    auto streams = playlists->streams();
+    std::sort(streams.begin(), streams.end(),
+              [](const auto& a, const auto& b) { return a.first < b.first; });
+    Metrics::describe(out, "hls_ingest_segments_total", "counter", "Segments published per stream.");
+    std::vector<std::pair<std::string, uint64_t>> bytes;
+    for (auto& it : streams) {
+        uint64_t segments, size;
+        it.second->ingested(segments, size);
+        std::string label = "stream=\"" + Metrics::escape(it.first) + "\"";
+        Metrics::sample(out, "hls_ingest_segments_total", label, segments);
+        bytes.emplace_back(label, size);
     }
-    fclose(file);
+    Metrics::describe(out, "hls_ingest_bytes_total", "counter", "Segment bytes stored per stream.");
+    for (auto& it : bytes)
+        Metrics::sample(out, "hls_ingest_bytes_total", it.first, it.second);
 
-    return 0;
+    send_body(conn, body, "text/plain; version=0.0.4; charset=utf-8");
 }
 
-void handle(void* arg)
+/* 在线程池中处理一个完整的请求，生成的响应由事件循环发送 */
+void handle(Connection* conn)
 {
-    int client_sock = *(int*)arg;
-    // 解析http头信息
-    httpHeader http(client_sock);
+    // 请求已经由事件循环解析完成
+    httpHeader& http = conn->http;
+
+    // 判断这个连接是否还能继续复用
+    conn->requests++;
+    conn->keep_alive = http.keep_alive() && conn->requests < conn->loop->max_requests();
 
-    std::string url = http.get("path");
+    std::string_view url = http.path();
     // 如果是POST方法，且url是/upload
-    std::cout << "pthread:" << pthread_self();
-    if (url.compare("/upload") == 0 && http.get_method() == METHOD_POST) {
-        printf("handle_save\n");
-        handle_save(client_sock, http);
+    if (url == "/upload" && http.get_method() == METHOD_POST) {
+        if (handle_save(conn) < 0)
+            send_status(conn, 500);
+    }
+
+    // 运行状态
+    else if (url == "/metrics" && http.get_method() == METHOD_GET) {
+        handle_metrics(conn);
     }
 
     // 如果是GET方法
-    if (http.get_method() == METHOD_GET) {
-        std::cout << "handle_file:" <<  url << std::endl;;
-        handle_file(client_sock, http);
+    else if (http.get_method() == METHOD_GET) {
+        handle_file(conn, http);
+    }
+
+    // 不支持的请求
+    else {
+        conn->keep_alive = false;
+        send_status(conn, 400);
     }
-    close(client_sock);
 }
 
 
-int main()
+/* 每秒检查一次超时的阻塞请求 */
+void expire_waiters()
 {
-    // 创建线程池
-    ThreadPool* pool = new ThreadPool(8, 10);
-
-    int server = socket(PF_INET, SOCK_STREAM, 0);
-    if (server == -1)
-    {
-        perror("Socket creation failed");
-        exit(EXIT_FAILURE);
-    }
+    playlists->expire();
+}
 
-    // 设置此选项，强制重新使用处于TIME_WAIT状态的socket地址
-    int option;
-    socklen_t optlen;
-    optlen = sizeof(option);
-    option = 1;
-    setsockopt(server, SOL_SOCKET, SO_REUSEADDR, (void *)&option, optlen);
-
-    struct sockaddr_in myaddr;
-    bzero(&myaddr, sizeof(myaddr));
-    myaddr.sin_family = AF_INET;
-    myaddr.sin_port = htons(PORT);
-    myaddr.sin_addr.s_addr = INADDR_ANY;
-    socklen_t myaddrlen = sizeof(myaddr);
-    if (bind(server, (struct sockaddr *)&myaddr, sizeof(myaddr)) == -1) {
-        perror("Binding failed");
-        close(server);
+int main(int argc, char* argv[])
+{
+    ServerConfig cfg;
+    cfg.parse(argc, argv);
+    // 访问日志由后台线程写出，请求不等待日志I/O
+    if (AccessLog::start(cfg.log_level, cfg.log_sample, cfg.access_log) < 0)
         exit(EXIT_FAILURE);
-    }
 
-    if (listen(server, 5) == -1)
-    {
-        perror("Listening failed");
-        close(server);
+    // 对端关闭后继续写socket不应该结束进程
+    signal(SIGPIPE, SIG_IGN);
+    // 每个连接占用一个fd，尽量提高上限
+    EventLoop::raise_fd_limit();
+    // 创建文件缓存
+    if (cfg.cache_bytes > 0)
+        cache = new SegmentCache(cfg.cache_bytes, file_header);
+    // 直播流的播放列表
+    playlists = new PlaylistRegistry(cfg.playlist_window, cfg.part_target);
+    archive_mode = cfg.archive;
+    cmaf_mode = cfg.cmaf;
+    writer = new DiskWriter(cfg.durability, cfg.group_commit_ms);
+
+    // 每个分片一个监听socket，线程池的线程数平均分给各个分片
+    shards = new ShardSet(cfg.shards, cfg.pin_cpu);
+    if (shards->listen(cfg.port, cfg.backlog) < 0)
         exit(EXIT_FAILURE);
-    }
-
-    while (true)
-    {
-        struct sockaddr clientaddr;
-        socklen_t clientaddrlen = sizeof(clientaddr);
-        int client_sock = accept(server, &clientaddr, &clientaddrlen);
-        if (client_sock < 0)
-        {
-            perror("accpet error\n");
-            continue;
-        }
-        else if (client_sock == 0)
-        {
-            close(client_sock);
-            continue;
-        }
-        else if (client_sock > 0)
-        {
-            int* num = (int*)malloc(sizeof(int));
-            *num = client_sock;
-            pool->addTask(handle, num);
+    int n = shards->size();
+    int thread_min = (cfg.thread_min + n - 1) / n;
+    int thread_max = std::max(thread_min, (cfg.thread_max + n - 1) / n);
+
+    // 由事件循环接收连接、读写数据，线程池只负责处理请求
+    bool uring_failed = false;
+    for (int i = 0; i < n; i++) {
+        Shard& s = (*shards)[i];
+        s.pool = new ThreadPool(thread_min, thread_max, s.cpu);
+        if (cfg.io_uring && !uring_failed) {
+#ifdef HLS_IO_URING
+            UringLoop* uring = new UringLoop(s.listen_fd, s.pool, handle, cfg.idle_timeout, cfg.max_requests);
+            if (uring->ok())
+                s.loop = uring;
+            else
+                delete uring;
+#endif
+            if (s.loop == nullptr) {
+                AccessLog::message(LOG_WARN, "io_uring不可用，使用epoll");
+                uring_failed = true;
+            }
         }
+        if (s.loop == nullptr)
+            s.loop = new EventLoop(s.listen_fd, s.pool, handle, cfg.idle_timeout, cfg.max_requests);
+        s.loop->set_sendfile(cfg.sendfile);
+        s.loop->set_queue_capacity(cfg.queue_capacity);
+        s.loop->set_body_limit(cfg.max_body);
+        s.loop->set_body_handler(stream_body);
+        s.loop->set_response_handler(response_done);
     }
-}
\ No newline at end of file
+    // 播放列表是所有分片共用的，只由第0个分片检查超时
+    (*shards)[0].loop->set_timer_handler(expire_waiters);
+    if (n > 1)
+        AccessLog::message(LOG_INFO, "%d个分片，每个分片%d:%d个工作线程%s", n, thread_min, thread_max,
+                           cfg.pin_cpu ? "，绑定CPU" : "");
+    shards->run();
+
+    delete shards;
+    AccessLog::stop();
+    delete writer;
+    delete playlists;
+    delete cache;
+    return 0;
+}
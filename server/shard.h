@@ -0,0 +1,202 @@
+#ifndef _SHARD_H
+#define _SHARD_H
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+#include "threadPool.h"
+#include "eventLoop.h"
+#include "accessLog.h"
+
+#define SHARD_MAX 256 // 最多的分片数
+
+// 一个分片：自己的监听socket、事件循环和线程池。
+// 多个分片时每个分片的监听socket都设置SO_REUSEPORT，由内核把新连接分给各个分片，
+// 连接从接收到处理完都在同一个分片中，事件循环和工作线程绑定在同一个CPU上
+struct Shard
+{
+    int index;
+    // 绑定的CPU，-1表示不绑定
+    int cpu;
+    int listen_fd;
+    ThreadPool *pool;
+    EventLoop *loop;
+    pthread_t tid;
+
+    Shard(int index, int cpu) : index(index), cpu(cpu), listen_fd(-1), pool(nullptr), loop(nullptr), tid(0) {}
+};
+
+// 所有分片，由主线程创建，第0个分片的事件循环在主线程中运行
+class ShardSet
+{
+public:
+    // count为0时每个可用的CPU一个分片；pin为false或者只有一个分片时不绑定CPU
+    ShardSet(int count, bool pin);
+    ~ShardSet();
+
+    int size() const { return (int)m_shards.size(); }
+    Shard &operator[](int i) { return m_shards[i]; }
+
+    // 为每个分片打开监听socket，失败返回-1
+    int listen(int port, int backlog);
+    // 运行所有分片的事件循环，事件循环都退出后返回
+    void run();
+
+    // 当前进程可以使用的CPU
+    static std::vector<int> allowed_cpus();
+    // 把线程绑定到一个CPU上，失败返回-1
+    static int pin(pthread_t tid, int cpu);
+
+private:
+    static int open_listener(int port, int backlog, bool reuseport);
+    static void *shard_main(void *arg);
+
+    std::vector<Shard> m_shards;
+};
+
+ShardSet::ShardSet(int count, bool pin)
+{
+    std::vector<int> cpus = allowed_cpus();
+    if (count <= 0)
+        count = cpus.empty() ? 1 : (int)cpus.size();
+    if (count > SHARD_MAX)
+        count = SHARD_MAX;
+    for (int i = 0; i < count; i++)
+    {
+        int cpu = pin && count > 1 && !cpus.empty() ? cpus[i % cpus.size()] : -1;
+        m_shards.emplace_back(i, cpu);
+    }
+}
+
+ShardSet::~ShardSet()
+{
+    for (Shard &s : m_shards)
+    {
+        delete s.loop;
+        // 事件循环退出后线程池中可能还有任务，最后才销毁线程池
+        delete s.pool;
+        if (s.listen_fd >= 0)
+            close(s.listen_fd);
+    }
+}
+
+std::vector<int> ShardSet::allowed_cpus()
+{
+    std::vector<int> cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+    {
+        for (int i = 0; i < CPU_SETSIZE; i++)
+        {
+            if (CPU_ISSET(i, &set))
+                cpus.push_back(i);
+        }
+    }
+    return cpus;
+}
+
+int ShardSet::pin(pthread_t tid, int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int err = pthread_setaffinity_np(tid, sizeof(set), &set);
+    if (err != 0)
+    {
+        AccessLog::message(LOG_WARN, "无法绑定CPU %d: %s", cpu, strerror(err));
+        return -1;
+    }
+    return 0;
+}
+
+int ShardSet::open_listener(int port, int backlog, bool reuseport)
+{
+    int fd = socket(PF_INET, SOCK_STREAM, 0);
+    if (fd == -1)
+    {
+        perror("Socket creation failed");
+        return -1;
+    }
+
+    // 设置此选项，强制重新使用处于TIME_WAIT状态的socket地址
+    int option = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (void *)&option, sizeof(option));
+    // 多个分片的socket绑定同一个端口，各自有独立的监听队列。只有一个分片时不设置，
+    // 避免和另一个已经在运行的服务端共用端口
+    if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (void *)&option, sizeof(option)) == -1)
+    {
+        perror("SO_REUSEPORT failed");
+        close(fd);
+        return -1;
+    }
+
+    struct sockaddr_in myaddr;
+    bzero(&myaddr, sizeof(myaddr));
+    myaddr.sin_family = AF_INET;
+    myaddr.sin_port = htons(port);
+    myaddr.sin_addr.s_addr = INADDR_ANY;
+    if (bind(fd, (struct sockaddr *)&myaddr, sizeof(myaddr)) == -1)
+    {
+        perror("Binding failed");
+        close(fd);
+        return -1;
+    }
+
+    if (::listen(fd, backlog) == -1)
+    {
+        perror("Listening failed");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int ShardSet::listen(int port, int backlog)
+{
+    bool reuseport = m_shards.size() > 1;
+    for (Shard &s : m_shards)
+    {
+        s.listen_fd = open_listener(port, backlog, reuseport);
+        if (s.listen_fd < 0)
+            return -1;
+    }
+    return 0;
+}
+
+void *ShardSet::shard_main(void *arg)
+{
+    Shard *s = static_cast<Shard *>(arg);
+    s->loop->run();
+    return nullptr;
+}
+
+void ShardSet::run()
+{
+    // 第0个分片在当前线程中运行，其他分片各一个线程
+    for (size_t i = 1; i < m_shards.size(); i++)
+    {
+        Shard &s = m_shards[i];
+        if (pthread_create(&s.tid, NULL, shard_main, &s) != 0)
+        {
+            perror("pthread_create failed");
+            exit(EXIT_FAILURE);
+        }
+        if (s.cpu >= 0)
+            pin(s.tid, s.cpu);
+    }
+    Shard &first = m_shards[0];
+    first.tid = pthread_self();
+    if (first.cpu >= 0)
+        pin(first.tid, first.cpu);
+    shard_main(&first);
+    for (size_t i = 1; i < m_shards.size(); i++)
+        pthread_join(m_shards[i].tid, NULL);
+}
+
+#endif
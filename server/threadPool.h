@@ -2,10 +2,15 @@
 #define _THREADPOOL_H
 
 #include <pthread.h>
+#include <sched.h>
 #include <malloc.h>
 #include <string.h>
 #include <unistd.h>
-#include <queue>
+#include <atomic>
+#include <deque>
+
+#define DEQUE_SIZE 1024  // 每个工作线程本地队列的容量，必须是2的幂
+#define INJECT_BATCH 16  // 工作线程一次从共享队列取出的最多任务数
 
 
 // 定义任务结构体
@@ -19,7 +24,7 @@ struct Task
 };
 
 
-// 任务队列
+// 共享任务队列，线程池外部（事件循环、accept）提交的任务先放到这里
 class TaskQueue
 {
 public:
@@ -36,52 +41,159 @@ public:
     inline void addTask(Task &task)
     {
         pthread_mutex_lock(&m_mutex);
-        m_queue.push(task);
+        m_queue.push_back(task);
+        m_size.store(m_queue.size(), std::memory_order_relaxed);
         pthread_mutex_unlock(&m_mutex);
     }
 
     // 添加任务
     inline void addTask(callback func, void *arg)
     {
-        pthread_mutex_lock(&m_mutex);
         Task task(func, arg);
-        m_queue.push(task);
-        pthread_mutex_unlock(&m_mutex);
+        addTask(task);
     };
 
     // 取出一个任务
     inline Task takeTask()
     {
         Task t;
+        takeTasks(&t, 1);
+        return t;
+    };
+
+    // 一次取出最多max个任务，返回取出的个数
+    inline int takeTasks(Task *out, int max)
+    {
+        // 队列为空时不加锁
+        if (empty())
+            return 0;
+        int n = 0;
         pthread_mutex_lock(&m_mutex);
-        if (!m_queue.empty())
+        while (n < max && !m_queue.empty())
         {
-            t = m_queue.front();
-            m_queue.pop();
+            out[n++] = m_queue.front();
+            m_queue.pop_front();
         }
+        m_size.store(m_queue.size(), std::memory_order_relaxed);
         pthread_mutex_unlock(&m_mutex);
-        return t;
-    };
+        return n;
+    }
 
     // 获取当前队列中任务个数
     inline int taskNumber()
     {
-        return m_queue.size();
+        return m_size.load(std::memory_order_relaxed);
     }
 
     inline bool empty() {
-        return m_queue.empty();
+        return m_size.load(std::memory_order_seq_cst) == 0;
     }
 
 private:
     pthread_mutex_t m_mutex;  // 互斥锁
-    std::queue<Task> m_queue; // 任务队列
+    std::deque<Task> m_queue; // 任务队列
+    // 任务个数，不加锁也可以读取
+    std::atomic<size_t> m_size{0};
+};
+
+
+// 工作线程本地的无锁双端队列（Chase-Lev）
+// 只有所属的线程从底部放入和取出，其他线程从顶部窃取
+class WorkDeque
+{
+public:
+    WorkDeque() : m_top(0), m_bottom(0) {}
+
+    // 所属线程放入一个任务，队列满时返回false
+    bool push(const Task &task);
+    // 所属线程取出最后放入的任务
+    bool pop(Task &task);
+    // 其他线程窃取最早放入的任务，失败（队列为空或者竞争失败）返回false
+    bool steal(Task &task);
+    // 队列中的任务个数，只是一个近似值
+    int size() const;
+
+private:
+    // 窃取的线程可能和所属线程同时访问同一个槽，两个字段都用原子变量
+    struct Slot
+    {
+        std::atomic<callback> function;
+        std::atomic<void *> arg;
+    };
+
+    alignas(64) std::atomic<int64_t> m_top;
+    alignas(64) std::atomic<int64_t> m_bottom;
+    alignas(64) Slot m_slots[DEQUE_SIZE];
 };
 
+bool WorkDeque::push(const Task &task)
+{
+    int64_t b = m_bottom.load(std::memory_order_relaxed);
+    int64_t t = m_top.load(std::memory_order_acquire);
+    if (b - t >= DEQUE_SIZE)
+        return false;
+    Slot &s = m_slots[b & (DEQUE_SIZE - 1)];
+    s.function.store(task.function, std::memory_order_relaxed);
+    s.arg.store(task.arg, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    m_bottom.store(b + 1, std::memory_order_relaxed);
+    return true;
+}
+
+bool WorkDeque::pop(Task &task)
+{
+    int64_t b = m_bottom.load(std::memory_order_relaxed) - 1;
+    m_bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = m_top.load(std::memory_order_relaxed);
+    if (t > b)
+    {
+        // 队列为空
+        m_bottom.store(b + 1, std::memory_order_relaxed);
+        return false;
+    }
+    Slot &s = m_slots[b & (DEQUE_SIZE - 1)];
+    task.function = s.function.load(std::memory_order_relaxed);
+    task.arg = s.arg.load(std::memory_order_relaxed);
+    if (t == b)
+    {
+        // 最后一个任务，和窃取的线程竞争
+        bool won = m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+        m_bottom.store(b + 1, std::memory_order_relaxed);
+        return won;
+    }
+    return true;
+}
+
+bool WorkDeque::steal(Task &task)
+{
+    int64_t t = m_top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t b = m_bottom.load(std::memory_order_acquire);
+    if (t >= b)
+        return false;
+    Slot &s = m_slots[t & (DEQUE_SIZE - 1)];
+    task.function = s.function.load(std::memory_order_relaxed);
+    task.arg = s.arg.load(std::memory_order_relaxed);
+    return m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+}
+
+int WorkDeque::size() const
+{
+    int64_t n = m_bottom.load(std::memory_order_relaxed) - m_top.load(std::memory_order_relaxed);
+    return n > 0 ? (int)n : 0;
+}
+
+
+// 工作窃取线程池
+// 外部提交的任务进入共享队列；工作线程在执行任务时提交的任务放入自己的本地队列。
+// 工作线程依次从本地队列、共享队列（一次取一批）、其他线程的本地队列获取任务，
+// 都没有任务时才在条件变量上睡眠。只有睡眠和唤醒需要加锁。
 class ThreadPool
 {
 public:
-    ThreadPool(int min, int max);
+    // cpu不小于0时，所有工作线程都绑定在这个CPU上
+    ThreadPool(int min, int max, int cpu = -1);
     ThreadPool() : ThreadPool(5, 20) {}
     ~ThreadPool();
 
@@ -89,39 +201,78 @@ public:
     void addTask(Task task);
     // 添加任务
     void addTask(callback func, void *arg);
+    // 等待执行的任务已经有limit个时不添加，返回false
+    bool tryAddTask(callback func, void *arg, int limit);
+    // 获取等待执行的任务个数
+    int getQueueNumber();
     // 获取忙线程的个数
     int getBusyNumber();
     // 获取活着的线程个数
     int getAliveNumber();
 
 private:
+    // 每个工作线程的状态
+    struct Worker
+    {
+        pthread_t tid;
+        WorkDeque deque;
+    };
+
+    // 放入任务并唤醒线程，m_pending已经由调用者增加
+    void push(Task task);
     // 工作的线程的任务函数
     static void *worker(void *arg);
     // 管理者线程的任务函数
     static void *manager(void *arg);
-    void threadExit();
+    void threadExit(int index);
+    // 获取一个任务，没有任务时返回false
+    bool findTask(int index, Task &task, unsigned &seed);
+    // 所有队列中是否还有任务
+    bool hasTask();
+    // 有睡眠的线程时唤醒一个
+    void wakeOne();
+
+    // 当前线程是哪个线程池的第几个工作线程
+    static thread_local ThreadPool *t_pool;
+    static thread_local int t_index;
 
 private:
     pthread_mutex_t m_lock;
     pthread_cond_t m_notEmpty;
-    pthread_t *m_threadIDs;
+    Worker *m_workers;
     pthread_t m_managerID;
     TaskQueue *m_taskQ;
     int m_minNum;
     int m_maxNum;
-    int m_busyNum;
+    int m_cpu;
+    std::atomic<int> m_busyNum;
+    // 已经添加、还没有开始执行的任务数
+    std::atomic<int> m_pending;
     int m_aliveNum;
     int m_exitNum;
-    bool m_shutdown;
+    // 正在条件变量上睡眠的线程数
+    std::atomic<int> m_idleNum;
+    std::atomic<bool> m_shutdown;
+};
+
+thread_local ThreadPool *ThreadPool::t_pool = nullptr;
+thread_local int ThreadPool::t_index = -1;
+
+// 启动工作线程时传递的参数
+struct WorkerArg
+{
+    ThreadPool *pool;
+    int index;
 };
 
-ThreadPool::ThreadPool(int min, int max) : m_minNum(min), m_maxNum(max), m_busyNum(0), m_aliveNum(min), m_exitNum(0), m_shutdown(false)
+ThreadPool::ThreadPool(int min, int max, int cpu) : m_minNum(min), m_maxNum(max), m_cpu(cpu), m_busyNum(0), m_pending(0), m_aliveNum(min), m_exitNum(0), m_idleNum(0), m_shutdown(false)
 {
     // 实例化任务队列
     m_taskQ = new TaskQueue;
-    // 给线程数组分配内存
-    m_threadIDs = new pthread_t[m_maxNum];
-    memset(m_threadIDs, 0, sizeof(pthread_t) * m_maxNum);
+    // 给工作线程分配内存，每个线程一个本地队列
+    m_workers = new Worker[m_maxNum];
+    for (int i = 0; i < m_maxNum; i++)
+        m_workers[i].tid = 0;
     // 初始化锁和条件变量
     pthread_mutex_init(&m_lock, NULL);
     pthread_cond_init(&m_notEmpty,NULL);
@@ -129,7 +280,7 @@ ThreadPool::ThreadPool(int min, int max) : m_minNum(min), m_maxNum(max), m_busyN
     pthread_create(&m_managerID, NULL, manager, this);
     // 创建工作者线程
     for (int i=0; i<min; i++) {
-        pthread_create(&m_threadIDs[i], NULL, worker, this);
+        pthread_create(&m_workers[i].tid, NULL, worker, new WorkerArg{this, i});
     }
 }
 
@@ -138,13 +289,21 @@ ThreadPool::~ThreadPool() {
     // 销毁管理者线程
     pthread_join(m_managerID, NULL);
     // 唤醒所有的消费者线程
-    for (int i = 0; i < m_aliveNum; ++i) {
-        pthread_cond_signal(&m_notEmpty);
+    pthread_mutex_lock(&m_lock);
+    pthread_cond_broadcast(&m_notEmpty);
+    pthread_mutex_unlock(&m_lock);
+    // 等所有工作线程退出后再释放它们的队列
+    while (true) {
+        pthread_mutex_lock(&m_lock);
+        int alive = m_aliveNum;
+        pthread_mutex_unlock(&m_lock);
+        if (alive == 0) break;
+        usleep(1000);
     }
     // 销毁任务队列
     if (m_taskQ) delete m_taskQ;
-    // 销毁保存消费者ID的数组
-    if (m_threadIDs) delete[]m_threadIDs;
+    // 销毁工作线程数组
+    if (m_workers) delete[]m_workers;
     // 销毁锁
     pthread_mutex_destroy(&m_lock);
     // 销毁条件变量
@@ -154,30 +313,139 @@ ThreadPool::~ThreadPool() {
 void ThreadPool::addTask(Task task)
 {
     if (m_shutdown) return;
-    // 添加任务
-    m_taskQ->addTask(task);
-    // 唤醒一个工作处理线程
-    pthread_cond_signal(&m_notEmpty);
+    m_pending++;
+    push(task);
 }
 
 void ThreadPool::addTask(callback func, void *arg)
 {
-    if (m_shutdown) return;
-    // 添加任务
-    m_taskQ->addTask(func,arg);
+    addTask(Task(func, arg));
+}
+
+bool ThreadPool::tryAddTask(callback func, void *arg, int limit)
+{
+    if (m_shutdown) return false;
+    // 先占一个名额，超出限制再退回，多个线程同时添加也不会超过limit
+    if (m_pending.fetch_add(1) >= limit) {
+        m_pending--;
+        return false;
+    }
+    push(Task(func, arg));
+    return true;
+}
+
+int ThreadPool::getQueueNumber()
+{
+    return m_pending.load(std::memory_order_relaxed);
+}
+
+void ThreadPool::push(Task task)
+{
+    // 工作线程提交的任务放入自己的本地队列，满了再放共享队列
+    if (t_pool != this || !m_workers[t_index].deque.push(task))
+        m_taskQ->addTask(task);
     // 唤醒一个工作处理线程
-    pthread_cond_signal(&m_notEmpty);
+    wakeOne();
+}
+
+int ThreadPool::getBusyNumber()
+{
+    return m_busyNum.load(std::memory_order_relaxed);
+}
+
+int ThreadPool::getAliveNumber()
+{
+    pthread_mutex_lock(&m_lock);
+    int alive = m_aliveNum;
+    pthread_mutex_unlock(&m_lock);
+    return alive;
+}
+
+void ThreadPool::wakeOne()
+{
+    // 放入任务和这里的读取都是顺序一致的，睡眠前的线程会先增加m_idleNum再检查队列，
+    // 两边至少有一边能看到对方，不会丢失唤醒
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_idleNum.load(std::memory_order_seq_cst) > 0) {
+        pthread_mutex_lock(&m_lock);
+        pthread_cond_signal(&m_notEmpty);
+        pthread_mutex_unlock(&m_lock);
+    }
+}
+
+bool ThreadPool::hasTask()
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!m_taskQ->empty()) return true;
+    for (int i = 0; i < m_maxNum; i++) {
+        if (m_workers[i].deque.size() > 0) return true;
+    }
+    return false;
+}
+
+bool ThreadPool::findTask(int index, Task &task, unsigned &seed)
+{
+    WorkDeque &local = m_workers[index].deque;
+    // 本地队列
+    if (local.pop(task)) return true;
+
+    // 共享队列，一次取一批，多出来的放进本地队列，其他空闲线程可以窃取
+    Task batch[INJECT_BATCH];
+    int n = m_taskQ->takeTasks(batch, INJECT_BATCH);
+    if (n > 0) {
+        task = batch[0];
+        for (int i = 1; i < n; i++) {
+            if (!local.push(batch[i])) m_taskQ->addTask(batch[i]);
+        }
+        // 还有任务，叫醒别的线程来窃取
+        if (n > 1) wakeOne();
+        return true;
+    }
+
+    // 从随机的一个线程开始窃取
+    seed = seed * 1103515245 + 12345;
+    int start = (seed >> 16) % m_maxNum;
+    for (int i = 0; i < m_maxNum; i++) {
+        int victim = (start + i) % m_maxNum;
+        if (victim != index && m_workers[victim].deque.steal(task)) return true;
+    }
+    return false;
 }
 
 // 工作线程任务函数
 void* ThreadPool::worker(void* arg) {
-    // 将传入的参数强制转换为ThreadPool*指针类型
-    ThreadPool* pool = static_cast<ThreadPool*>(arg);
+    WorkerArg* warg = static_cast<WorkerArg*>(arg);
+    ThreadPool* pool = warg->pool;
+    int index = warg->index;
+    delete warg;
+    t_pool = pool;
+    t_index = index;
+    unsigned seed = index + 1;
+    if (pool->m_cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(pool->m_cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+
     while (true) {
-        // 访问任务队列先要加锁
+        Task task;
+        if (pool->findTask(index, task, seed)) {
+            pool->m_pending--;
+            // 工作的线程加1
+            pool->m_busyNum++;
+            // 执行任务，参数由任务自己管理
+            task.function(task.arg);
+            // 工作的线程减1
+            pool->m_busyNum--;
+            continue;
+        }
+
+        // 没有任务，准备睡眠
         pthread_mutex_lock(&pool->m_lock);
+        pool->m_idleNum++;
         // 任务为空则线程阻塞
-        while (pool->m_taskQ->empty() && !pool->m_shutdown) {
+        while (!pool->hasTask() && !pool->m_shutdown) {
             // 阻塞线程在信号量m_notEmpty上
             pthread_cond_wait(&pool->m_notEmpty, &pool->m_lock);
             // 解除阻塞之后判断是否要销毁线程
@@ -185,35 +453,20 @@ void* ThreadPool::worker(void* arg) {
                 pool->m_exitNum--;
                 if (pool->m_aliveNum > pool->m_minNum) {
                     pool->m_aliveNum--;
+                    pool->m_idleNum--;
                     pthread_mutex_unlock(&pool->m_lock);
-                    pool->threadExit();
+                    pool->threadExit(index);
                 }
             }
         }
+        pool->m_idleNum--;
         // 如果线程池要结束了
         if (pool->m_shutdown) {
             // 解锁
             pthread_mutex_unlock(&pool->m_lock);
             // 销毁线程
-            pool->threadExit();
+            pool->threadExit(index);
         }
-
-        // 从任务队列中取出一个任务
-        Task task = pool->m_taskQ->takeTask();
-        // 工作的线程加1
-        pool->m_busyNum++;
-        // 解锁，下面要开始执行了
-        pthread_mutex_unlock(&pool->m_lock);
-        
-        // 执行任务
-        task.function(task.arg);
-        // 销毁参数指针
-        free(task.arg);
-        task.arg = nullptr;
-        
-        // 工作的线程减1
-        pthread_mutex_lock(&pool->m_lock);
-        pool->m_busyNum--;
         pthread_mutex_unlock(&pool->m_lock);
     }
     return nullptr;
@@ -227,10 +480,13 @@ void* ThreadPool::manager(void* arg)
     // 如果线程池没有关闭就一直检测
     while (!pool->m_shutdown) {
         // 每5s监控一次线程池状态
-        sleep(5);
+        for (int i = 0; i < 50 && !pool->m_shutdown; i++)
+            usleep(100000);
         // 取出任务数量和线程数量
-        pthread_mutex_lock(&pool->m_lock);
         int queuesize = pool->m_taskQ->taskNumber();
+        for (int i = 0; i < pool->m_maxNum; i++)
+            queuesize += pool->m_workers[i].deque.size();
+        pthread_mutex_lock(&pool->m_lock);
         int liveNum = pool->m_aliveNum;
         int busyNum = pool->m_busyNum;
         pthread_mutex_unlock(&pool->m_lock);
@@ -244,9 +500,9 @@ void* ThreadPool::manager(void* arg)
             int num = 0;
             for (int i = 0; i < pool->m_maxNum && num < NUMBER && pool->m_aliveNum < pool->m_maxNum; ++i)
             {
-                if (pool->m_threadIDs[i] == 0)
+                if (pool->m_workers[i].tid == 0)
                 {
-                    pthread_create(&pool->m_threadIDs[i], NULL, worker, pool);
+                    pthread_create(&pool->m_workers[i].tid, NULL, worker, new WorkerArg{pool, i});
                     num++;
                     pool->m_aliveNum++;
                 }
@@ -259,30 +515,27 @@ void* ThreadPool::manager(void* arg)
             // 线程池加锁
             pthread_mutex_lock(&pool->m_lock);
             pool->m_exitNum = NUMBER;
-            // 线程池解锁
-            pthread_mutex_unlock(&pool->m_lock);
-            
             // 唤醒线程，自动删除自己
             for (int i = 0; i < NUMBER; ++i) {
                 pthread_cond_signal(&pool->m_notEmpty);
             }
+            // 线程池解锁
+            pthread_mutex_unlock(&pool->m_lock);
         }
     }
     return nullptr;
 }
 
-void ThreadPool::threadExit()
+void ThreadPool::threadExit(int index)
 {
-    pthread_t tid = pthread_self();
-    for (int i = 0; i < m_maxNum; ++i)
-    {
-        if (m_threadIDs[i] == tid) {
-            m_threadIDs[i] = 0;
-            break;
-        }
-    }
+    // 本地队列已经取空才会退出，这个槽位可以留给新线程
+    pthread_mutex_lock(&m_lock);
+    if (m_shutdown) m_aliveNum--;
+    m_workers[index].tid = 0;
+    pthread_detach(pthread_self());
+    pthread_mutex_unlock(&m_lock);
     pthread_exit(NULL);
 }
 
 
-#endif
\ No newline at end of file
+#endif
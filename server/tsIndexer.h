@@ -0,0 +1,368 @@
+#ifndef _TSINDEXER_H
+#define _TSINDEXER_H
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#define TS_PACKET_SIZE 188
+#define TS_SYNC_BYTE 0x47
+#define TS_CLOCK 90000 // PTS/DTS/PCR基准时钟频率
+
+// 一个视频帧（音频流时为一个PES）的位置
+struct TsFrame
+{
+    // 帧所在的第一个TS包在切片中的偏移
+    uint64_t offset;
+    // 展开后的时间戳，单位是1/90000秒
+    int64_t pts;
+    int64_t dts;
+    // 是否是关键帧，可以从这里开始解码
+    bool key;
+};
+
+// 一个切片的索引
+struct TsIndex
+{
+    int pmt_pid;
+    int video_pid;
+    int audio_pid;
+    int video_type;
+    int audio_type;
+    // 用来计时的流（有视频时为视频）中每一帧的位置
+    std::vector<TsFrame> frames;
+    // 计时流的最小、最大PTS，以及相邻两帧的间隔
+    int64_t min_pts;
+    int64_t max_pts;
+    int64_t frame_duration;
+    // 第一个和最后一个PCR
+    int64_t first_pcr;
+    int64_t last_pcr;
+    uint64_t bytes;
+    uint64_t packets;
+    // 丢失同步后重新查找同步字节的次数
+    uint64_t resyncs;
+
+    TsIndex() { clear(); }
+    void clear();
+    // 是否找到了时间戳
+    bool valid() const { return min_pts >= 0; }
+    // 切片时长（秒）
+    double duration() const;
+    // 关键帧的个数
+    size_t keyframes() const;
+};
+
+// MPEG-TS切片扫描器，在上传时对切片数据扫描一遍，生成索引
+// 数据可以分多次输入，边接收边扫描
+class TsIndexer
+{
+public:
+    TsIndexer() { reset(); }
+
+    // 输入一段数据
+    void feed(const uint8_t *data, size_t len);
+    // 扫描到目前为止的索引
+    const TsIndex &index() const { return m_index; }
+    // 准备扫描下一个切片
+    void reset();
+    // 读取PES头中33位的PTS/DTS
+    static int64_t read_timestamp(const uint8_t *p);
+
+private:
+    void packet(const uint8_t *p, uint64_t offset);
+    void parse_pat(const uint8_t *p, size_t len);
+    void parse_pmt(const uint8_t *p, size_t len);
+    void parse_pes(const uint8_t *p, size_t len, uint64_t offset, bool rai);
+    // 展开33位的时间戳
+    int64_t unwrap(int64_t ts);
+    // 在PES负载中查找H.264/HEVC的关键帧NAL
+    bool has_keyframe_nal(const uint8_t *p, size_t len);
+
+private:
+    TsIndex m_index;
+    // 上一次输入剩下的不完整的TS包
+    uint8_t m_partial[TS_PACKET_SIZE];
+    size_t m_partialLen;
+    // 下一个输入字节在切片中的偏移
+    uint64_t m_offset;
+    // 计时流上一帧的DTS
+    int64_t m_lastDts;
+    // 第一个时间戳，用来展开回绕的时间戳
+    int64_t m_base;
+};
+
+void TsIndex::clear()
+{
+    pmt_pid = video_pid = audio_pid = -1;
+    video_type = audio_type = 0;
+    frames.clear();
+    min_pts = max_pts = -1;
+    frame_duration = 0;
+    first_pcr = last_pcr = -1;
+    bytes = packets = resyncs = 0;
+}
+
+double TsIndex::duration() const
+{
+    if (!valid())
+        return 0;
+    // 最后一帧也要持续一帧的时间
+    return (double)(max_pts - min_pts + frame_duration) / TS_CLOCK;
+}
+
+size_t TsIndex::keyframes() const
+{
+    size_t n = 0;
+    for (const TsFrame &f : frames)
+        n += f.key;
+    return n;
+}
+
+void TsIndexer::reset()
+{
+    m_index.clear();
+    m_partialLen = 0;
+    m_offset = 0;
+    m_lastDts = -1;
+    m_base = -1;
+}
+
+void TsIndexer::feed(const uint8_t *data, size_t len)
+{
+    const uint8_t *end = data + len;
+    m_index.bytes += len;
+
+    // 先补齐上一次剩下的半个包
+    if (m_partialLen > 0)
+    {
+        size_t need = TS_PACKET_SIZE - m_partialLen;
+        if (len < need)
+        {
+            memcpy(m_partial + m_partialLen, data, len);
+            m_partialLen += len;
+            m_offset += len;
+            return;
+        }
+        memcpy(m_partial + m_partialLen, data, need);
+        data += need;
+        m_offset += need;
+        if (m_partial[0] == TS_SYNC_BYTE)
+            packet(m_partial, m_offset - TS_PACKET_SIZE);
+        m_partialLen = 0;
+    }
+
+    while (data < end)
+    {
+        if (*data != TS_SYNC_BYTE)
+        {
+            // 丢失同步，查找下一个同步字节，要求后面一个包的位置也是同步字节
+            m_index.resyncs++;
+            const uint8_t *p = data + 1;
+            while (p < end)
+            {
+                p = static_cast<const uint8_t *>(memchr(p, TS_SYNC_BYTE, end - p));
+                if (p == nullptr)
+                {
+                    p = end;
+                    break;
+                }
+                if (p + TS_PACKET_SIZE >= end || p[TS_PACKET_SIZE] == TS_SYNC_BYTE)
+                    break;
+                p++;
+            }
+            m_offset += p - data;
+            data = p;
+            continue;
+        }
+        if (end - data < TS_PACKET_SIZE)
+        {
+            m_partialLen = end - data;
+            memcpy(m_partial, data, m_partialLen);
+            m_offset += m_partialLen;
+            return;
+        }
+        packet(data, m_offset);
+        data += TS_PACKET_SIZE;
+        m_offset += TS_PACKET_SIZE;
+    }
+}
+
+void TsIndexer::packet(const uint8_t *p, uint64_t offset)
+{
+    m_index.packets++;
+    bool pusi = p[1] & 0x40;
+    int pid = ((p[1] & 0x1f) << 8) | p[2];
+    int afc = (p[3] >> 4) & 0x3;
+    size_t pos = 4;
+    bool rai = false;
+
+    // 自适应字段：随机访问标志和PCR
+    if (afc & 0x2)
+    {
+        size_t af_len = p[4];
+        if (af_len > 0 && 5 + af_len <= TS_PACKET_SIZE)
+        {
+            uint8_t flags = p[5];
+            rai = flags & 0x40;
+            if ((flags & 0x10) && af_len >= 7)
+            {
+                int64_t pcr = ((int64_t)p[6] << 25) | (p[7] << 17) | (p[8] << 9) | (p[9] << 1) | (p[10] >> 7);
+                if (m_index.first_pcr < 0)
+                    m_index.first_pcr = pcr;
+                m_index.last_pcr = pcr;
+            }
+        }
+        pos = 5 + af_len;
+    }
+    if (!(afc & 0x1) || pos >= TS_PACKET_SIZE || !pusi)
+        return;
+
+    const uint8_t *payload = p + pos;
+    size_t len = TS_PACKET_SIZE - pos;
+    if (pid == 0)
+    {
+        parse_pat(payload, len);
+    }
+    else if (pid == m_index.pmt_pid)
+    {
+        parse_pmt(payload, len);
+    }
+    else if (pid == m_index.video_pid || (m_index.video_pid < 0 && pid == m_index.audio_pid))
+    {
+        // 有视频时按视频计时，否则按音频计时
+        parse_pes(payload, len, offset, rai);
+    }
+}
+
+void TsIndexer::parse_pat(const uint8_t *p, size_t len)
+{
+    // 跳过pointer_field
+    size_t pos = 1 + p[0];
+    if (pos + 8 > len || p[pos] != 0x00)
+        return;
+    size_t section_len = ((p[pos + 1] & 0x0f) << 8) | p[pos + 2];
+    size_t end = pos + 3 + section_len - 4; // 去掉CRC
+    if (end > len)
+        end = len;
+    for (size_t i = pos + 8; i + 4 <= end; i += 4)
+    {
+        int program = (p[i] << 8) | p[i + 1];
+        if (program != 0)
+        {
+            m_index.pmt_pid = ((p[i + 2] & 0x1f) << 8) | p[i + 3];
+            return;
+        }
+    }
+}
+
+void TsIndexer::parse_pmt(const uint8_t *p, size_t len)
+{
+    size_t pos = 1 + p[0];
+    if (pos + 12 > len || p[pos] != 0x02)
+        return;
+    size_t section_len = ((p[pos + 1] & 0x0f) << 8) | p[pos + 2];
+    size_t end = pos + 3 + section_len - 4;
+    if (end > len)
+        end = len;
+    size_t info_len = ((p[pos + 10] & 0x0f) << 8) | p[pos + 11];
+    for (size_t i = pos + 12 + info_len; i + 5 <= end;)
+    {
+        int type = p[i];
+        int pid = ((p[i + 1] & 0x1f) << 8) | p[i + 2];
+        size_t es_len = ((p[i + 3] & 0x0f) << 8) | p[i + 4];
+        // H.264 / HEVC / MPEG-2 视频
+        if ((type == 0x1b || type == 0x24 || type == 0x02) && m_index.video_pid < 0)
+        {
+            m_index.video_pid = pid;
+            m_index.video_type = type;
+        }
+        // AAC / MP3 / AC-3 音频
+        else if ((type == 0x0f || type == 0x03 || type == 0x04 || type == 0x81) && m_index.audio_pid < 0)
+        {
+            m_index.audio_pid = pid;
+            m_index.audio_type = type;
+        }
+        i += 5 + es_len;
+    }
+}
+
+int64_t TsIndexer::read_timestamp(const uint8_t *p)
+{
+    return ((int64_t)(p[0] & 0x0e) << 29) | (p[1] << 22) | ((p[2] & 0xfe) << 14) | (p[3] << 7) | (p[4] >> 1);
+}
+
+int64_t TsIndexer::unwrap(int64_t ts)
+{
+    const int64_t wrap = 1ll << 33;
+    if (m_base < 0)
+        m_base = ts;
+    // 时间戳回绕后仍然保持单调
+    while (ts < m_base - wrap / 2)
+        ts += wrap;
+    return ts;
+}
+
+void TsIndexer::parse_pes(const uint8_t *p, size_t len, uint64_t offset, bool rai)
+{
+    if (len < 14 || p[0] != 0 || p[1] != 0 || p[2] != 1)
+        return;
+    int flags = p[7] >> 6;
+    size_t header_len = 9 + p[8];
+    if (!(flags & 0x2) || header_len < 14)
+        return;
+    // PTS在p[9..13]，DTS在p[14..18]，都要在PES头和已收到的数据之内
+    if ((flags & 0x1) && (len < 19 || header_len < 19))
+        return;
+
+    TsFrame frame;
+    frame.offset = offset;
+    frame.pts = unwrap(read_timestamp(p + 9));
+    frame.dts = (flags & 0x1) ? unwrap(read_timestamp(p + 14)) : frame.pts;
+    if (m_index.video_pid >= 0)
+        frame.key = rai || (header_len < len && has_keyframe_nal(p + header_len, len - header_len));
+    else
+        frame.key = true; // 音频的每一帧都可以独立解码
+
+    if (m_index.min_pts < 0 || frame.pts < m_index.min_pts)
+        m_index.min_pts = frame.pts;
+    if (frame.pts > m_index.max_pts)
+        m_index.max_pts = frame.pts;
+    // DTS是单调的，相邻DTS的最小间隔就是帧间隔
+    if (m_lastDts >= 0 && frame.dts > m_lastDts)
+    {
+        int64_t delta = frame.dts - m_lastDts;
+        if (m_index.frame_duration == 0 || delta < m_index.frame_duration)
+            m_index.frame_duration = delta;
+    }
+    m_lastDts = frame.dts;
+    m_index.frames.push_back(frame);
+}
+
+bool TsIndexer::has_keyframe_nal(const uint8_t *p, size_t len)
+{
+    for (size_t i = 0; i + 3 < len; i++)
+    {
+        if (p[i] != 0 || p[i + 1] != 0 || p[i + 2] != 1)
+            continue;
+        uint8_t nal = p[i + 3];
+        if (m_index.video_type == 0x1b)
+        {
+            // IDR或者SPS
+            int type = nal & 0x1f;
+            if (type == 5 || type == 7)
+                return true;
+        }
+        else if (m_index.video_type == 0x24)
+        {
+            // IRAP或者VPS/SPS
+            int type = (nal >> 1) & 0x3f;
+            if ((type >= 16 && type <= 21) || type == 32 || type == 33)
+                return true;
+        }
+        i += 2;
+    }
+    return false;
+}
+
+#endif
@@ -0,0 +1,369 @@
+#ifndef _UPLOAD_H
+#define _UPLOAD_H
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <atomic>
+#include <string>
+#include <unordered_map>
+#include "eventLoop.h"
+#include "tsIndexer.h"
+#include "playlist.h"
+#include "diskWriter.h"
+#include "cmafRepackager.h"
+#include "accessLog.h"
+
+#define ARCHIVE_NAME "archive.ts" // 整段录像模式下每路流的录像文件名
+
+// 上传的切片边接收边写入磁盘
+// 数据先写到同一目录下的临时文件，接收完整后rename成最终的文件名，
+// 拉流的客户端不会读到写了一半的切片。写入的同时扫描切片生成索引。
+// 写磁盘交给DiskWriter的写线程，事件循环只复制一份数据，不等待磁盘。
+//
+// CMAF模式下切片先留在内存中，接收完整后重新封装成fMP4，保存为同名的.m4s，
+// 初始化段按内容命名（init-<哈希>.mp4），参数不变的切片共用同一个初始化段。
+// 低延迟直播时按照索引出来的帧把切片切成部分切片，每凑够一个就发布到播放列表。
+//
+// 整段录像模式下切片不单独成文件，而是追加到这路流的录像文件中，播放列表用EXT-X-BYTERANGE
+// 引用其中的一段。同一路流同时有多个上传时，各自按Content-Length预留一段位置，互不覆盖。
+class UploadSink : public BodySink
+{
+public:
+    UploadSink(DiskWriter *writer, const std::string &dir, const std::string &filename, bool archive = false,
+               bool cmaf = false);
+    ~UploadSink();
+
+    // 创建临时文件（整段录像模式下打开录像文件并预留length字节），失败返回-1
+    int open(uint64_t length);
+    bool write(const char *data, size_t len) override;
+    // 写线程的队列满了时暂停接收
+    bool ready() override { return !m_writer->full(); }
+    // 把切片发布到直播流的播放列表，接收过程中生成部分切片
+    void publish(std::shared_ptr<LivePlaylist> live);
+    // 所有数据接收后调用（CMAF模式下在这里转换格式），写线程写完后重命名为最终的文件并调用published，
+    // 再按持久化策略落盘后调用durable，两个回调的status为0表示成功。已经写入失败时返回-1
+    // duration是整个切片的时长，用来计算最后一个部分切片的时长
+    int commit(double duration, write_callback published, write_callback durable, void *ctx);
+
+    const std::string &path() const { return m_path; }
+    // 播放列表中的地址，CMAF模式下是.m4s文件，以及初始化段的地址（TS切片为空）
+    std::string uri() const { return m_path.substr(m_path.rfind('/') + 1); }
+    const std::string &map() const { return m_map; }
+    // 转换成fMP4后得到的视频分辨率，例如1280x720，没有时为空
+    const std::string &resolution() const { return m_resolution; }
+    // 保存到磁盘的字节数，CMAF模式下是媒体段的大小
+    uint64_t stored() const { return m_cmaf ? m_stored : m_bytes; }
+    bool archive() const { return m_archive; }
+    // 切片在录像文件中的位置
+    uint64_t offset() const { return m_offset; }
+    const TsIndexer &indexer() const { return m_indexer; }
+    uint64_t bytes() const { return m_bytes; }
+    bool failed() const { return !m_file || m_file->failed; }
+
+private:
+    // 转换成fMP4并交给写线程，格式不支持时返回-1
+    int write_cmaf();
+
+    // 录像文件的结尾位置（包括已经预留的部分），按路径索引
+    static pthread_mutex_t archive_lock;
+    static std::unordered_map<std::string, uint64_t> archive_end;
+
+    DiskWriter *m_writer;
+    std::string m_dir;
+    std::string m_name;
+    std::string m_path;
+    std::string m_tmpPath;
+    // 写线程写入的文件，写入出错后剩余的请求体直接丢弃
+    std::shared_ptr<WriteFile> m_file;
+    uint64_t m_bytes;
+    bool m_finished;
+    // commit的参数，写线程完成后调用
+    double m_duration;
+    write_callback m_published;
+    write_callback m_durable;
+    void *m_ctx;
+    TsIndexer m_indexer;
+    // 整段录像模式，以及预留的位置和长度
+    bool m_archive;
+    uint64_t m_offset;
+    uint64_t m_length;
+    // CMAF模式，接收到的TS数据和转换结果
+    bool m_cmaf;
+    std::string m_ts;
+    std::string m_map;
+    std::string m_resolution;
+    uint64_t m_stored;
+
+    // 低延迟直播，没有发布时m_live为空，m_upload是播放列表分配的上传编号
+    std::shared_ptr<LivePlaylist> m_live;
+    uint64_t m_upload;
+    int64_t m_partTicks;
+    // 当前部分切片的数据，从切片的m_partStart处开始
+    std::string m_part;
+    uint64_t m_partStart;
+    // 当前部分切片第一帧的DTS，以及是否是关键帧
+    int64_t m_partDts;
+    bool m_partKey;
+    // 已经发布的部分切片的总时长
+    double m_partSum;
+    // 已经处理过的帧数以及最后一帧
+    size_t m_frames;
+    TsFrame m_lastFrame;
+
+    // 检查新扫描到的帧，凑够一个部分切片就发布
+    void cut_parts();
+    void cut(const TsFrame &at);
+
+    // 写线程中调用
+    static void on_published(WriteFile *file, void *ctx, int status);
+    static void on_durable(WriteFile *file, void *ctx, int status);
+    static void on_discarded(WriteFile *file, void *ctx, int status);
+};
+
+pthread_mutex_t UploadSink::archive_lock = PTHREAD_MUTEX_INITIALIZER;
+std::unordered_map<std::string, uint64_t> UploadSink::archive_end;
+
+UploadSink::UploadSink(DiskWriter *writer, const std::string &dir, const std::string &filename, bool archive,
+                       bool cmaf)
+    : m_writer(writer), m_dir(dir), m_name(filename), m_path(dir + "/" + (archive ? ARCHIVE_NAME : filename)), m_bytes(0),
+      m_finished(false), m_duration(0), m_published(nullptr), m_durable(nullptr), m_ctx(nullptr), m_archive(archive), m_offset(0), m_length(0), m_cmaf(cmaf && !archive), m_stored(0), m_upload(0), m_partTicks(0), m_partStart(0), m_partDts(-1), m_partKey(false), m_partSum(0), m_frames(0)
+{
+    m_lastFrame.dts = -1;
+    if (m_cmaf)
+        m_path = dir + "/" + filename.substr(0, filename.rfind('.')) + CMAF_SEGMENT_EXT;
+    // 同一个文件可能同时有多个上传，临时文件名不能重复
+    static std::atomic<unsigned long> counter(0);
+    m_tmpPath = dir + "/." + filename + "." + std::to_string(getpid()) + "." +
+                std::to_string(counter++) + ".tmp";
+}
+
+UploadSink::~UploadSink()
+{
+    // 没有接收完整的上传不保留
+    if (!m_finished)
+    {
+        if (m_archive && m_file)
+        {
+            // 预留的是录像文件的最后一段时收回，否则留下一段空洞
+            // 截断排在已经提交的写入之后，之后预留同一位置的上传的写入又排在截断之后
+            pthread_mutex_lock(&archive_lock);
+            uint64_t &end = archive_end[m_path];
+            if (end == m_offset + m_length)
+            {
+                end = m_offset;
+                m_writer->discard(m_file, on_discarded, new uint64_t(m_offset));
+            }
+            pthread_mutex_unlock(&archive_lock);
+        }
+        else if (m_file)
+            m_writer->discard(m_file, nullptr, nullptr); // 写线程删除临时文件
+        if (m_live)
+            m_live->abort(m_upload);
+    }
+}
+
+void UploadSink::publish(std::shared_ptr<LivePlaylist> live)
+{
+    if (live->part_target() <= 0)
+        return;
+    // 这一路流已经有切片在发布部分切片，这个切片上传完成后再整个加入播放列表
+    uint64_t upload = live->begin(m_name);
+    if (upload == 0)
+    {
+        AccessLog::message(LOG_WARN, "%s: 上一个切片还在上传，不发布部分切片", m_name.c_str());
+        return;
+    }
+    m_live = live;
+    m_upload = upload;
+    m_partTicks = (int64_t)(live->part_target() * TS_CLOCK);
+}
+
+int UploadSink::open(uint64_t length)
+{
+    int fd;
+    if (!m_archive)
+        fd = ::open(m_tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    else
+        fd = ::open(m_path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        AccessLog::message(LOG_ERROR, "open %s: %s", (m_archive ? m_path : m_tmpPath).c_str(), strerror(errno));
+        return -1;
+    }
+    if (!m_archive)
+        m_file = std::make_shared<WriteFile>(fd, m_tmpPath, m_path, m_dir);
+    else
+        m_file = std::make_shared<WriteFile>(fd, m_path, "", m_dir);
+    if (m_archive)
+    {
+        pthread_mutex_lock(&archive_lock);
+        auto it = archive_end.find(m_path);
+        if (it == archive_end.end())
+        {
+            // 第一次使用时从文件大小开始追加
+            struct stat st;
+            uint64_t size = fstat(fd, &st) == 0 ? st.st_size : 0;
+            it = archive_end.emplace(m_path, size).first;
+        }
+        m_offset = it->second;
+        m_length = length;
+        it->second += length;
+        pthread_mutex_unlock(&archive_lock);
+    }
+    return 0;
+}
+
+bool UploadSink::write(const char *data, size_t len)
+{
+    m_bytes += len;
+    if (m_file->failed)
+        return false;
+    m_indexer.feed(reinterpret_cast<const uint8_t *>(data), len);
+    if (m_live)
+    {
+        m_part.append(data, len);
+        cut_parts();
+    }
+    if (m_cmaf)
+    {
+        m_ts.append(data, len);
+        return true;
+    }
+    // 整段录像模式写到预留的位置
+    m_writer->write(m_file, m_offset + (m_bytes - len), data, len);
+    return true;
+}
+
+void UploadSink::cut_parts()
+{
+    const std::vector<TsFrame> &frames = m_indexer.index().frames;
+    for (; m_frames < frames.size(); m_frames++)
+    {
+        const TsFrame &f = frames[m_frames];
+        if (m_partDts < 0)
+        {
+            // 第一帧之前的PAT/PMT属于第一个部分切片
+            m_partDts = f.dts;
+            m_partKey = f.key;
+        }
+        // 部分切片的时长不超过PART-TARGET，在不超过它的最后一帧处切开
+        while (f.dts - m_partDts >= m_partTicks)
+        {
+            if (f.dts - m_partDts > m_partTicks && m_lastFrame.dts > m_partDts)
+                cut(m_lastFrame);
+            else
+                cut(f);
+        }
+        m_lastFrame = f;
+    }
+}
+
+void UploadSink::cut(const TsFrame &at)
+{
+    size_t len = at.offset - m_partStart;
+    double duration = (double)(at.dts - m_partDts) / TS_CLOCK;
+    m_live->add_part(m_upload, std::make_shared<const std::string>(m_part, 0, len), duration, m_partKey);
+    m_part.erase(0, len);
+    m_partStart = at.offset;
+    m_partDts = at.dts;
+    m_partKey = at.key;
+    m_partSum += duration;
+}
+
+int UploadSink::commit(double duration, write_callback published, write_callback durable, void *ctx)
+{
+    if (failed() || (m_cmaf && write_cmaf() < 0))
+        return -1;
+    m_duration = duration;
+    m_published = published;
+    m_durable = durable;
+    m_ctx = ctx;
+    m_writer->commit(m_file, on_published, on_durable, this);
+    return 0;
+}
+
+int UploadSink::write_cmaf()
+{
+    static std::atomic<uint32_t> sequence(0);
+    // 每个处理上传的线程一个转换器，重复使用内部的缓冲区
+    static thread_local CmafRepackager repackager;
+    CmafSegment out;
+    if (repackager.repackage(reinterpret_cast<const uint8_t *>(m_ts.data()), m_ts.size(), m_indexer.index(),
+                             ++sequence, out) < 0)
+    {
+        AccessLog::message(LOG_WARN, "无法转换为fMP4: %s", m_name.c_str());
+        return -1;
+    }
+    std::string().swap(m_ts);
+    m_resolution = std::to_string(out.width) + "x" + std::to_string(out.height);
+
+    // 初始化段按内容的FNV-1a哈希命名，内容变化时地址随之变化
+    uint64_t hash = 14695981039346656037ull;
+    for (unsigned char c : out.init)
+        hash = (hash ^ c) * 1099511628211ull;
+    char name[64];
+    snprintf(name, sizeof(name), "init-%016llx" CMAF_INIT_EXT, (unsigned long long)hash);
+    m_map = name;
+    std::string init_path = m_dir + "/" + m_map;
+    struct stat st;
+    if (stat(init_path.c_str(), &st) < 0)
+    {
+        // 同样排在切片之前写入、重命名，切片发布时初始化段已经存在
+        std::string tmp = m_tmpPath + CMAF_INIT_EXT;
+        int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0)
+        {
+            AccessLog::message(LOG_ERROR, "open %s: %s", tmp.c_str(), strerror(errno));
+            return -1;
+        }
+        std::shared_ptr<WriteFile> init = std::make_shared<WriteFile>(fd, tmp, init_path, m_dir);
+        m_writer->write(init, 0, out.init.data(), out.init.size());
+        m_writer->commit(init, nullptr, nullptr, nullptr);
+    }
+    m_stored = out.fragment.size();
+    m_writer->write(m_file, 0, out.fragment.data(), out.fragment.size());
+    return 0;
+}
+
+void UploadSink::on_published(WriteFile *file, void *ctx, int status)
+{
+    UploadSink *sink = static_cast<UploadSink *>(ctx);
+    if (status == 0)
+    {
+        sink->m_finished = true;
+        // 剩下的数据是最后一个部分切片
+        if (sink->m_live && !sink->m_part.empty())
+        {
+            double last = sink->m_duration > sink->m_partSum ? sink->m_duration - sink->m_partSum : 0;
+            sink->m_live->add_part(sink->m_upload, std::make_shared<const std::string>(std::move(sink->m_part)), last,
+                                   sink->m_partKey);
+            sink->m_part.clear();
+        }
+    }
+    else
+        AccessLog::message(LOG_ERROR, "无法保存文件%s!", sink->m_path.c_str());
+    if (sink->m_published != nullptr)
+        sink->m_published(file, sink->m_ctx, status);
+}
+
+void UploadSink::on_durable(WriteFile *file, void *ctx, int status)
+{
+    // 回调之后连接可能已经释放，不能再访问sink
+    UploadSink *sink = static_cast<UploadSink *>(ctx);
+    if (sink->m_durable != nullptr)
+        sink->m_durable(file, sink->m_ctx, status);
+}
+
+void UploadSink::on_discarded(WriteFile *file, void *ctx, int status)
+{
+    (void)status;
+    uint64_t *offset = static_cast<uint64_t *>(ctx);
+    ftruncate(file->fd, *offset);
+    delete offset;
+}
+
+#endif
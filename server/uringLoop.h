@@ -0,0 +1,565 @@
+#ifndef _URINGLOOP_H
+#define _URINGLOOP_H
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <signal.h>
+#include "eventLoop.h"
+
+#define URING_ENTRIES 1024      // 提交队列的长度，完成队列是它的4倍
+#define URING_BUFFERS 32        // 发送文件用的注册缓冲区个数
+#define URING_CHUNK (128 << 10) // 每个注册缓冲区的大小，也是一次读文件的最大长度
+
+// user_data的低3位是操作类型，其余位是Connection指针
+enum URING_OP
+{
+    UOP_ACCEPT = 1, // 多次触发的accept
+    UOP_EVENTFD,    // 线程池完成通知
+    UOP_RECV,       // 读请求
+    UOP_SEND,       // 发送响应头和内存中的响应体
+    UOP_READ,       // 把文件读到注册缓冲区
+    UOP_FILESEND,   // 发送注册缓冲区中的文件内容
+};
+
+// 基于io_uring的事件循环，和EventLoop使用同样的请求处理函数和连接状态机
+// 区别在于所有的网络读写都以异步请求的形式提交，每轮事件循环只调用一次io_uring_enter：
+// - 监听socket上挂一个多次触发的accept，每个新连接一个完成事件
+// - 文件内容通过 READ_FIXED -> SEND 的链接请求发送，数据先读到预先注册的缓冲区，
+//   不需要每次把用户态内存映射进内核
+// - 关闭连接时先shutdown让进行中的请求失败返回，所有请求都完成后才close，fd号不会被提前复用
+// 不使用liburing，直接通过系统调用操作提交队列和完成队列
+class UringLoop : public EventLoop
+{
+public:
+    UringLoop(int listen_fd, ThreadPool *pool, conn_handler handler,
+              int idle_timeout = IDLE_TIMEOUT, int max_requests = MAX_REQUESTS);
+    ~UringLoop();
+
+    // 内核是否支持需要的io_uring特性，不支持时应该改用EventLoop
+    bool ok() const { return m_ringfd >= 0; }
+    void run() override;
+
+protected:
+    void on_readable(Connection *conn) override;
+    void on_writable(Connection *conn) override;
+    void close_fd(Connection *conn) override;
+
+private:
+    // 确保提交队列中至少还有n个空位，链接的请求必须在同一次提交中
+    void reserve(unsigned n);
+    struct io_uring_sqe *get_sqe(uint64_t user_data);
+    // 提交所有准备好的请求，wait为true时等待至少一个完成事件，最多等待1秒
+    int submit(bool wait);
+    void reap();
+    void arm_accept();
+    void arm_eventfd();
+    void on_accepted(int res, uint32_t flags);
+    void on_recv(Connection *conn, int res);
+    void on_send(Connection *conn, int res);
+    void on_file_sent(Connection *conn, int res);
+    // 发送文件的下一段，没有空闲的注册缓冲区时返回false
+    bool send_file_chunk(Connection *conn);
+    void put_buffer(Connection *conn);
+
+    static uint64_t tag(Connection *conn, int op) { return reinterpret_cast<uint64_t>(conn) | op; }
+
+private:
+    int m_ringfd;
+    unsigned m_entries;
+    // 提交队列，m_sqTailLocal是本地准备好的位置，提交时写入共享的m_sqTail
+    unsigned *m_sqHead;
+    unsigned *m_sqTail;
+    unsigned *m_sqMask;
+    struct io_uring_sqe *m_sqes;
+    unsigned m_sqTailLocal;
+    unsigned m_submitted;
+    // 完成队列
+    unsigned *m_cqHead;
+    unsigned *m_cqTail;
+    unsigned *m_cqMask;
+    struct io_uring_cqe *m_cqes;
+    // mmap的区域
+    void *m_sqRing;
+    void *m_cqRing;
+    size_t m_sqRingLen;
+    size_t m_cqRingLen;
+    size_t m_sqesLen;
+    // 是否支持多次触发的accept
+    bool m_multishot;
+    // 注册缓冲区，注册失败时退回普通的READ
+    char *m_bufs;
+    bool m_fixed;
+    std::vector<int> m_freeBufs;
+    // 等待空闲注册缓冲区的连接
+    std::list<Connection *> m_bufWait;
+};
+
+UringLoop::UringLoop(int listen_fd, ThreadPool *pool, conn_handler handler, int idle_timeout, int max_requests)
+    : EventLoop(listen_fd, pool, handler, idle_timeout, max_requests), m_ringfd(-1), m_entries(0),
+      m_sqTailLocal(0), m_submitted(0), m_sqRing(MAP_FAILED), m_cqRing(MAP_FAILED), m_sqesLen(0),
+      m_multishot(true), m_bufs(nullptr), m_fixed(false)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = URING_ENTRIES * 4;
+    int fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (fd < 0)
+    {
+        perror("io_uring_setup");
+        return;
+    }
+    // 等待时需要带超时时间
+    if (!(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_NODROP))
+    {
+        fprintf(stderr, "io_uring: kernel too old\n");
+        close(fd);
+        return;
+    }
+
+    m_sqRingLen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    m_cqRingLen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        m_sqRingLen = m_cqRingLen = m_sqRingLen > m_cqRingLen ? m_sqRingLen : m_cqRingLen;
+    m_sqRing = mmap(NULL, m_sqRingLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (m_sqRing != MAP_FAILED)
+        m_cqRing = (p.features & IORING_FEAT_SINGLE_MMAP)
+                       ? m_sqRing
+                       : mmap(NULL, m_cqRingLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    m_sqesLen = p.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = m_cqRing == MAP_FAILED ? MAP_FAILED : mmap(NULL, m_sqesLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+    {
+        perror("io_uring mmap");
+        close(fd);
+        return;
+    }
+
+    char *sq = static_cast<char *>(m_sqRing);
+    char *cq = static_cast<char *>(m_cqRing);
+    m_sqHead = reinterpret_cast<unsigned *>(sq + p.sq_off.head);
+    m_sqTail = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+    m_sqMask = reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+    m_sqes = static_cast<struct io_uring_sqe *>(sqes);
+    m_cqHead = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+    m_cqTail = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+    m_cqMask = reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+    m_cqes = reinterpret_cast<struct io_uring_cqe *>(cq + p.cq_off.cqes);
+    m_entries = p.sq_entries;
+    m_sqTailLocal = m_submitted = *m_sqTail;
+    // 提交队列的索引数组和sqe一一对应，以后不再修改
+    unsigned *array = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+    for (unsigned i = 0; i < m_entries; i++)
+        array[i] = i;
+    m_ringfd = fd;
+
+    // 注册发送文件用的缓冲区
+    size_t total = (size_t)URING_BUFFERS * URING_CHUNK;
+    void *bufs = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (bufs == MAP_FAILED)
+    {
+        perror("mmap");
+        return;
+    }
+    m_bufs = static_cast<char *>(bufs);
+    struct iovec iov[URING_BUFFERS];
+    for (int i = 0; i < URING_BUFFERS; i++)
+    {
+        iov[i].iov_base = m_bufs + (size_t)i * URING_CHUNK;
+        iov[i].iov_len = URING_CHUNK;
+        m_freeBufs.push_back(URING_BUFFERS - 1 - i);
+    }
+    m_fixed = syscall(__NR_io_uring_register, m_ringfd, IORING_REGISTER_BUFFERS, iov, URING_BUFFERS) == 0;
+    if (!m_fixed)
+        perror("io_uring register buffers");
+}
+
+UringLoop::~UringLoop()
+{
+    if (m_ringfd >= 0)
+    {
+        munmap(m_sqes, m_sqesLen);
+        if (m_cqRing != m_sqRing)
+            munmap(m_cqRing, m_cqRingLen);
+        munmap(m_sqRing, m_sqRingLen);
+        close(m_ringfd);
+    }
+    if (m_bufs != nullptr)
+        munmap(m_bufs, (size_t)URING_BUFFERS * URING_CHUNK);
+}
+
+void UringLoop::reserve(unsigned n)
+{
+    unsigned head = __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+    if (m_sqTailLocal + n - head > m_entries)
+        submit(false);
+}
+
+struct io_uring_sqe *UringLoop::get_sqe(uint64_t user_data)
+{
+    reserve(1);
+    struct io_uring_sqe *sqe = &m_sqes[m_sqTailLocal & *m_sqMask];
+    m_sqTailLocal++;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = user_data;
+    return sqe;
+}
+
+int UringLoop::submit(bool wait)
+{
+    __atomic_store_n(m_sqTail, m_sqTailLocal, __ATOMIC_RELEASE);
+    unsigned n = m_sqTailLocal - m_submitted;
+    if (n == 0 && !wait)
+        return 0;
+
+    struct __kernel_timespec ts;
+    ts.tv_sec = wait_ms() / 1000;
+    ts.tv_nsec = (wait_ms() % 1000) * 1000000ll;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.sigmask_sz = _NSIG / 8;
+    arg.ts = reinterpret_cast<uint64_t>(&ts);
+    unsigned flags = wait ? IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG : 0;
+    int ret = syscall(__NR_io_uring_enter, m_ringfd, n, wait ? 1 : 0, flags,
+                      wait ? &arg : NULL, wait ? sizeof(arg) : 0);
+    count_syscall();
+    if (ret < 0)
+        return -errno;
+    m_submitted += ret;
+    return ret;
+}
+
+void UringLoop::run()
+{
+    if (m_ringfd < 0)
+    {
+        EventLoop::run();
+        return;
+    }
+    arm_accept();
+    arm_eventfd();
+    while (true)
+    {
+        // 提交上一轮产生的所有请求，同时等待完成事件
+        int ret = submit(true);
+        if (ret < 0 && ret != -EINTR && ret != -ETIME && ret != -EBUSY && ret != -EAGAIN)
+        {
+            errno = -ret;
+            perror("io_uring_enter");
+            return;
+        }
+        bool tick = update_clock();
+        reap();
+        after_events(tick);
+    }
+}
+
+void UringLoop::reap()
+{
+    unsigned head = *m_cqHead;
+    while (true)
+    {
+        unsigned tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+        if (head == tail)
+            break;
+        for (; head != tail; head++)
+        {
+            struct io_uring_cqe *cqe = &m_cqes[head & *m_cqMask];
+            uint64_t data = cqe->user_data;
+            int res = cqe->res;
+            uint32_t flags = cqe->flags;
+            Connection *conn = reinterpret_cast<Connection *>(data & ~(uint64_t)7);
+            switch (data & 7)
+            {
+            case UOP_ACCEPT:
+                on_accepted(res, flags);
+                break;
+            case UOP_EVENTFD:
+                on_complete();
+                if (!(flags & IORING_CQE_F_MORE))
+                    arm_eventfd();
+                break;
+            case UOP_RECV:
+                on_recv(conn, res);
+                break;
+            case UOP_SEND:
+                on_send(conn, res);
+                break;
+            case UOP_READ:
+                // 读取失败或者文件被截断时，链接的SEND会以-ECANCELED结束，在那里处理
+                conn->io_pending--;
+                break;
+            case UOP_FILESEND:
+                on_file_sent(conn, res);
+                break;
+            }
+        }
+        // 处理过程中可能产生了新的完成事件，一并处理
+        __atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+    }
+}
+
+void UringLoop::arm_accept()
+{
+    struct io_uring_sqe *sqe = get_sqe(tag(nullptr, UOP_ACCEPT));
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = m_listenfd;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    if (m_multishot)
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+void UringLoop::arm_eventfd()
+{
+    struct io_uring_sqe *sqe = get_sqe(tag(nullptr, UOP_EVENTFD));
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = m_eventfd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+}
+
+void UringLoop::on_accepted(int res, uint32_t flags)
+{
+    if (res >= 0)
+    {
+        on_readable(add_conn(res));
+    }
+    else if (res == -EINVAL && m_multishot)
+    {
+        // 内核不支持多次触发的accept，改为每次接收一个
+        m_multishot = false;
+    }
+    else if (res != -EINTR && res != -ECONNABORTED && res != -EAGAIN)
+    {
+        AccessLog::message(LOG_ERROR, "accept error: %s", strerror(-res));
+    }
+    if (!(flags & IORING_CQE_F_MORE))
+        arm_accept();
+}
+
+void UringLoop::on_readable(Connection *conn)
+{
+    // 只在等待请求时读，线程池处理期间in不能被修改
+    if (conn->state != CONN_READING || conn->io_reading)
+        return;
+    // 写线程积压时不再读取请求体，由TCP的流量控制让推流端放慢
+    if (conn->sink != nullptr && !conn->sink->ready())
+    {
+        pause(conn);
+        return;
+    }
+    conn->io_in_base = conn->in.size();
+    conn->in.resize(conn->io_in_base + READ_CHUNK);
+    struct io_uring_sqe *sqe = get_sqe(tag(conn, UOP_RECV));
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->addr = reinterpret_cast<uint64_t>(&conn->in[conn->io_in_base]);
+    sqe->len = READ_CHUNK;
+    conn->io_reading = true;
+    conn->io_pending++;
+}
+
+void UringLoop::on_recv(Connection *conn, int res)
+{
+    conn->io_reading = false;
+    conn->io_pending--;
+    conn->in.resize(conn->io_in_base + (res > 0 ? res : 0));
+    if (conn->state == CONN_CLOSED)
+        return;
+    if (res > 0)
+    {
+        count_in(res);
+        touch(conn);
+        if (request_ready(conn))
+            dispatch(conn);
+        // 请求还不完整，或者请求体正在流式接收
+        if (conn->state == CONN_READING)
+            on_readable(conn);
+        return;
+    }
+    if (res == -EINTR || res == -EAGAIN)
+    {
+        on_readable(conn);
+        return;
+    }
+    // 对端关闭或者出错
+    close_conn(conn);
+}
+
+void UringLoop::on_writable(Connection *conn)
+{
+    if (conn->state != CONN_WRITING || conn->io_writing)
+        return;
+
+    // 先发送响应头和内存中的响应体，后面还有文件内容时带上MSG_MORE
+    size_t body_size = conn->body ? (conn->body_end > 0 ? conn->body_end : conn->body->size()) : 0;
+    bool more_file = conn->file_fd >= 0 && conn->file_pos < conn->file_end;
+    if (conn->out_pos < conn->out.size() || conn->body_pos < body_size)
+    {
+        struct msghdr &msg = conn->io_msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = conn->io_iov;
+        if (conn->out_pos < conn->out.size())
+        {
+            conn->io_iov[msg.msg_iovlen].iov_base = (void *)(conn->out.data() + conn->out_pos);
+            conn->io_iov[msg.msg_iovlen++].iov_len = conn->out.size() - conn->out_pos;
+        }
+        if (conn->body_pos < body_size)
+        {
+            conn->io_iov[msg.msg_iovlen].iov_base = (void *)(conn->body->data() + conn->body_pos);
+            conn->io_iov[msg.msg_iovlen++].iov_len = body_size - conn->body_pos;
+        }
+        struct io_uring_sqe *sqe = get_sqe(tag(conn, UOP_SEND));
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = conn->fd;
+        sqe->addr = reinterpret_cast<uint64_t>(&msg);
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL | (more_file ? MSG_MORE : 0);
+        conn->io_writing = true;
+        conn->io_pending++;
+        return;
+    }
+
+    // 再发送文件内容
+    if (more_file)
+    {
+        if (!send_file_chunk(conn))
+        {
+            // 注册缓冲区都在使用中，等其他连接归还，期间连接不能被释放
+            conn->io_writing = true;
+            conn->io_pending++;
+            m_bufWait.push_back(conn);
+        }
+        return;
+    }
+
+    finish_response(conn);
+}
+
+void UringLoop::on_send(Connection *conn, int res)
+{
+    conn->io_writing = false;
+    conn->io_pending--;
+    if (conn->state == CONN_CLOSED)
+        return;
+    if (res <= 0)
+    {
+        close_conn(conn);
+        return;
+    }
+    count_out(conn, res);
+    size_t head = conn->out.size() - conn->out_pos;
+    if ((size_t)res <= head)
+    {
+        conn->out_pos += res;
+    }
+    else
+    {
+        conn->out_pos = conn->out.size();
+        conn->body_pos += res - head;
+    }
+    touch(conn);
+    on_writable(conn);
+}
+
+bool UringLoop::send_file_chunk(Connection *conn)
+{
+    if (m_freeBufs.empty())
+        return false;
+    int idx = m_freeBufs.back();
+    m_freeBufs.pop_back();
+    char *buf = m_bufs + (size_t)idx * URING_CHUNK;
+    size_t len = conn->file_end - conn->file_pos;
+    if (len > URING_CHUNK)
+        len = URING_CHUNK;
+    conn->io_buf = idx;
+    conn->io_buf_pos = 0;
+    conn->io_buf_len = len;
+
+    // 读文件和发送链接在一起，读完整后内核直接开始发送，中间不需要回到用户态
+    reserve(2);
+    struct io_uring_sqe *sqe = get_sqe(tag(conn, UOP_READ));
+    sqe->opcode = m_fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = conn->file_fd;
+    sqe->addr = reinterpret_cast<uint64_t>(buf);
+    sqe->len = len;
+    sqe->off = conn->file_pos;
+    sqe->buf_index = m_fixed ? idx : 0;
+    sqe->flags = IOSQE_IO_LINK;
+
+    sqe = get_sqe(tag(conn, UOP_FILESEND));
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->fd;
+    sqe->addr = reinterpret_cast<uint64_t>(buf);
+    sqe->len = len;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+
+    conn->io_writing = true;
+    conn->io_pending += 2;
+    return true;
+}
+
+void UringLoop::on_file_sent(Connection *conn, int res)
+{
+    conn->io_pending--;
+    if (conn->state == CONN_CLOSED || res <= 0)
+    {
+        // 连接已经关闭，或者读文件失败、发送失败
+        put_buffer(conn);
+        conn->io_writing = false;
+        if (conn->state != CONN_CLOSED)
+            close_conn(conn);
+        return;
+    }
+    count_out(conn, res);
+    conn->io_buf_pos += res;
+    conn->file_pos += res;
+    touch(conn);
+    if (conn->io_buf_pos < conn->io_buf_len)
+    {
+        // 只发送了一部分，继续发送缓冲区中剩下的数据
+        struct io_uring_sqe *sqe = get_sqe(tag(conn, UOP_FILESEND));
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = conn->fd;
+        sqe->addr = reinterpret_cast<uint64_t>(m_bufs + (size_t)conn->io_buf * URING_CHUNK + conn->io_buf_pos);
+        sqe->len = conn->io_buf_len - conn->io_buf_pos;
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        conn->io_pending++;
+        return;
+    }
+    put_buffer(conn);
+    conn->io_writing = false;
+    on_writable(conn);
+}
+
+void UringLoop::put_buffer(Connection *conn)
+{
+    if (conn->io_buf < 0)
+        return;
+    m_freeBufs.push_back(conn->io_buf);
+    conn->io_buf = -1;
+    // 唤醒一个等待缓冲区的连接
+    while (!m_bufWait.empty() && !m_freeBufs.empty())
+    {
+        Connection *next = m_bufWait.front();
+        m_bufWait.pop_front();
+        next->io_pending--;
+        next->io_writing = false;
+        if (next->state == CONN_WRITING)
+        {
+            on_writable(next);
+            break;
+        }
+    }
+}
+
+void UringLoop::close_fd(Connection *conn)
+{
+    // 进行中的recv和send会立即失败返回，fd等连接释放时再关闭
+    count_syscall();
+    shutdown(conn->fd, SHUT_RDWR);
+}
+
+#endif